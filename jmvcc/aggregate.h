@@ -0,0 +1,444 @@
+/* aggregate.h                                                     -*- C++ -*-
+   Jeremy Barnes, 26 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Aggregates over a group of versioned objects, maintained incrementally.
+*/
+
+#ifndef __jmvcc__aggregate_h__
+#define __jmvcc__aggregate_h__
+
+#include "transaction.h"
+#include "versioned.h"
+#include "versioned2.h"
+#include <set>
+#include <map>
+#include <algorithm>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* AGGREGATE_BASE                                                            */
+/*****************************************************************************/
+
+/** Interface through which a commit updates the aggregates and indexes in
+    its domain.  All of these are called with the domain's commit lock held,
+    before the sandbox is prepared. */
+
+struct Aggregate_Base {
+    virtual ~Aggregate_Base() {}
+
+    /// Start collecting the changes made by a commit
+    virtual void begin_collect() = 0;
+
+    /// The commit writes the given value to the given object.  Returns true
+    /// if it is one of our members.
+    virtual bool collect(const Versioned_Object * obj, const void * value) = 0;
+
+    /// Put the new value of the aggregate into the sandbox.  Only called if
+    /// collect() returned true for some object.
+    virtual void end_collect(Sandbox & sandbox) = 0;
+
+    /// The given object is being destroyed.  If it's one of our members,
+    /// mark it to be taken out by the next commit that collects us.  Called
+    /// with the commit lock held, from the object's destructor, so it can't
+    /// commit anything itself.
+    virtual void forget(const Versioned_Object * obj) throw () = 0;
+
+    /// Can the epochs that we keep be renamed by compress_epochs()?
+    virtual bool can_compress_epochs() const { return true; }
+
+protected:
+    /// Keep count of the aggregates that an object is a member of, and
+    /// not being taken out of, so that its destructor knows whether to call
+    /// forget().  Must be called with the commit lock held.
+    static void count_member(const Versioned_Object * obj, int delta)
+    {
+        const_cast<Versioned_Object *>(obj)->num_aggregates_ += delta;
+    }
+};
+
+
+/*****************************************************************************/
+/* AGGREGATE_VALUE                                                           */
+/*****************************************************************************/
+
+/// The value of an aggregate at a given epoch
+
+template<typename T>
+struct Aggregate_Value {
+    Aggregate_Value()
+        : sum(), count(0), min(), max()
+    {
+    }
+
+    T sum;
+    size_t count;   ///< Number of members
+    T min;          ///< T() if there are no members
+    T max;
+};
+
+template<typename T>
+std::ostream &
+operator << (std::ostream & stream, const Aggregate_Value<T> & value)
+{
+    return stream << "sum " << value.sum << " count " << value.count
+                  << " min " << value.min << " max " << value.max;
+}
+
+
+/*****************************************************************************/
+/* AGGREGATE                                                                 */
+/*****************************************************************************/
+
+/** The sum, count, minimum and maximum of the values of a group of
+    Versioned<T> or Versioned2<T> objects, kept up to date by the commits
+    that write them.
+
+    Reading the aggregate in a transaction costs the same as reading a
+    single object, and gives the value as of the transaction's snapshot.
+    A transaction's own uncommitted writes aren't reflected.
+
+    Each commit that writes a member works out the change to the aggregate
+    from its write set, with the commit lock held, and commits the new
+    value of the aggregate in the same epoch as the members.  The new value
+    is derived from the latest committed values rather than those in the
+    transaction's snapshot, so commits that write different members still
+    don't conflict with each other.
+
+    Sums are updated from the difference between the old and new values.
+    The minimum and maximum are kept in an ordered set of the members'
+    committed values.
+
+    A member is taken out again with remove(), which commits a new value of
+    the aggregate without it.  A member that is destroyed while it's still
+    in the group is only marked by its destructor, and is taken out by the
+    next commit that writes a member or the aggregate; until then, its last
+    value still counts.
+*/
+
+template<typename T>
+struct Aggregate
+    : public Versioned<Aggregate_Value<T> >, public Aggregate_Base {
+
+    typedef Aggregate_Value<T> Value;
+    typedef Versioned<Value> Base;
+
+    explicit Aggregate(Domain & domain = default_domain)
+        : Base(domain)
+    {
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+        domain.aggregates.push_back(this);
+    }
+
+    ~Aggregate()
+    {
+        Domain & domain = this->domain();
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+        domain.aggregates.erase(std::find(domain.aggregates.begin(),
+                                          domain.aggregates.end(),
+                                          this));
+        for (typename Members::const_iterator it = members.begin();
+             it != members.end();  ++it)
+            if (!it->second.removing) count_member(it->first, -1);
+    }
+
+    /** Add an object to the group.  This commits a transaction of its own,
+        which rewrites the object's current value so that it is counted in
+        the same epoch as everything else. */
+    template<typename Lock>
+    void add(Versioned<T, Lock> & obj)
+    {
+        add_member(obj);
+    }
+
+    void add(Versioned2<T> & obj)
+    {
+        add_member(obj);
+    }
+
+    /** Take an object out of the group.  This commits a transaction of its
+        own, and the object no longer counts from that epoch on. */
+    template<typename Lock>
+    void remove(Versioned<T, Lock> & obj)
+    {
+        remove_member(&obj);
+    }
+
+    void remove(Versioned2<T> & obj)
+    {
+        remove_member(&obj);
+    }
+
+    /// Value in the current transaction's snapshot
+    Value read() const { return Base::read(); }
+
+    T sum() const { return read().sum; }
+    size_t count() const { return read().count; }
+
+    /// Smallest and largest values of the members.  Throw if there are none.
+    T min() const { return nonempty(read()).min; }
+    T max() const { return nonempty(read()).max; }
+
+    /* Aggregate_Base interface. */
+
+    virtual void begin_collect()
+    {
+        pending.clear();
+    }
+
+    virtual bool collect(const Versioned_Object * obj, const void * value)
+    {
+        // Written by remove_member(), to take out what's been removed.
+        // What it wrote is replaced by the value from end_collect().
+        if (obj == this) return true;
+
+        typename Members::const_iterator it = members.find(obj);
+        if (it == members.end()) return false;
+        pending.push_back(Change(obj, *reinterpret_cast<const T *>(value)));
+        return true;
+    }
+
+    virtual void end_collect(Sandbox & sandbox)
+    {
+        Value result = committed;
+
+        std::vector<T> removed;
+
+        for (unsigned i = 0;  i < removing.size();  ++i) {
+            const Member & member = members[removing[i]];
+            if (!member.counted) continue;
+            result.sum -= member.value;
+            --result.count;
+            removed.push_back(member.value);
+        }
+
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            const Member & member = members[pending[i].first];
+            const T & new_value = pending[i].second;
+            if (member.removing) continue;
+            if (member.counted) {
+                result.sum += new_value - member.value;
+                removed.push_back(member.value);
+            }
+            else {
+                result.sum += new_value;
+                ++result.count;
+            }
+        }
+
+        // The new minimum is the smallest of the new values and the
+        // remaining old ones.  Only as many old values as were removed need
+        // to be skipped to find it.
+        std::sort(removed.begin(), removed.end());
+        bool have_min = false, have_max = false;
+        T min = T(), max = T();
+
+        {
+            std::vector<T> skip = removed;
+            for (typename Values::const_iterator it = values.begin();
+                 it != values.end();  ++it) {
+                typename std::vector<T>::iterator sit
+                    = std::lower_bound(skip.begin(), skip.end(), *it);
+                if (sit != skip.end() && !(*it < *sit)) {
+                    skip.erase(sit);
+                    continue;
+                }
+                min = *it;
+                have_min = true;
+                break;
+            }
+        }
+
+        {
+            std::vector<T> skip = removed;
+            for (typename Values::const_reverse_iterator it = values.rbegin();
+                 it != values.rend();  ++it) {
+                typename std::vector<T>::iterator sit
+                    = std::lower_bound(skip.begin(), skip.end(), *it);
+                if (sit != skip.end() && !(*it < *sit)) {
+                    skip.erase(sit);
+                    continue;
+                }
+                max = *it;
+                have_max = true;
+                break;
+            }
+        }
+
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            if (members[pending[i].first].removing) continue;
+            const T & new_value = pending[i].second;
+            if (!have_min || new_value < min) min = new_value;
+            if (!have_max || max < new_value) max = new_value;
+            have_min = have_max = true;
+        }
+
+        result.min = min;
+        result.max = max;
+
+        staged = result;
+        *sandbox.local_value<Value>(this, result) = result;
+    }
+
+    virtual void forget(const Versioned_Object * obj) throw ()
+    {
+        typename Members::iterator it = members.find(obj);
+        if (it != members.end()) mark_removing(it);
+    }
+
+    /* Versioned_Object interface. */
+
+    virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
+    {
+        // Our new value was worked out from the latest committed values
+        // with the commit lock held, so it can't conflict with anything
+        return Base::setup(new_epoch - 1, new_epoch, data);
+    }
+
+    virtual void commit(Epoch new_epoch) throw ()
+    {
+        // The changes are now permanent
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            Member & member = members[pending[i].first];
+            const T & new_value = pending[i].second;
+            if (member.removing) continue;
+            if (member.counted)
+                values.erase(values.find(member.value));
+            values.insert(new_value);
+            member.value = new_value;
+            member.counted = true;
+        }
+        pending.clear();
+
+        for (unsigned i = 0;  i < removing.size();  ++i) {
+            typename Members::iterator it = members.find(removing[i]);
+            if (it->second.counted)
+                values.erase(values.find(it->second.value));
+            members.erase(it);
+        }
+        removing.clear();
+
+        committed = staged;
+
+        Base::commit(new_epoch);
+    }
+
+    virtual void rollback(Epoch new_epoch, void * data) throw ()
+    {
+        pending.clear();
+        Base::rollback(new_epoch, data);
+    }
+
+private:
+    // Aggregates can't be written directly
+    using Base::mutate;
+    using Base::write;
+
+    struct Member {
+        Member()
+            : value(), counted(false), removing(false)
+        {
+        }
+
+        T value;        ///< Latest committed value
+        bool counted;   ///< Has it been included yet?
+        bool removing;  ///< Taken out by the next commit that collects us
+    };
+
+    /// All of these are protected by the domain's commit lock
+    typedef std::map<const Versioned_Object *, Member> Members;
+    Members members;
+
+    typedef std::multiset<T> Values;
+    Values values;
+
+    typedef std::pair<const Versioned_Object *, T> Change;
+    std::vector<Change> pending;
+
+    /// Members to take out, until a commit has done so.  There's always
+    /// room for all of the members, so that forget() can't fail.
+    std::vector<const Versioned_Object *> removing;
+
+    /// Latest committed value, and the one being committed
+    Value committed, staged;
+
+    template<typename Var>
+    void add_member(Var & obj)
+    {
+        if (&obj.domain() != &this->domain())
+            throw ML::Exception("Aggregate: member is in a different domain");
+
+        for (;;) {
+            ACE_Guard<ACE_Mutex> guard(this->domain().commit_lock);
+            typename Members::iterator it = members.find(&obj);
+            if (it == members.end()) {
+                removing.reserve(members.size() + 1);
+                members.insert(std::make_pair(&obj, Member()));
+                count_member(&obj, 1);
+                break;
+            }
+            if (!it->second.removing)
+                throw ML::Exception("Aggregate: object added twice");
+
+            // A destroyed member was at the same address, and hasn't been
+            // taken out yet
+            guard.release();
+            take_out_removed();
+        }
+
+        // Rewrite the object's value.  The commit (or any other that
+        // writes the object first) will count it.
+        Local_Transaction trans(this->domain());
+        do {
+            obj.write(obj.read());
+        } while (!trans.commit());
+    }
+
+    void remove_member(const Versioned_Object * obj)
+    {
+        {
+            ACE_Guard<ACE_Mutex> guard(this->domain().commit_lock);
+            typename Members::iterator it = members.find(obj);
+            if (it == members.end() || it->second.removing)
+                throw ML::Exception("Aggregate: object isn't a member");
+            mark_removing(it);
+        }
+
+        take_out_removed();
+    }
+
+    /// Mark a member to be taken out.  Must be called with the commit lock
+    /// held.
+    void mark_removing(typename Members::iterator it) throw ()
+    {
+        if (it->second.removing) return;
+        it->second.removing = true;
+        removing.push_back(it->first);
+        count_member(it->first, -1);
+    }
+
+    /// Write ourself, so that the commit collects us.  It can't conflict,
+    /// and it (or a commit of one of the members that beat it) takes the
+    /// marked members out.
+    void take_out_removed()
+    {
+        Local_Transaction trans(this->domain());
+        do {
+            Base::mutate();
+        } while (!trans.commit());
+    }
+
+    static const Value & nonempty(const Value & value)
+    {
+        if (value.count == 0)
+            throw ML::Exception("Aggregate: no members");
+        return value;
+    }
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__aggregate_h__ */
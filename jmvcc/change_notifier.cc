@@ -0,0 +1,242 @@
+/* change_notifier.cc
+   Jeremy Barnes, 24 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Notification of changes to versioned objects.
+*/
+
+#include "change_notifier.h"
+#include "snapshot.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/atomic_ops.h"
+#include "futex.h"
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <algorithm>
+#include <climits>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* CHANGE_NOTIFIER                                                           */
+/*****************************************************************************/
+
+Change_Notifier::
+Change_Notifier(Domain & domain, int num_threads)
+    : domain(domain), next_id(1), in_progress(0), shutdown(false),
+      queue_changes(0), idle_changes(0), batches_delivered_(0)
+{
+    if (num_threads < 1)
+        throw Exception("Change_Notifier: need at least one thread");
+
+    {
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+        if (domain.notifier)
+            throw Exception("Change_Notifier: domain already has a notifier");
+        domain.notifier = this;
+    }
+
+    for (int i = 0;  i < num_threads;  ++i)
+        threads.create_thread(boost::bind(&Change_Notifier::run_thread, this));
+}
+
+Change_Notifier::
+~Change_Notifier()
+{
+    {
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+        domain.notifier = 0;
+    }
+
+    {
+        ACE_Guard<ACE_Mutex> guard(queue_lock);
+        shutdown = true;
+        ++queue_changes;
+    }
+    futex_wake(queue_changes, INT_MAX);
+
+    threads.join_all();
+}
+
+int
+Change_Notifier::
+subscribe(const Versioned_Object & obj, const Callback & callback)
+{
+    return subscribe(Objects(1, &obj), callback);
+}
+
+int
+Change_Notifier::
+subscribe(const Objects & objects, const Callback & callback)
+{
+    ACE_Guard<ACE_Mutex> guard(subscribers_lock);
+
+    int id = next_id++;
+
+    Subscriber & subscriber = subscribers[id];
+    subscriber.callback = callback;
+    subscriber.objects = objects;
+    std::sort(subscriber.objects.begin(), subscriber.objects.end());
+    subscriber.objects.erase(std::unique(subscriber.objects.begin(),
+                                         subscriber.objects.end()),
+                             subscriber.objects.end());
+
+    for (unsigned i = 0;  i < subscriber.objects.size();  ++i)
+        by_object[subscriber.objects[i]].push_back(id);
+
+    return id;
+}
+
+void
+Change_Notifier::
+unsubscribe(int id)
+{
+    ACE_Guard<ACE_Mutex> guard(subscribers_lock);
+
+    map<int, Subscriber>::iterator it = subscribers.find(id);
+    if (it == subscribers.end())
+        throw Exception("Change_Notifier::unsubscribe(): unknown id");
+
+    const Objects & objects = it->second.objects;
+    for (unsigned i = 0;  i < objects.size();  ++i) {
+        vector<int> & ids = by_object[objects[i]];
+        ids.erase(std::find(ids.begin(), ids.end(), id));
+        if (ids.empty()) by_object.erase(objects[i]);
+    }
+
+    subscribers.erase(it);
+}
+
+bool
+Change_Notifier::
+collect(Epoch epoch, const Objects & changed)
+{
+    // Map from subscriber id to the index of its notification in the batch
+    map<int, int> index;
+    Batch * batch = 0;
+
+    {
+        ACE_Guard<ACE_Mutex> guard(subscribers_lock);
+
+        for (unsigned i = 0;  i < changed.size();  ++i) {
+            map<const Versioned_Object *, vector<int> >::const_iterator it
+                = by_object.find(changed[i]);
+            if (it == by_object.end()) continue;
+
+            if (!batch) {
+                batch = new Batch();
+                batch->epoch = epoch;
+            }
+
+            const vector<int> & ids = it->second;
+            for (unsigned j = 0;  j < ids.size();  ++j) {
+                bool inserted;
+                map<int, int>::iterator iit;
+                boost::tie(iit, inserted)
+                    = index.insert(make_pair(ids[j],
+                                             batch->notifications.size()));
+                if (inserted) {
+                    batch->notifications.push_back(Notification());
+                    batch->notifications.back().callback
+                        = subscribers[ids[j]].callback;
+                }
+                batch->notifications[iit->second].objects.push_back(changed[i]);
+            }
+        }
+    }
+
+    if (!batch) return false;
+
+    // Queued here, with the commit lock still held, so that batches are
+    // queued in epoch order.  The threads are only woken up later.
+    ACE_Guard<ACE_Mutex> guard(queue_lock);
+    queue.push_back(batch);
+    ++queue_changes;
+
+    return true;
+}
+
+void
+Change_Notifier::
+wake()
+{
+    futex_wake(queue_changes);
+}
+
+void
+Change_Notifier::
+wait_until_idle()
+{
+    ACE_Guard<ACE_Mutex> guard(queue_lock);
+    while (!queue.empty() || in_progress) {
+        int changes = idle_changes;
+        guard.release();
+        futex_wait(idle_changes, changes);
+        guard.acquire();
+    }
+}
+
+void
+Change_Notifier::
+run_thread()
+{
+    ACE_Guard<ACE_Mutex> guard(queue_lock);
+
+    for (;;) {
+        // Anything queued after we read the count changes it, so the wait
+        // returns straight away rather than missing the wakeup
+        while (queue.empty() && !shutdown) {
+            int changes = queue_changes;
+            guard.release();
+            futex_wait(queue_changes, changes);
+            guard.acquire();
+        }
+
+        if (queue.empty()) return;  // shutdown, with nothing left to do
+
+        boost::scoped_ptr<Batch> batch(queue.front());
+        queue.pop_front();
+        ++in_progress;
+
+        // More may have been queued than we were woken up for
+        if (!queue.empty()) futex_wake(queue_changes);
+
+        guard.release();
+        deliver(*batch);
+        guard.acquire();
+
+        --in_progress;
+        if (queue.empty() && !in_progress) {
+            ++idle_changes;
+            futex_wake(idle_changes, INT_MAX);
+        }
+    }
+}
+
+void
+Change_Notifier::
+deliver(Batch & batch)
+{
+    for (unsigned i = 0;  i < batch.notifications.size();  ++i) {
+        Notification & notification = batch.notifications[i];
+        try {
+            notification.callback(batch.epoch, notification.objects);
+        } catch (const std::exception & exc) {
+            cerr << "Change_Notifier: callback threw exception: "
+                 << exc.what() << endl;
+        } catch (...) {
+            cerr << "Change_Notifier: callback threw unknown exception"
+                 << endl;
+        }
+    }
+
+    atomic_add(batches_delivered_, 1);
+}
+
+} // namespace JMVCC
@@ -0,0 +1,137 @@
+/* change_notifier.h                                               -*- C++ -*-
+   Jeremy Barnes, 24 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Notification of changes to versioned objects.
+*/
+
+#ifndef __jmvcc__change_notifier_h__
+#define __jmvcc__change_notifier_h__
+
+#include "jmvcc_defs.h"
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+#include <boost/thread.hpp>
+#include <ace/Mutex.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* CHANGE_NOTIFIER                                                           */
+/*****************************************************************************/
+
+/** Calls back subscribers when the objects that they are interested in are
+    changed by a commit.
+
+    While the commit lock is held, a commit only looks up which subscribers
+    are interested in the objects that it wrote, and queues a single batch
+    for its epoch.  The callbacks themselves are run afterwards by the
+    notifier's own threads, so they never hold up commits, and can start
+    transactions of their own.
+
+    Each subscriber gets at most one call per epoch, with all of the objects
+    that it subscribed to which changed in that epoch.  Batches are queued
+    in epoch order.  With a single thread they are delivered in that order;
+    with more, batches for different epochs may run at the same time.
+
+    A callback that is already queued may still run after its subscriber
+    has been unsubscribed.
+*/
+
+struct Change_Notifier : boost::noncopyable {
+
+    typedef std::vector<const Versioned_Object *> Objects;
+
+    /// Called with the epoch of a commit and the objects that it changed
+    typedef boost::function<void (Epoch, const Objects &)> Callback;
+
+    /** Attach a notifier to the given domain, with the given number of
+        threads to deliver notifications.  Only one notifier can be attached
+        to a domain. */
+    explicit Change_Notifier(Domain & domain = default_domain,
+                             int num_threads = 1);
+
+    /** Detaches from the domain, delivers any notifications that are still
+        queued and stops the threads.  There must be no commits running in
+        the domain at the time. */
+    ~Change_Notifier();
+
+    /// Subscribe to changes to a single object.  Returns an id for
+    /// unsubscribe().
+    int subscribe(const Versioned_Object & obj, const Callback & callback);
+
+    /// Subscribe to changes to any of a set of objects
+    int subscribe(const Objects & objects, const Callback & callback);
+
+    void unsubscribe(int id);
+
+    /// Block until every notification queued so far has been delivered
+    void wait_until_idle();
+
+    /// Number of notification batches delivered so far
+    size_t batches_delivered() const { return batches_delivered_; }
+
+    /* Used by the commit. */
+
+    /// Queue the notifications for a commit.  Called with the commit lock
+    /// held.  Returns true if anything was queued.
+    bool collect(Epoch epoch, const Objects & changed);
+
+    /// Start delivering what was collected.  Called once the commit lock
+    /// has been released.
+    void wake();
+
+private:
+    Domain & domain;
+
+    struct Subscriber {
+        Callback callback;
+        Objects objects;
+    };
+
+    /// Subscribers by id, and the subscriber ids for each object
+    std::map<int, Subscriber> subscribers;
+    std::map<const Versioned_Object *, std::vector<int> > by_object;
+    int next_id;
+    ACE_Mutex subscribers_lock;
+
+    struct Notification {
+        Callback callback;
+        Objects objects;
+    };
+
+    /// All of the notifications for one epoch
+    struct Batch {
+        Epoch epoch;
+        std::vector<Notification> notifications;
+    };
+
+    std::deque<Batch *> queue;
+    int in_progress;             ///< Batches being delivered right now
+    bool shutdown;
+    ACE_Mutex queue_lock;
+
+    /// Incremented under queue_lock whenever a batch is queued or we shut
+    /// down.  The threads sleep on it.
+    volatile int queue_changes;
+
+    /// Incremented under queue_lock whenever the last batch has been
+    /// delivered.  wait_until_idle() sleeps on it.
+    volatile int idle_changes;
+
+    volatile size_t batches_delivered_;
+
+    boost::thread_group threads;
+
+    void run_thread();
+    void deliver(Batch & batch);
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__change_notifier_h__ */
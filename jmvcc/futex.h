@@ -0,0 +1,33 @@
+/* futex.h                                                         -*- C++ -*-
+   Jeremy Barnes, 22 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Thin wrappers around the Linux futex system call.
+*/
+
+#ifndef __jmvcc__futex_h__
+#define __jmvcc__futex_h__
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+namespace JMVCC {
+
+/// Sleep until woken, as long as word still contains the given value.  May
+/// return spuriously, so the caller needs to check the condition again.
+inline void futex_wait(volatile int & word, int value)
+{
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, value, 0, 0, 0);
+}
+
+/// Wake up to the given number of threads waiting on word
+inline void futex_wake(volatile int & word, int num_to_wake = 1)
+{
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, num_to_wake, 0, 0, 0);
+}
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__futex_h__ */
@@ -6,17 +6,27 @@
 */
 
 #include "garbage.h"
+#include "jmvcc_defs.h"
 #include "jml/arch/exception.h"
 #include "spinlock.h"
 #include "jml/arch/cmp_xchg.h"
 #include <ace/Synch.h>
 #include <vector>
+#include <deque>
 #include <iostream>
 #include "jml/utils/hash_map.h"
 #include <set>
 #include "jml/utils/string_functions.h"
 #include "jml/arch/backtrace.h"
 #include "jml/arch/atomic_ops.h"
+#include "futex.h"
+#include <climits>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <pthread.h>
+#include <cstring>
+#include <sched.h>
+#include <stdlib.h>
 
 
 using namespace std;
@@ -77,6 +87,10 @@ namespace JMVCC {
      process, then the cleanup will be run straight away.
    * To make an object that does all of this automatically, use the RCU<>
      template.
+   * To wait until every critical section that is currently active has
+     finished, call synchronize_critical().  To wait until every cleanup
+     scheduled so far has been run, call cleanup_barrier().  Neither can be
+     called from inside a critical section.
 
 
    Implementation
@@ -194,25 +208,192 @@ struct Critical_Info;
 
 
 typedef ACE_Mutex Critical_Lock;
-Critical_Lock critical_lock;
 
-/// Global pointer to the latest critical info structure.  If this pointer is
-/// null, then it means that there are no critical sections active and so
-/// things can be deleted at will.
-Critical_Info * newest_ci = 0;
+/** What every critical section writes as it comes and goes.  It is all
+    protected by the lock, so it goes on the lock's cache line(s) and on no
+    one else's.
+*/
+struct Section_State {
+    Section_State()
+        : newest_ci(0), num_in_critical(0), num_entered(0),
+          num_cleanups_queued(0)
+    {
+    }
 
-typedef vector<boost::function<void ()> > Cleanups;
+    Critical_Lock lock;
+
+    /// Global pointer to the latest critical info structure.  If this
+    /// pointer is null, then it means that there are no critical sections
+    /// active and so things can be deleted at will.
+    Critical_Info * newest_ci;
 
-int num_in_critical = 0;
-int num_cleanups_outstanding = 0;
+    int num_in_critical;
+
+    /// Number of critical sections entered so far.  Read without the lock
+    /// by schedule_cleanup().
+    uint64_t num_entered;
+
+    /// Number of cleanups on the lists of the Critical_Info structures.
+    /// Those on the t_cleanups list of a thread that is still in its
+    /// critical section aren't counted.
+    size_t num_cleanups_queued;
+} JMVCC_CACHE_ALIGNED;
+
+Section_State sections;
+
+typedef vector<boost::function<void ()> > Cleanups;
 
 bool debug_mode = false;
 
-int num_added_local = 0;
-int num_added_newest = 0;
-int num_cleaned_immediately = 0;
+/** A list of cleanups that no critical section can need any more.  It is
+    handed out in chunks of at most max_cleanups_per_call, which can be run
+    by different threads at the same time.  Everything apart from the
+    cleanups themselves is protected by sections.lock; each of those is only
+    touched by the thread that took its chunk.
+*/
+struct Batch {
+    Batch(uint64_t id)
+        : id(id), next(0), in_progress(0)
+    {
+    }
+
+    uint64_t id;
+    Cleanups cleanups;
+    size_t next;          ///< Index of the first cleanup not handed out
+    int in_progress;      ///< Number of chunks being run right now
+
+    bool finished() const
+    {
+        return next == cleanups.size() && in_progress == 0;
+    }
+};
+
+/// Batches of cleanups that haven't finished, by id.  Protected by
+/// sections.lock.  Only used by cleanup_barrier().
+uint64_t next_batch = 1;
+vector<uint64_t> running_batches;
+
+/// Batches with cleanups that haven't been handed out yet, oldest first.
+/// Protected by sections.lock.
+deque<Batch *> ready_batches;
+
+/// Maximum number of cleanups run by one call; zero means no limit
+size_t max_cleanups_per_call = 0;
+
+/** Counters that are read without the lock to find out whether there is
+    cleanup work to do, and that threads moving cleanups around update.
+    They are kept apart from the read-mostly settings around them and from
+    the section state, so that polling them doesn't take those lines away
+    from anyone.
+*/
+struct Queue_State {
+    Queue_State()
+        : num_cleanups_ready(0), cleanup_progress(0), progress_waiters(0)
+    {
+    }
+
+    /// Number of cleanups in ready_batches that haven't been handed out.
+    /// Updated under sections.lock, but read without it as a hint.
+    volatile size_t num_cleanups_ready;
+
+    /// Incremented whenever a chunk of cleanups has been run;
+    /// cleanup_barrier() sleeps on it
+    volatile int cleanup_progress;
+    volatile int progress_waiters;
+} JMVCC_CACHE_ALIGNED;
+
+Queue_State queue;
+
+/** Cleanups scheduled from outside a critical section, sharded by the CPU
+    that scheduled them so that threads doing so don't all serialize on
+    sections.lock and the newest section's list.  Such a cleanup has to
+    wait for the critical sections that were active when it was scheduled,
+    which are those with a serial number below its tag.  It is collected
+    by a critical section leaving on the same CPU, which moves it to the
+    newest of those that is still active, or runs it if there are none.
+    The last section to leave, and every so often any of them, collects
+    the other shards too, so that nothing is left behind on a CPU with no
+    sections of its own.
+
+    Each shard keeps its own count and has a cache line to itself, so that
+    scheduling a cleanup and collecting it only touch that line.  The one
+    shared word, nonempty_shards, only changes when a shard goes from empty
+    to not or back.
+*/
+struct Sharded_Cleanup {
+    Sharded_Cleanup(const Cleanup & cleanup, uint64_t tag)
+        : cleanup(cleanup), tag(tag)
+    {
+    }
+
+    Cleanup cleanup;
+    uint64_t tag;     ///< Value of num_entered when it was scheduled
+};
+
+struct Cleanup_Shard {
+    Cleanup_Shard()
+        : pending(0)
+    {
+    }
+
+    /// The threads that share a shard mostly share a CPU too, so one that
+    /// is waiting for the lock may well have preempted the holder.  The
+    /// ticket lock would then make everyone queue behind whichever waiter
+    /// isn't running; the plain one goes to whoever is.
+    Spinlock lock;
+
+    /// Number of cleanups in the shard.  Updated under the lock, but read
+    /// without it as a hint.
+    volatile int pending;
+
+    vector<Sharded_Cleanup> cleanups;
+} JMVCC_CACHE_ALIGNED;
+
+enum { NUM_SHARDS = 64 };
+Cleanup_Shard shards[NUM_SHARDS];
+
+/// One bit for each shard with something in it.  Set and cleared under the
+/// shard's lock, but read without any lock.
+struct Shard_Mask {
+    Shard_Mask()
+        : nonempty(0)
+    {
+    }
 
+    volatile uint64_t nonempty;
+} JMVCC_CACHE_ALIGNED;
+
+Shard_Mask nonempty_shards;
+
+/// A thread that leaves this many critical sections collects every shard,
+/// and not just its own CPU's
+enum { SHARD_SWEEP_INTERVAL = 64 };
+
+__thread unsigned t_num_left = 0;
+
+size_t cleanup_high_water_mark = 0;
+
+/// Have we reported that we're over the high water mark?  Reset once we've
+/// drained back down.  Protected by sections.lock.
+bool stall_reported = false;
+
+void report_stall_to_cerr(const std::string & message)
+{
+    cerr << message << endl;
+}
+
+Stall_Reporter stall_reporter = report_stall_to_cerr;
+
+/** Counters kept in debug mode.  Every thread that schedules a cleanup
+    updates them atomically, so they have their own line.
+*/
 struct Stats {
+    Stats()
+        : num_cleanups_outstanding(0), num_added_local(0),
+          num_added_newest(0), num_cleaned_immediately(0)
+    {
+    }
+
     ~Stats()
     {
         if (!debug_mode) return;
@@ -222,13 +403,18 @@ struct Stats {
         cerr << "num_cleaned_immediately = "
              << num_cleaned_immediately << endl;
     }
-} stats;
+
+    int num_cleanups_outstanding;
+    int num_added_local;
+    int num_added_newest;
+    int num_cleaned_immediately;
+} JMVCC_CACHE_ALIGNED stats;
 
 struct Critical_Info {
     bool live;
 
     Critical_Info()
-        : live(false), prev(0), next(0)
+        : live(false), prev(0), next(0), thread(pthread_self()), serial(0)
     {
     }
 
@@ -236,16 +422,16 @@ struct Critical_Info {
     {
         if (live)
             throw Exception("insert on live Critical_Info");
-        // Must be called with critical_lock held
+        // Must be called with sections.lock held
 
         // This is the newest one.  Put it in the chain.
-        prev = newest_ci;
+        prev = sections.newest_ci;
         if (prev) {
             if (prev->next != 0)
                 throw Exception("newest_ci->next != 0");
             prev->next = this;
         }
-        newest_ci = this;
+        sections.newest_ci = this;
         next = 0;
         live = true;
     }
@@ -261,14 +447,14 @@ struct Critical_Info {
         if (!live)
             throw Exception("remove on non-live Critical_Info");
 
-        // Must be called with critical_lock held
+        // Must be called with sections.lock held
         if (prev) {
             prev->next = next;
             prev->take_cleanups_from(cleanups);
         }
 
         if (next) next->prev = prev;
-        else newest_ci = prev;
+        else sections.newest_ci = prev;
 
         prev = next = 0;
 
@@ -280,10 +466,13 @@ struct Critical_Info {
     
     Cleanups cleanups;
 
+    pthread_t thread;   ///< Thread that owns this structure
+    uint64_t serial;    ///< Value of sections.num_entered when it was entered
+
     void add_cleanup(Cleanup cleanup)
     {
         cleanups.push_back(cleanup);
-        if (debug_mode) atomic_add(num_cleanups_outstanding, 1);
+        if (debug_mode) atomic_add(stats.num_cleanups_outstanding, 1);
     }
 
     void take_cleanups_from(Cleanups & other_cleanups)
@@ -300,15 +489,6 @@ struct Critical_Info {
         other_cleanups.clear();
     }
 
-    void cleanup()
-    {
-        for (unsigned i = 0;  i != cleanups.size();  ++i)
-            cleanups[i]();
-
-        if (debug_mode) atomic_add(num_cleanups_outstanding, -cleanups.size());
-        
-        cleanups.clear();
-    }
 };
 
 /// Thread-specific data: what is the thread's critical info structure.  Null
@@ -328,6 +508,371 @@ __thread Cleanups * t_cleanups = 0;
 __thread uint32_t t_nesting = 0;
 
 
+/// Critical_Info structures of threads that have exited, ready to be
+/// reused.  Protected by sections.lock.
+vector<Critical_Info *> free_critical_info;
+
+/// Number of Critical_Info structures ever allocated.  Protected by
+/// sections.lock.
+size_t num_critical_info_allocated = 0;
+
+/// Key whose destructor is our hook for a thread exiting
+pthread_key_t thread_exit_key;
+pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+
+void on_thread_exit(void * arg);
+
+void create_thread_exit_key()
+{
+    int res = pthread_key_create(&thread_exit_key, &on_thread_exit);
+    if (res != 0)
+        throw Exception("pthread_key_create: " + string(strerror(res)));
+}
+
+/// Get a Critical_Info structure for this thread, reusing one from a thread
+/// that has exited if we can
+Critical_Info * get_critical_info()
+{
+    pthread_once(&thread_exit_once, &create_thread_exit_key);
+
+    Critical_Info * result = 0;
+    {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
+        if (!free_critical_info.empty()) {
+            result = free_critical_info.back();
+            free_critical_info.pop_back();
+        }
+        else ++num_critical_info_allocated;
+    }
+
+    if (!result) result = new Critical_Info();
+    result->thread = pthread_self();
+
+    // Non-null so that on_thread_exit() is called
+    pthread_setspecific(thread_exit_key, result);
+
+    return result;
+}
+
+/** Each thread that has used a light critical section has a slot, whose
+    sequence number is odd while it is in one.  Reclaimers walk the list
+    without a lock, so slots are never freed; a thread that exits leaves
+    its slot for the next thread to pick up.
+*/
+struct Light_Slot {
+    Light_Slot()
+        : seq(0), owned(1), next(0)
+    {
+    }
+
+    volatile uint32_t seq;
+    volatile int owned;
+    Light_Slot * next;
+} JMVCC_CACHE_ALIGNED;
+
+/// Every slot there has ever been; only ever pushed onto
+Light_Slot * volatile light_slots = 0;
+
+__thread Light_Slot * t_light = 0;
+
+Light_Slot * get_light_slot()
+{
+    pthread_once(&thread_exit_once, &create_thread_exit_key);
+
+    Light_Slot * result = 0;
+    for (Light_Slot * s = light_slots;  s && !result;  s = s->next)
+        if (!s->owned && __sync_bool_compare_and_swap(&s->owned, 0, 1))
+            result = s;
+
+    if (!result) {
+        // Slots are never freed, but operator new needn't give us the
+        // cache line alignment that keeps each one to itself
+        void * mem;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(Light_Slot)))
+            throw Exception("couldn't allocate light critical section slot");
+        result = new (mem) Light_Slot();
+
+        Light_Slot * old;
+        do {
+            old = light_slots;
+            result->next = old;
+        } while (!__sync_bool_compare_and_swap(&light_slots, old, result));
+    }
+
+    // Non-null so that on_thread_exit() is called
+    if (!pthread_getspecific(thread_exit_key))
+        pthread_setspecific(thread_exit_key, result);
+
+    return result;
+}
+
+/** Wait for every light critical section that is in progress to end.
+    Called just before cleanups are run: what they free has already been
+    unlinked, so a light section that starts after this can't get to it.
+*/
+void wait_for_light_readers()
+{
+    // Pairs with the one in enter_light_critical()
+    memory_barrier();
+
+    for (Light_Slot * s = light_slots;  s;  s = s->next) {
+        uint32_t seq = s->seq;
+        if (!(seq & 1)) continue;
+
+        if (s == t_light)
+            throw Exception("cleanups run inside a light critical section");
+
+        for (unsigned spun = 0;  s->seq == seq;  ++spun) {
+            cpu_relax();
+            if (spun == 128) {
+                spun = 0;
+                sched_yield();
+            }
+        }
+    }
+}
+
+int current_shard()
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0) cpu = 0;
+    return cpu % NUM_SHARDS;
+}
+
+uint64_t shard_bit(int shard)
+{
+    return (uint64_t)1 << shard;
+}
+
+/** Add a cleanup to the given shard.  Returns the number of cleanups that
+    are now in it. */
+int push_shard(int i, const Cleanup & cleanup, uint64_t tag)
+{
+    Cleanup_Shard & shard = shards[i];
+    ACE_Guard<Spinlock> guard(shard.lock);
+    shard.cleanups.push_back(Sharded_Cleanup(cleanup, tag));
+    if (shard.pending++ == 0)
+        __sync_fetch_and_or(&nonempty_shards.nonempty, shard_bit(i));
+    return shard.pending;
+}
+
+/** Take everything out of the shards in the given mask and append it to
+    taken.  Only the shards' locks are taken, so sections.lock may be held
+    or not.
+*/
+void collect_shards(uint64_t mask, vector<Sharded_Cleanup> & taken)
+{
+    for (int i = 0;  mask;  ++i, mask >>= 1) {
+        if (!(mask & 1)) continue;
+
+        Cleanup_Shard & shard = shards[i];
+        ACE_Guard<Spinlock> guard(shard.lock);
+        if (!shard.pending) continue;
+
+        if (taken.empty()) taken.swap(shard.cleanups);
+        else {
+            taken.insert(taken.end(),
+                         shard.cleanups.begin(), shard.cleanups.end());
+            shard.cleanups.clear();
+        }
+        shard.pending = 0;
+        __sync_fetch_and_and(&nonempty_shards.nonempty, ~shard_bit(i));
+    }
+}
+
+/** Move cleanups collected from the shards to the newest critical section
+    that was active when each was scheduled, or onto the given list if
+    nothing that could need it is still active.  Must be called with
+    sections.lock held.
+*/
+void distribute_collected(vector<Sharded_Cleanup> & taken, Cleanups & ready)
+{
+    for (unsigned i = 0;  i < taken.size();  ++i) {
+        const Sharded_Cleanup & sc = taken[i];
+
+        Critical_Info * ci = sections.newest_ci;
+        while (ci && ci->serial >= sc.tag)
+            ci = ci->prev;
+
+        if (ci) ci->cleanups.push_back(sc.cleanup);
+        else ready.push_back(sc.cleanup);
+    }
+
+    sections.num_cleanups_queued += taken.size();
+    taken.clear();
+}
+
+/** Hand out the next chunk of up to max cleanups (all of them if max is
+    zero) from the given batch, which must be on ready_batches.  Must be
+    called with sections.lock held.  The chunk is [begin, end).
+*/
+void take_chunk(Batch * batch, size_t max, size_t & begin, size_t & end)
+{
+    begin = batch->next;
+    size_t left = batch->cleanups.size() - begin;
+    end = begin + (max && max < left ? max : left);
+    batch->next = end;
+    ++batch->in_progress;
+
+    if (end == batch->cleanups.size())
+        ready_batches.erase(std::find(ready_batches.begin(),
+                                      ready_batches.end(),
+                                      batch));
+
+    queue.num_cleanups_ready -= end - begin;
+    sections.num_cleanups_queued -= end - begin;
+    if (sections.num_cleanups_queued <= cleanup_high_water_mark / 2)
+        stall_reported = false;
+}
+
+/** Make a batch of the given cleanups, which no critical section can need
+    any more, and hand out its first chunk.  Must be called with
+    sections.lock held, and the cleanups must be counted in
+    num_cleanups_queued.  The chunk is [begin, end) of the batch returned.
+*/
+Batch * start_batch(Cleanups & cleanups, size_t & begin, size_t & end)
+{
+    Batch * batch = new Batch(next_batch++);
+    batch->cleanups.swap(cleanups);
+    running_batches.push_back(batch->id);
+    ready_batches.push_back(batch);
+    queue.num_cleanups_ready += batch->cleanups.size();
+    take_chunk(batch, max_cleanups_per_call, begin, end);
+    return batch;
+}
+
+/** Run a chunk that was handed out by take_chunk(), and finish the batch if
+    it was the last.  Must be called without sections.lock held. */
+void run_chunk(Batch * batch, size_t begin, size_t end)
+{
+    wait_for_light_readers();
+
+    for (size_t i = begin;  i != end;  ++i) {
+        batch->cleanups[i]();
+        batch->cleanups[i] = Cleanup();  // release what it holds now
+    }
+
+    if (debug_mode)
+        atomic_add(stats.num_cleanups_outstanding, -(int)(end - begin));
+
+    bool finished;
+    {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
+        --batch->in_progress;
+        finished = batch->finished();
+        if (finished)
+            running_batches.erase(std::find(running_batches.begin(),
+                                            running_batches.end(),
+                                            batch->id));
+    }
+
+    if (finished) delete batch;
+
+    atomic_add(queue.cleanup_progress, 1);
+    if (JML_UNLIKELY(queue.progress_waiters))
+        futex_wake(queue.cleanup_progress, INT_MAX);
+}
+
+/// Run a chunk of up to max of the ready cleanups, oldest first.  Returns
+/// the number that were run.
+size_t run_ready_chunk(size_t max)
+{
+    Batch * batch = 0;
+    size_t begin = 0, end = 0;
+
+    {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
+        if (ready_batches.empty()) return 0;
+        batch = ready_batches.front();
+        take_chunk(batch, max, begin, end);
+    }
+
+    run_chunk(batch, begin, end);
+    return end - begin;
+}
+
+/** Collect the shards in the given mask, and run the first chunk of
+    whatever no critical section needs any more.  Must be called without
+    sections.lock held.  Returns the number that were run.
+*/
+size_t flush_shards(uint64_t mask)
+{
+    vector<Sharded_Cleanup> taken;
+    collect_shards(mask, taken);
+    if (taken.empty()) return 0;
+
+    Batch * batch = 0;
+    size_t begin = 0, end = 0;
+    {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
+        Cleanups ready;
+        distribute_collected(taken, ready);
+        if (!ready.empty())
+            batch = start_batch(ready, begin, end);
+    }
+
+    if (!batch) return 0;
+    run_chunk(batch, begin, end);
+    return end - begin;
+}
+
+/** Called once we're over the high water mark on the number of queued
+    cleanups, from outside a critical section.  Reports the critical section
+    that is holding them up, and waits until they have drained down to half
+    of the mark. */
+void wait_for_cleanups_to_drain()
+{
+    std::string message;
+    Stall_Reporter reporter;
+
+    {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
+
+        if (sections.num_cleanups_queued <= cleanup_high_water_mark / 2
+            || !sections.newest_ci)
+            return;
+
+        if (!stall_reported) {
+            // The oldest critical section is the one holding everything up
+            Critical_Info * oldest = sections.newest_ci;
+            while (oldest->prev) oldest = oldest->prev;
+
+            message = format("garbage: %zd cleanups queued, over the high "
+                             "water mark of %zd; held up by a critical "
+                             "section in thread %lx that has been active "
+                             "for %lld critical sections",
+                             sections.num_cleanups_queued,
+                             cleanup_high_water_mark,
+                             (unsigned long)oldest->thread,
+                             (long long)(sections.num_entered
+                                         - oldest->serial));
+            stall_reported = true;
+            reporter = stall_reporter;
+        }
+    }
+
+    if (!message.empty() && reporter)
+        reporter(message);
+
+    for (;;) {
+        int progress;
+        {
+            ACE_Guard<Critical_Lock> guard(sections.lock);
+            if (sections.num_cleanups_queued <= cleanup_high_water_mark / 2
+                || !sections.newest_ci)
+                return;
+            progress = queue.cleanup_progress;
+        }
+
+        // Help with the ready ones rather than waiting for someone else to
+        if (run_ready_chunk(max_cleanups_per_call)) continue;
+
+        atomic_add(queue.progress_waiters, 1);
+        futex_wait(queue.cleanup_progress, progress);
+        atomic_add(queue.progress_waiters, -1);
+    }
+}
+
 void enter_critical()
 {
     if (t_critical != 0) {
@@ -336,17 +881,18 @@ void enter_critical()
     }
     
     if (JML_UNLIKELY(!t_critical_alloc))
-        t_critical_alloc = new Critical_Info();
+        t_critical_alloc = get_critical_info();
     
     t_critical = t_critical_alloc;
     if (t_critical->live)
         throw Exception("entered critical section with live t_critical");
 
-    ACE_Guard<Critical_Lock> guard(critical_lock);
+    ACE_Guard<Critical_Lock> guard(sections.lock);
     t_critical->insert();
+    t_critical->serial = sections.num_entered++;
     ++t_nesting;
-    ++num_in_critical;
-    check_invariants();
+    ++sections.num_in_critical;
+    if (debug_level) check_invariants();
 }
 
 void leave_critical()
@@ -358,35 +904,144 @@ void leave_critical()
     --t_nesting;
     if (t_nesting > 0) return;
 
+    Batch * batch = 0;
+    size_t begin = 0, end = 0;
+    bool over_limit = false;
+
+    // Pick up what was scheduled from outside a critical section on our
+    // CPU, and every so often from all of them.  Only the shards' locks are
+    // needed for that, not sections.lock.
+    vector<Sharded_Cleanup> collected;
+    uint64_t nonempty = nonempty_shards.nonempty;
+    if (JML_UNLIKELY(nonempty)) {
+        if (++t_num_left % SHARD_SWEEP_INTERVAL != 0)
+            nonempty &= shard_bit(current_shard());
+        if (nonempty) collect_shards(nonempty, collected);
+    }
+
     // We can't call cleanups with the lock held
     {
-        ACE_Guard<Critical_Lock> guard(critical_lock);
+        ACE_Guard<Critical_Lock> guard(sections.lock);
 
         // Our local list of things to clean up gets transferred to the
         // list of the newest one
-        if (t_cleanups)
-            newest_ci->take_cleanups_from(*t_cleanups);
+        if (t_cleanups && !t_cleanups->empty()) {
+            sections.num_cleanups_queued += t_cleanups->size();
+            sections.newest_ci->take_cleanups_from(*t_cleanups);
+
+            // Only those that add cleanups are held back
+            over_limit = cleanup_high_water_mark
+                && sections.num_cleanups_queued > cleanup_high_water_mark;
+        }
         
         t_critical->remove();
         t_critical = 0;
-        --num_in_critical;
-        check_invariants();
+        --sections.num_in_critical;
+        if (debug_level) check_invariants();
+
+        // If we were the last, nobody else is going to collect the other
+        // shards.  The barrier pairs with the one in schedule_cleanup():
+        // either we see their cleanup here, or they see that there are no
+        // critical sections left.
+        if (!sections.newest_ci) {
+            memory_barrier();
+            if (JML_UNLIKELY(nonempty_shards.nonempty))
+                collect_shards(nonempty_shards.nonempty, collected);
+        }
+
+        if (JML_UNLIKELY(!collected.empty()))
+            distribute_collected(collected, t_critical_alloc->cleanups);
+
+        // If we were the oldest, the cleanups are ready to run.  We run the
+        // first chunk of them, and leave the rest for whoever comes next.
+        // Keep track of them so that cleanup_barrier() can wait for them.
+        if (!t_critical_alloc->cleanups.empty())
+            batch = start_batch(t_critical_alloc->cleanups, begin, end);
+        else if (max_cleanups_per_call && !ready_batches.empty()) {
+            // Otherwise, do our share of what's been left
+            batch = ready_batches.front();
+            take_chunk(batch, max_cleanups_per_call, begin, end);
+        }
     }
 
-    t_critical_alloc->cleanup();
+    if (batch)
+        run_chunk(batch, begin, end);
 
-    if (debug_mode) {
-        ACE_Guard<Critical_Lock> guard(critical_lock);
+    if (JML_UNLIKELY(over_limit))
+        wait_for_cleanups_to_drain();
+
+    if (debug_level && debug_mode) {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
         check_invariants();
     }
 }
 
+/** Called when a thread that has been in a critical section exits.  The
+    thread's structures can't be freed, as other threads may still be
+    looking at them without a lock; instead they go on a freelist for the
+    next thread.
+*/
+void on_thread_exit(void * arg)
+{
+    // A thread that exits in its critical section would hold up every
+    // cleanup forever.  End it, which passes its cleanups on to whatever
+    // critical section is still active.
+    if (t_critical) {
+        cerr << "thread exited inside a critical section" << endl;
+        t_nesting = 1;
+        leave_critical();
+    }
+
+    delete t_cleanups;
+    t_cleanups = 0;
+
+    if (t_light) {
+        if (t_light->seq & 1) {
+            cerr << "thread exited inside a light critical section" << endl;
+            leave_light_critical();
+        }
+        t_light->owned = 0;
+        t_light = 0;
+    }
+
+    Critical_Info * ci = t_critical_alloc;
+    t_critical_alloc = 0;
+    if (!ci) return;
+
+    ACE_Guard<Critical_Lock> guard(sections.lock);
+    free_critical_info.push_back(ci);
+}
+
 void new_critical()
 {
     leave_critical();
     enter_critical();
 }
 
+void enter_light_critical()
+{
+    if (JML_UNLIKELY(!t_light))
+        t_light = get_light_slot();
+
+    if (debug_level && (t_light->seq & 1))
+        throw Exception("light critical sections can't be nested");
+
+    // A full barrier: reclaimers see that we're in before we read anything
+    // that they could free
+    atomic_add(t_light->seq, 1);
+}
+
+void leave_light_critical()
+{
+    if (debug_level && (!t_light || !(t_light->seq & 1)))
+        throw Exception("left a light critical section we weren't in");
+
+    // Loads aren't reordered with later stores on x86, so it's enough to
+    // stop the compiler from moving our reads past the store
+    __asm__ __volatile__ ("" : : : "memory");
+    t_light->seq = t_light->seq + 1;
+}
+
 void schedule_cleanup(const Cleanup & cleanup)
 {
     /* NOTE: concurrency notes
@@ -396,9 +1051,9 @@ void schedule_cleanup(const Cleanup & cleanup)
 
        Note that:
        1.  The Cleanup_Info structures, once live, never disappear, so the
-           newest_ci pointer will always point to a valid structure.  (NOTE:
-           this is not true in the case of a thread exiting, but it will be
-           possible to deal with that).
+           newest_ci pointer will always point to a valid structure.  When a
+           thread exits, its structure goes on a freelist to be reused
+           rather than being freed.
        2.  If the newest_ci pointer changes, it will always represent a later
            critical section, which could also take care of cleaning up.
        3.  The main complication is when we end up pointing to a Cleanup_Info
@@ -410,18 +1065,43 @@ void schedule_cleanup(const Cleanup & cleanup)
     if (JML_UNLIKELY(!t_critical)) {
         // Slow path: not in a critical section
         // We need to add the value to the newest_ci if it exists, or otherwise
-        // just clean it up straight away.
-        ACE_Guard<Critical_Lock> guard(critical_lock); // TO REMOVE
-
-        if (newest_ci) {
-            if (debug_mode) atomic_add(num_added_newest, 1);
-            newest_ci->add_cleanup(cleanup);
+        // just clean it up straight away.  It goes into our CPU's shard, and
+        // a critical section that finishes later moves it to the newest one.
+        if (debug_mode) {
+            atomic_add(stats.num_cleanups_outstanding, 1);
+            atomic_add(stats.num_added_newest, 1);
         }
-        else {
-            cleanup();
-            if (debug_mode) atomic_add(num_cleaned_immediately, 1);
+
+        // Anything that has entered by now is on the list with a lower
+        // serial number; the barrier makes sure that we see them
+        memory_barrier();
+        uint64_t tag = sections.num_entered;
+
+        int shard = current_shard();
+        int pending = push_shard(shard, cleanup, tag);
+
+        // The lock's release isn't a full barrier; see leave_critical()
+        memory_barrier();
+
+        if (sections.newest_ci) {
+            if (JML_UNLIKELY(cleanup_high_water_mark
+                             && (sections.num_cleanups_queued + pending
+                                 > cleanup_high_water_mark))) {
+                // Make ours count towards the mark before waiting on it
+                flush_shards(shard_bit(shard));
+                wait_for_cleanups_to_drain();
+            }
+            return;
         }
 
+        // Nothing was active, so nothing can need it.  The rest of our
+        // shard goes where it needs to.  What's ready is run as a batch, so
+        // that with a limit we only run the first chunk, as when leaving a
+        // critical section, and the rest is left for later calls.
+        size_t n = flush_shards(shard_bit(shard));
+        if (debug_mode)
+            atomic_add(stats.num_cleaned_immediately, n);
+
         return;
     }
 
@@ -430,48 +1110,211 @@ void schedule_cleanup(const Cleanup & cleanup)
         t_cleanups = new Cleanups();
 
     if (debug_mode) {
-        atomic_add(num_cleanups_outstanding, 1);
-        atomic_add(num_added_local, 1);
+        atomic_add(stats.num_cleanups_outstanding, 1);
+        atomic_add(stats.num_added_local, 1);
     }
     t_cleanups->push_back(cleanup);
+
+    // Do our share of the cleanups that are waiting to be run
+    if (JML_UNLIKELY(queue.num_cleanups_ready) && max_cleanups_per_call)
+        run_ready_chunk(max_cleanups_per_call);
+}
+
+namespace {
+
+/// Scheduled as a cleanup to find out when a grace period has passed
+struct Grace_Period {
+    Grace_Period()
+        : done(0)
+    {
+    }
+
+    /// Waiters sleep on queue.cleanup_progress, which is bumped once the
+    /// chunk that we're in has been run
+    volatile int done;
+
+    void finish()
+    {
+        done = 1;
+    }
+};
+
+} // file scope
+
+void synchronize_critical()
+{
+    if (t_critical)
+        throw Exception("synchronize_critical(): called in a critical "
+                        "section");
+
+    // A cleanup scheduled from outside a critical section goes on the newest
+    // one, and so is run as soon as everything that is active now has
+    // finished (or straight away, if there is nothing active)
+    boost::shared_ptr<Grace_Period> grace(new Grace_Period());
+    schedule_cleanup(boost::bind(&Grace_Period::finish, grace));
+
+    // Don't wait for a section on the same CPU to collect it
+    flush_shards(nonempty_shards.nonempty);
+
+    // With a limit on the cleanups per call, whoever released ours may
+    // have left it on the ready queue, so we help to run it
+    for (;;) {
+        int progress = queue.cleanup_progress;
+        memory_barrier();
+        if (grace->done) break;
+
+        if (run_ready_chunk(max_cleanups_per_call)) continue;
+
+        atomic_add(queue.progress_waiters, 1);
+        futex_wait(queue.cleanup_progress, progress);
+        atomic_add(queue.progress_waiters, -1);
+    }
+}
+
+void cleanup_barrier()
+{
+    if (t_critical)
+        throw Exception("cleanup_barrier(): called in a critical section");
+
+    /* A cleanup that was scheduled before now is in one of four places:
+       1.  The local list of a thread still in its critical section;
+       2.  The list of a critical section that is still active;
+       3.  A batch that is being run;
+       4.  Already run.
+
+       After one grace period, everything in (1) has moved to (2), (3) or
+       (4).  After a second, everything in (2) has moved to (3) or (4).
+       Then we just need to wait for the batches that are running.
+    */
+    synchronize_critical();
+    synchronize_critical();
+
+    vector<uint64_t> waiting;
+    {
+        ACE_Guard<Critical_Lock> guard(sections.lock);
+        waiting = running_batches;
+    }
+
+    while (!waiting.empty()) {
+        int progress;
+        {
+            ACE_Guard<Critical_Lock> guard(sections.lock);
+            progress = queue.cleanup_progress;
+
+            vector<uint64_t> still_running;
+            for (unsigned i = 0;  i < waiting.size();  ++i)
+                if (std::find(running_batches.begin(), running_batches.end(),
+                              waiting[i]) != running_batches.end())
+                    still_running.push_back(waiting[i]);
+            waiting.swap(still_running);
+        }
+
+        if (waiting.empty()) break;
+
+        // Run what's left of them ourselves if nobody else is
+        if (run_ready_chunk(max_cleanups_per_call)) continue;
+
+        atomic_add(queue.progress_waiters, 1);
+        futex_wait(queue.cleanup_progress, progress);
+        atomic_add(queue.progress_waiters, -1);
+    }
 }
 
 void check_invariants()
 {
     if (!debug_mode) return;
 
-    if (num_in_critical == 0) {
+    if (sections.num_in_critical == 0) {
         if (t_critical)
             throw Exception("num_in_critical == 0 but t_critical != 0");
-        if (newest_ci)
+        if (sections.newest_ci)
             throw Exception("num_in_critical == 0 but newest_ci != 0");
     }
-    if (num_in_critical != 0) {
+    if (sections.num_in_critical != 0) {
         if (t_critical && t_critical->live != true)
             throw Exception("t_critical->live != true");
-        if (!newest_ci)
+        if (!sections.newest_ci)
             throw Exception("num_in_critical != 0 but newest_ci == 0");
-        if (newest_ci->live != true)
+        if (sections.newest_ci->live != true)
             throw Exception("newest_ci->live != true");
-        if (newest_ci->next != 0)
+        if (sections.newest_ci->next != 0)
             throw Exception("newest_ci->next != 0");
-        if (num_in_critical == 1) {
-            if (t_critical && t_critical != newest_ci)
+        if (sections.num_in_critical == 1) {
+            if (t_critical && t_critical != sections.newest_ci)
                 throw Exception("only one in critical and we're in critical but t_critical != newest_ci");
-            if (newest_ci->prev != 0)
+            if (sections.newest_ci->prev != 0)
                 throw Exception("one in critical but newest_ci->prev != 0");
         }
     }
 }
 
+void set_cleanup_high_water_mark(size_t high_water_mark)
+{
+    ACE_Guard<Critical_Lock> guard(sections.lock);
+    cleanup_high_water_mark = high_water_mark;
+    stall_reported = false;
+}
+
+size_t get_cleanup_high_water_mark()
+{
+    return cleanup_high_water_mark;
+}
+
+void set_stall_reporter(const Stall_Reporter & reporter)
+{
+    ACE_Guard<Critical_Lock> guard(sections.lock);
+    stall_reporter = reporter;
+}
+
+size_t get_num_cleanups_queued()
+{
+    ACE_Guard<Critical_Lock> guard(sections.lock);
+    return sections.num_cleanups_queued;
+}
+
+void set_max_cleanups_per_call(size_t max_cleanups)
+{
+    ACE_Guard<Critical_Lock> guard(sections.lock);
+    max_cleanups_per_call = max_cleanups;
+}
+
+size_t get_max_cleanups_per_call()
+{
+    return max_cleanups_per_call;
+}
+
+size_t run_ready_cleanups(size_t max_to_run)
+{
+    size_t result = 0;
+
+    while (max_to_run == 0 || result < max_to_run) {
+        size_t n = run_ready_chunk(max_to_run ? max_to_run - result : 0);
+        if (n == 0) break;
+        result += n;
+    }
+
+    return result;
+}
+
+size_t get_num_cleanups_ready()
+{
+    return queue.num_cleanups_ready;
+}
+
+size_t get_num_critical_info_allocated()
+{
+    ACE_Guard<Critical_Lock> guard(sections.lock);
+    return num_critical_info_allocated;
+}
+
 int get_num_in_critical()
 {
-    return num_in_critical;
+    return sections.num_in_critical;
 }
 
 int get_num_cleanups_outstanding()
 {
-    return num_cleanups_outstanding;
+    return stats.num_cleanups_outstanding;
 }
 
 void set_debug_mode(bool debug_mode_on)
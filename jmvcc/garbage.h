@@ -11,6 +11,8 @@
 
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
+#include <boost/utility.hpp>
+#include <string>
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/cmp_xchg.h"
 
@@ -34,6 +36,29 @@ size_t current_critical_section();
 // Same as enter_critical() then leave_critical()
 void new_critical();
 
+/** A light critical section, for a reader that loads a pointer, copies
+    out what it points to and leaves.  It costs an atomic increment of a
+    counter that belongs to the thread instead of taking a lock; in return
+    cleanups wait, just before they run, for any light section that was in
+    progress.  Light sections can't be nested, and nothing may be cleaned
+    up or waited for inside one.  They can be used inside an ordinary
+    critical section.
+*/
+void enter_light_critical();
+void leave_light_critical();
+
+struct Light_Critical_Guard : boost::noncopyable {
+    Light_Critical_Guard()
+    {
+        enter_light_critical();
+    }
+
+    ~Light_Critical_Guard()
+    {
+        leave_light_critical();
+    }
+};
+
 template<typename X>
 struct Delete_Object {
     Delete_Object(X * x)
@@ -54,10 +79,59 @@ typedef boost::function<void ()> Cleanup;
 /// Schedule a cleanup.  Has to be called when in a critical section.
 void schedule_cleanup(const Cleanup & cleanup);
 
+/** Block until every critical section that was active when this was called
+    has finished.  Can't be called from inside a critical section. */
+void synchronize_critical();
+
+/** Block until every cleanup that was scheduled before this was called has
+    been run.  Can't be called from inside a critical section. */
+void cleanup_barrier();
+
+
+/** Limit on the number of cleanups that can be queued waiting for critical
+    sections to finish.  A single long critical section holds up every
+    cleanup scheduled after it started.  Once the limit is reached, threads
+    that scheduled cleanups are made to wait when they leave their critical
+    section, until the queue has drained to half of the limit.  The stall
+    is reported once each time the limit is reached.  Zero, the default,
+    means no limit. */
+void set_cleanup_high_water_mark(size_t high_water_mark);
+size_t get_cleanup_high_water_mark();
+
+/// Called with a description of the critical section that is holding up
+/// the cleanups when the high water mark is reached.  By default, it is
+/// written to cerr.
+typedef boost::function<void (const std::string &)> Stall_Reporter;
+void set_stall_reporter(const Stall_Reporter & reporter);
+
+/// Number of cleanups that are waiting for critical sections to finish, or
+/// waiting to be run once they have
+size_t get_num_cleanups_queued();
+
+
+/** Limit on the number of cleanups run by a single call to leave_critical()
+    or schedule_cleanup().  When the oldest critical section finishes, all
+    of the cleanups it was holding up can be run, and there may be a great
+    many of them.  With a limit, the thread leaving runs only the first
+    chunk, and the rest go on a shared queue.  Later calls by any thread
+    run a chunk each from that queue, as do run_ready_cleanups() and
+    cleanup_barrier(), which bounds the pause that any one call can see.
+    Zero, the default, means no limit. */
+void set_max_cleanups_per_call(size_t max_cleanups);
+size_t get_max_cleanups_per_call();
+
+/** Run up to the given number of the cleanups on the shared queue (all of
+    them if zero), oldest first.  Returns the number that were run.  For
+    a reclaimer thread that takes the work off the others. */
+size_t run_ready_cleanups(size_t max_to_run = 0);
+
+/// Number of cleanups on the shared queue that are ready to be run
+size_t get_num_cleanups_ready();
 
 // Debug only
 void set_debug_mode(bool debug_mode_on);
 int get_num_in_critical();
+size_t get_num_critical_info_allocated();
 int get_num_cleanups_outstanding();
 void check_invariants();
 
@@ -88,7 +162,7 @@ struct RCU {
 
     const Data * operator -> () const
     {
-        return *read();
+        return read();
     }
 
     const Data * operator * () const
@@ -3,9 +3,14 @@ JMVCC_SOURCES := \
 	sandbox.cc \
 	transaction.cc \
 	versioned_object.cc \
-	garbage.cc
+	garbage.cc \
+	shared_domain.cc \
+	snapshot_export.cc \
+	change_notifier.cc \
+	node_pool.cc \
+	versioned_striped.cc
 
-JMVCC_LINK :=  boost_date_time-mt
+JMVCC_LINK :=  boost_date_time-mt boost_thread-mt rt
 
 $(eval $(call library,jmvcc,$(JMVCC_SOURCES),$(JMVCC_LINK)))
 
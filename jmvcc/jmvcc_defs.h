@@ -8,12 +8,62 @@
 #ifndef __jmvcc__jmvcc_defs_h__
 #define __jmvcc__jmvcc_defs_h__
 
+/** Level of checking compiled into the hot paths.  At 0 the snapshot and
+    transaction status bookkeeping, the epoch ordering checks and the calls
+    to the garbage collector's invariant checks are compiled out; at 1 they
+    are compiled in.  Defaults to 0 if NDEBUG is defined, and 1 otherwise.
+*/
+#ifndef JMVCC_DEBUG
+#  ifdef NDEBUG
+#    define JMVCC_DEBUG 0
+#  else
+#    define JMVCC_DEBUG 1
+#  endif
+#endif
+
+/** Size of a cache line.  Data that is written by one thread and read or
+    written by others goes on cache lines of its own, so that it doesn't
+    drag unrelated data between CPUs with it (false sharing).  A type or
+    variable marked JMVCC_CACHE_ALIGNED starts on a new line, and the size
+    of an aligned type is rounded up to a whole number of lines.  Objects
+    allocated with new are only aligned to what malloc gives.
+*/
+#ifndef JMVCC_CACHE_LINE_SIZE
+#  define JMVCC_CACHE_LINE_SIZE 64
+#endif
+
+#define JMVCC_CACHE_ALIGNED __attribute__((__aligned__(JMVCC_CACHE_LINE_SIZE)))
+
+/** Set to 0 to pack Versioned, Versioned2 and Versioned3 objects tightly
+    instead of starting each on its own cache line.  That saves memory when
+    there are lots of small objects, at the price of commits to one object
+    slowing down readers of its neighbours.
+*/
+#ifndef JMVCC_PAD_OBJECTS
+#  define JMVCC_PAD_OBJECTS 1
+#endif
+
+#if JMVCC_PAD_OBJECTS
+#  define JMVCC_OBJECT_ALIGNED JMVCC_CACHE_ALIGNED
+#else
+#  define JMVCC_OBJECT_ALIGNED
+#endif
+
 namespace JMVCC {
 
+/// JMVCC_DEBUG as a constant, so that the checks are still compiled (and
+/// so don't rot) but the optimizer removes them
+enum { debug_level = JMVCC_DEBUG };
+
 typedef unsigned Epoch;
 
 class Snapshot;
 class Versioned_Object;
+struct Domain;
+struct Change_Notifier;
+
+/// The domain used by objects and transactions that don't specify one
+extern Domain default_domain;
 
 } // namespace JMVCC
 
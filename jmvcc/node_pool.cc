@@ -0,0 +1,221 @@
+/* node_pool.cc
+   Jeremy Barnes, 29 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Memory pools for each NUMA node.
+*/
+
+#include "node_pool.h"
+#include "spinlock.h"
+#include "jml/arch/exception.h"
+#include "jml/utils/string_functions.h"
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace JMVCC {
+
+namespace {
+
+enum {
+    MAX_NODES = 16,
+    MAX_CPUS = 4096,
+    CLASS_SIZE = 16,         ///< Size classes go up in steps of this much
+    NUM_CLASSES = 32,        ///< So the biggest is 512 bytes
+    BLOCKS_PER_SLAB = 64,    ///< Number of blocks to get at once
+    BIG = NUM_CLASSES        ///< Size class of blocks that came from malloc()
+};
+
+/// Goes in front of each block.  Keeps the block aligned as malloc() would.
+struct Block_Header {
+    uint32_t node;
+    uint32_t size_class;
+    uint64_t unused;
+};
+
+/// A block on a free list, which holds the link in its own memory
+struct Free_Block {
+    Free_Block * next;
+};
+
+/** Free blocks of one size class on one node, with a cache line to itself.
+    These, and the topology, are set up statically, as allocations can
+    happen from other static constructors. */
+struct Free_List {
+    Internal_Spinlock lock;
+    Free_Block * head;
+} JMVCC_CACHE_ALIGNED;
+
+Free_List free_lists[MAX_NODES][NUM_CLASSES];
+
+int nodes = 1;
+
+/// Which node each CPU is on
+int node_of_cpu[MAX_CPUS];
+
+pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/// Work out which CPUs are on which node, from sysfs.  If we can't, the
+/// machine is treated as a single node.
+void init_topology()
+{
+    for (int node = 0;  node < MAX_NODES;  ++node) {
+        string filename
+            = format("/sys/devices/system/node/node%d/cpulist", node);
+        ifstream stream(filename.c_str());
+        if (!stream) continue;
+
+        string cpulist;
+        getline(stream, cpulist);
+
+        // Looks like "0-3,8-11"
+        const char * p = cpulist.c_str();
+        while (*p) {
+            int first, last, chars;
+            if (sscanf(p, "%d-%d%n", &first, &last, &chars) != 2) {
+                if (sscanf(p, "%d%n", &first, &chars) != 1) break;
+                last = first;
+            }
+
+            if (first < 0 || last >= MAX_CPUS) break;
+            for (int cpu = first;  cpu <= last;  ++cpu)
+                node_of_cpu[cpu] = node;
+
+            p += chars;
+            if (*p == ',') ++p;
+        }
+
+        nodes = node + 1;
+    }
+}
+
+void init()
+{
+    pthread_once(&topology_once, &init_topology);
+}
+
+/// Put a new slab's worth of blocks on the given list
+void add_slab(Free_List & list, int node, int size_class)
+{
+    size_t block_size = sizeof(Block_Header) + (size_class + 1) * CLASS_SIZE;
+
+    // The memory is touched here by a thread on the node, so it's placed
+    // there.  Slabs are never given back; their blocks are reused.
+    char * slab = (char *)malloc(block_size * BLOCKS_PER_SLAB);
+    if (!slab) throw std::bad_alloc();
+
+    Free_Block * first = 0;
+    for (int i = BLOCKS_PER_SLAB - 1;  i >= 0;  --i) {
+        Block_Header * header = (Block_Header *)(slab + i * block_size);
+        header->node = node;
+        header->size_class = size_class;
+        Free_Block * block = (Free_Block *)(header + 1);
+        block->next = first;
+        first = block;
+    }
+
+    Free_Block * last = first;
+    while (last->next) last = last->next;
+
+    list.lock.acquire();
+    last->next = list.head;
+    list.head = first;
+    list.lock.release();
+}
+
+const Block_Header * header_of(const void * mem)
+{
+    return reinterpret_cast<const Block_Header *>(mem) - 1;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* NODE POOLS                                                                */
+/*****************************************************************************/
+
+int num_numa_nodes()
+{
+    init();
+    return nodes;
+}
+
+int current_numa_node()
+{
+    init();
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= MAX_CPUS) return 0;
+    return node_of_cpu[cpu];
+}
+
+void * pool_allocate(size_t bytes)
+{
+    int node = current_numa_node();
+
+    size_t size_class = (bytes + CLASS_SIZE - 1) / CLASS_SIZE;
+    if (size_class > 0) --size_class;
+
+    if (size_class >= NUM_CLASSES) {
+        Block_Header * header
+            = (Block_Header *)malloc(sizeof(Block_Header) + bytes);
+        if (!header) throw std::bad_alloc();
+        header->node = node;
+        header->size_class = BIG;
+        return header + 1;
+    }
+
+    Free_List & list = free_lists[node][size_class];
+
+    for (;;) {
+        list.lock.acquire();
+        Free_Block * block = list.head;
+        if (block) {
+            list.head = block->next;
+            list.lock.release();
+            return block;
+        }
+        list.lock.release();
+
+        add_slab(list, node, size_class);
+    }
+}
+
+void pool_free(void * mem)
+{
+    if (!mem) return;
+
+    const Block_Header * header = header_of(mem);
+
+    if (header->size_class == BIG) {
+        free(const_cast<Block_Header *>(header));
+        return;
+    }
+
+    if (header->node >= MAX_NODES || header->size_class >= NUM_CLASSES)
+        throw Exception("pool_free(): not a pool block");
+
+    // Back to where it came from, whichever node we're on
+    Free_List & list = free_lists[header->node][header->size_class];
+    Free_Block * block = reinterpret_cast<Free_Block *>(mem);
+
+    list.lock.acquire();
+    block->next = list.head;
+    list.head = block;
+    list.lock.release();
+}
+
+int pool_node(const void * mem)
+{
+    return header_of(mem)->node;
+}
+
+} // namespace JMVCC
@@ -0,0 +1,76 @@
+/* node_pool.h                                                     -*- C++ -*-
+   Jeremy Barnes, 29 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Memory pools for each NUMA node.
+*/
+
+#ifndef __jmvcc__node_pool_h__
+#define __jmvcc__node_pool_h__
+
+#include <cstddef>
+#include <new>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* NODE POOLS                                                                */
+/*****************************************************************************/
+
+/* Versions and sandbox values are written by one thread and then read, and
+   eventually freed, by others, which may be on a different socket.  To keep
+   memory close to the threads that create it, small blocks are allocated
+   from a pool for the NUMA node that the calling thread is running on.
+   Each block remembers which node it came from, and freeing it returns it
+   to that node's pool, no matter which thread the cleanup runs on; so a
+   block is always reused on the node where its memory was first touched.
+
+   Blocks larger than the biggest size class go straight to malloc().
+*/
+
+/// Number of NUMA nodes in the machine
+int num_numa_nodes();
+
+/// NUMA node that the calling thread is running on right now
+int current_numa_node();
+
+/// Allocate the given number of bytes from the calling thread's node's pool
+void * pool_allocate(size_t bytes);
+
+/// Return a block from pool_allocate() to the pool of the node it came from
+void pool_free(void * mem);
+
+/// Node that a block from pool_allocate() came from
+int pool_node(const void * mem);
+
+
+/*****************************************************************************/
+/* POOL_ALLOCATOR                                                            */
+/*****************************************************************************/
+
+/** Allocator that gets its memory from the node pools.  Only does what
+    Versioned needs of it.
+*/
+
+template<typename T>
+struct Pool_Allocator {
+    typedef T value_type;
+    typedef T * pointer;
+    typedef size_t size_type;
+
+    T * allocate(size_t n)
+    {
+        return reinterpret_cast<T *>(pool_allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T * p, size_t n)
+    {
+        pool_free(p);
+    }
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__node_pool_h__ */
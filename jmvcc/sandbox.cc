@@ -7,6 +7,9 @@
 
 #include "sandbox.h"
 #include "transaction.h"
+#include "futex.h"
+#include "change_notifier.h"
+#include "aggregate.h"
 #include "jml/arch/atomic_ops.h"
 
 
@@ -33,21 +36,51 @@ clear()
              it = local_values.begin(),
              end = local_values.end();
          it != end;  ++it) {
-        free(it->second.val);
+        it->second.destroy(it->second.val);
+        pool_free(it->second.val);
     }
     local_values.clear();
 }
 
 Epoch
 Sandbox::
-commit(Epoch old_epoch)
+commit(Domain & domain, Epoch old_epoch)
 {
-    ACE_Guard<ACE_Mutex> guard(commit_lock);
+    bool result;
+    Epoch new_epoch;
 
-    Epoch new_epoch = get_current_epoch() + 1;
+    {
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
 
+        new_epoch = domain.current_epoch() + 1;
+
+        result = prepare(old_epoch, new_epoch);
+
+        if (result) publish(domain, new_epoch);
+
+        // TODO: for failed transactions, we'd do better to keep the
+        // structure to avoid reallocations
+        // TODO: clear as we go to better use cache
+        clear();
+    }
+
+    notify();
+
+    return (result ? new_epoch : 0);
+}
+
+bool
+Sandbox::
+prepare(Epoch old_epoch, Epoch new_epoch)
+{
     bool result = true;
 
+    if (!local_values.empty()) {
+        Domain & domain = local_values.begin()->first->domain();
+        if (JML_UNLIKELY(!domain.aggregates.empty()))
+            collect_aggregates(domain);
+    }
+
     Local_Values::iterator
         it = local_values.begin(),
         end = local_values.end();
@@ -56,38 +89,129 @@ commit(Epoch old_epoch)
     for (; result && it != end;  ++it)
         result = it->first->setup(old_epoch, new_epoch, it->second.val);
 
-    if (result) {
-        // First we update the epoch.  This ensures that any new snapshot
-        // created will see the correct epoch value, and won't look at
-        // old values which might not have a list.
-        //
-        // IT IS REALLY IMPORTANT THAT THIS BE DONE IN THE GIVEN ORDER.
-        // If we were to update the epoch afterwards, then new transactions
-        // could be created with the old epoch.  These transactions might
-        // need the values being cleaned up, racing with the creation
-        // process.
-        set_current_epoch(new_epoch);
-
-        // Make sure these writes are seen before we clean up
-        memory_barrier();
-
-        // Success: we are in a new epoch
-        for (it = local_values.begin(); it != end;  ++it)
-            it->first->commit(new_epoch);
+    if (result) return true;
+
+    // Rollback any that were set up if there was a problem
+    for (end = boost::prior(it), it = local_values.begin();
+         it != end;  ++it)
+        it->first->rollback(new_epoch, it->second.val);
+
+    return false;
+}
+
+void
+Sandbox::
+collect_aggregates(Domain & domain)
+{
+    for (unsigned i = 0;  i < domain.aggregates.size();  ++i) {
+        Aggregate_Base * aggregate = domain.aggregates[i];
+        aggregate->begin_collect();
+
+        bool any = false;
+        for (Local_Values::const_iterator
+                 it = local_values.begin(),
+                 end = local_values.end();
+             it != end;  ++it)
+            any |= aggregate->collect(it->first, it->second.val);
+
+        // Adds to local_values, so can't be done while iterating
+        if (any) aggregate->end_collect(*this);
     }
-    else {
-        // Rollback any that were set up if there was a problem
-        for (end = boost::prior(it), it = local_values.begin();
+}
+
+void
+Sandbox::
+publish(Domain & domain, Epoch new_epoch)
+{
+    // First we update the epoch.  This ensures that any new snapshot
+    // created will see the correct epoch value, and won't look at
+    // old values which might not have a list.
+    //
+    // IT IS REALLY IMPORTANT THAT THIS BE DONE IN THE GIVEN ORDER.
+    // If we were to update the epoch afterwards, then new transactions
+    // could be created with the old epoch.  These transactions might
+    // need the values being cleaned up, racing with the creation
+    // process.
+    domain.set_current_epoch(new_epoch);
+
+    // Make sure these writes are seen before we clean up
+    memory_barrier();
+
+    // Success: we are in a new epoch
+    for (Local_Values::iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it)
+        it->first->commit(new_epoch);
+
+    if (JML_UNLIKELY(!domain.waiters.empty()))
+        wake_waiters(domain);
+
+    if (JML_UNLIKELY(domain.notifier != 0)) {
+        Change_Notifier::Objects changed;
+        changed.reserve(local_values.size());
+        for (Local_Values::const_iterator
+                 it = local_values.begin(),
+                 end = local_values.end();
              it != end;  ++it)
-            it->first->rollback(new_epoch, it->second.val);
+            changed.push_back(it->first);
+
+        if (domain.notifier->collect(new_epoch, changed))
+            to_notify = domain.notifier;
     }
+}
 
-    // TODO: for failed transactions, we'd do better to keep the
-    // structure to avoid reallocations
-    // TODO: clear as we go to better use cache
-    clear();
-        
-    return (result ? new_epoch : 0);
+void
+Sandbox::
+notify()
+{
+    if (!to_notify) return;
+    to_notify->wake();
+    to_notify = 0;
+}
+
+void
+Sandbox::
+wake_waiters(Domain & domain)
+{
+    vector<Retry_Waiter *> & waiters = domain.waiters;
+
+    for (unsigned i = 0;  i < waiters.size();  /* no inc */) {
+        Retry_Waiter * waiter = waiters[i];
+
+        bool wake = false;
+        for (Local_Values::const_iterator
+                 it = local_values.begin(),
+                 end = local_values.end();
+             !wake && it != end;  ++it)
+            wake = waiter->waits_for(it->first);
+
+        if (!wake) {
+            ++i;
+            continue;
+        }
+
+        waiters[i] = waiters.back();
+        waiters.pop_back();
+
+        // The woken thread may return as soon as it sees this, so the
+        // waiter could be gone by the time that we wake it.  That's OK
+        // as futex_wake() only uses the address, and waiters allow for
+        // spurious wakeups.
+        waiter->woken = 1;
+        futex_wake(waiter->woken);
+    }
+}
+
+void
+Sandbox::
+abort(Epoch new_epoch)
+{
+    for (Local_Values::iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it)
+        it->first->rollback(new_epoch, it->second.val);
 }
 
 void
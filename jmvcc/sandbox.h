@@ -12,6 +12,7 @@
 #include "jml/utils/lightweight_hash.h"
 #include "jml/utils/string_functions.h"
 #include "versioned_object.h"
+#include "node_pool.h"
 #include <boost/tuple/tuple.hpp>
 
 namespace JMVCC {
@@ -26,12 +27,13 @@ namespace JMVCC {
 
 class Sandbox {
     struct Entry {
-        Entry() : val(0), size(0)
+        Entry() : val(0), size(0), destroy(0)
         {
         }
 
         void * val;
         size_t size;
+        void (* destroy) (void * val);  ///< Runs the value's destructor
 
         std::string print() const
         {
@@ -43,6 +45,11 @@ class Sandbox {
     Local_Values local_values;
 
 public:
+    Sandbox()
+        : to_notify(0)
+    {
+    }
+
     ~Sandbox();
 
     void clear();
@@ -63,9 +70,10 @@ public:
         boost::tie(it, inserted)
             = local_values.insert(std::make_pair(obj, Entry()));
         if (inserted) {
-            it->second.val = malloc(sizeof(T));
+            it->second.val = pool_allocate(sizeof(T));
             new (it->second.val) T(initial_value);
             it->second.size = sizeof(T);
+            it->second.destroy = &destroy_value<T>;
         }
         return reinterpret_cast<T *>(it->second.val);
     }
@@ -82,14 +90,52 @@ public:
         return local_value(const_cast<Versioned_Object *>(obj), initial_value);
     }
 
-    /** Commits the current transaction.  Returns zero if the transaction
-        failed, or returns the id of the new epoch if it succeeded. */
-    Epoch commit(Epoch old_epoch);
+    /** Commits the current transaction into the given domain.  Returns zero
+        if the transaction failed, or returns the id of the new epoch if it
+        succeeded.  All of the objects in the sandbox must belong to the
+        domain. */
+    Epoch commit(Domain & domain, Epoch old_epoch);
+
+    /** The two phases of a commit, for when several sandboxes (one per
+        domain) need to be committed atomically.  All of them must be called
+        with the domain's commit lock held.
+
+        prepare() sets up every object for a commit at new_epoch.  It
+        returns false, having rolled everything back, if any object was
+        modified after old_epoch.  publish() then makes a prepared commit
+        visible, and abort() rolls back a prepared commit that won't be
+        published.  The sandbox isn't cleared by any of these.
+    */
+    bool prepare(Epoch old_epoch, Epoch new_epoch);
+    void publish(Domain & domain, Epoch new_epoch);
+    void abort(Epoch new_epoch);
+
+    /** Start delivering any change notifications collected by publish().
+        Must be called once the commit lock has been released. */
+    void notify();
 
     void dump(std::ostream & stream = std::cerr, int indent = 0) const;
 
     size_t num_local_values() const { return local_values.size(); }
 
+private:
+    template<typename T>
+    static void destroy_value(void * val)
+    {
+        reinterpret_cast<T *>(val)->~T();
+    }
+
+    /// Wake up the transactions blocked in retry() on one of our objects
+    void wake_waiters(Domain & domain);
+
+    /// Have the domain's aggregates add their new values to the sandbox
+    void collect_aggregates(Domain & domain);
+
+    /// Notifier that publish() queued notifications with
+    Change_Notifier * to_notify;
+
+public:
+
     friend std::ostream & operator << (std::ostream&, const Sandbox::Entry&);
 };
 
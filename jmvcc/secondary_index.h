@@ -0,0 +1,499 @@
+/* secondary_index.h                                               -*- C++ -*-
+   Jeremy Barnes, 27 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Secondary indexes over groups of versioned objects.
+*/
+
+#ifndef __jmvcc__secondary_index_h__
+#define __jmvcc__secondary_index_h__
+
+#include "aggregate.h"
+#include <boost/function.hpp>
+#include <limits>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* SECONDARY_INDEX                                                           */
+/*****************************************************************************/
+
+/** Index of a group of Versioned<T> or Versioned2<T> objects by a key that
+    is worked out from their values.  Finding the objects with a given key
+    takes O(log n) rather than a scan over all of them.
+
+    The index is updated by the commits that write its members, in the same
+    epoch, through the same hook as Aggregate.  Each entry records the
+    epochs between which its object had that key, so lookups return what
+    was true in the transaction's snapshot.  As for aggregates, a
+    transaction's own uncommitted writes aren't reflected.  Members that
+    are destroyed are no longer found, and are taken out by the next commit
+    that writes a member or the index.
+
+    Entries that are no longer current are kept until no snapshot can see
+    them, and then cleaned up like old versions of an object, or by
+    vacuum() in vacuum mode.  Only the epochs that are registered for
+    cleanup are renamed by compress_epochs(), so it throws on domains with
+    indexes.
+*/
+
+template<typename Var, typename Key>
+struct Secondary_Index : public Versioned_Object, public Aggregate_Base {
+
+    typedef typename Var::value_type T;
+    typedef ACE_Mutex Mutex;
+
+    /// Works out the key of a value
+    typedef boost::function<Key (const T &)> Key_Function;
+
+    explicit Secondary_Index(const Key_Function & key_of,
+                             Domain & domain = default_domain)
+        : Versioned_Object(domain), key_of(key_of), last_changed(1)
+    {
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+        domain.aggregates.push_back(this);
+    }
+
+    ~Secondary_Index()
+    {
+        forget_vacuum();
+
+        Domain & domain = this->domain();
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+        domain.aggregates.erase(std::find(domain.aggregates.begin(),
+                                          domain.aggregates.end(),
+                                          this));
+        for (typename Members::const_iterator it = members.begin();
+             it != members.end();  ++it)
+            if (!it->second.removing) count_member(it->first, -1);
+    }
+
+    /** Add an object to the index.  Like Aggregate::add(), this rewrites
+        the object's current value in a transaction of its own; lookups find
+        it from that epoch on. */
+    void add(Var & obj)
+    {
+        if (&obj.domain() != &this->domain())
+            throw ML::Exception("Secondary_Index: member is in a different "
+                                "domain");
+
+        for (;;) {
+            ACE_Guard<ACE_Mutex> guard(this->domain().commit_lock);
+            typename Members::iterator it = members.find(&obj);
+            if (it == members.end()) {
+                removing.reserve(members.size() + 1);
+                members.insert(std::make_pair(&obj, Member(&obj)));
+                count_member(&obj, 1);
+                break;
+            }
+            if (!it->second.removing)
+                throw ML::Exception("Secondary_Index: object added twice");
+
+            // A destroyed member was at the same address, and hasn't been
+            // taken out yet
+            guard.release();
+            take_out_removed();
+        }
+
+        Local_Transaction trans(this->domain());
+        do {
+            obj.write(obj.read());
+        } while (!trans.commit());
+    }
+
+    /** Take an object out of the index.  This commits a transaction of its
+        own; lookups no longer find it from that epoch on. */
+    void remove(Var & obj)
+    {
+        remove_member(&obj);
+    }
+
+    /// Objects with the given key in the current transaction's snapshot
+    std::vector<Var *> find(const Key & key) const
+    {
+        Epoch epoch = lookup_epoch();
+
+        std::vector<Var *> result;
+
+        ACE_Guard<Mutex> guard(lock);
+        std::pair<typename Entries::const_iterator,
+                  typename Entries::const_iterator>
+            range = entries.equal_range(key);
+        for (; range.first != range.second;  ++range.first) {
+            const Entry & entry = range.first->second;
+            if (entry.visible_at(epoch))
+                result.push_back(entry.obj);
+        }
+
+        return result;
+    }
+
+    /// Number of objects with the given key in the current snapshot
+    size_t count(const Key & key) const
+    {
+        Epoch epoch = lookup_epoch();
+
+        size_t result = 0;
+
+        ACE_Guard<Mutex> guard(lock);
+        std::pair<typename Entries::const_iterator,
+                  typename Entries::const_iterator>
+            range = entries.equal_range(key);
+        for (; range.first != range.second;  ++range.first)
+            result += range.first->second.visible_at(epoch);
+
+        return result;
+    }
+
+    /// Number of entries, including those kept for old snapshots.  For
+    /// testing.
+    size_t entry_count() const
+    {
+        ACE_Guard<Mutex> guard(lock);
+        return entries.size();
+    }
+
+    /* Aggregate_Base interface. */
+
+    virtual void begin_collect()
+    {
+        pending.clear();
+    }
+
+    virtual bool collect(const Versioned_Object * obj, const void * value)
+    {
+        // Written by remove_member(), to take out what's been removed
+        if (obj == this) return true;
+
+        typename Members::iterator it = members.find(obj);
+        if (it == members.end()) return false;
+        pending.push_back(Change(&it->second,
+                                 key_of(*reinterpret_cast<const T *>(value))));
+        return true;
+    }
+
+    virtual void end_collect(Sandbox & sandbox)
+    {
+        // Only needs to be in the sandbox so that it's committed or rolled
+        // back with everything else; the changes are in pending.
+        sandbox.local_value<int>(this, 0);
+    }
+
+    virtual bool can_compress_epochs() const
+    {
+        // The epochs of the current entries aren't registered anywhere
+        return false;
+    }
+
+    virtual void forget(const Versioned_Object * obj) throw ()
+    {
+        typename Members::iterator it = members.find(obj);
+        if (it == members.end()) return;
+
+        // Lookups mustn't return it while it waits to be taken out
+        if (it->second.indexed) {
+            ACE_Guard<Mutex> guard(lock);
+            it->second.current->second.destroyed = true;
+        }
+
+        mark_removing(it);
+    }
+
+    /* Versioned_Object interface. */
+
+    virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
+    {
+        // The new entries go in now, as Versioned does with its new value,
+        // so that they are there for any snapshot at new_epoch.  Older
+        // snapshots can't see them.  Our changes were worked out from the
+        // latest committed values, so they never conflict.
+        ACE_Guard<Mutex> guard(lock);
+
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            Change & change = pending[i];
+            Member & member = *change.member;
+            if (member.removing) continue;
+
+            if (member.indexed) {
+                const Key & old_key = member.current->first;
+                if (!(old_key < change.key) && !(change.key < old_key))
+                    continue;  // key didn't change
+                member.current->second.valid_to = new_epoch;
+            }
+
+            change.new_entry
+                = entries.insert(std::make_pair(change.key,
+                                                Entry(member.obj, new_epoch)));
+            change.changed = true;
+        }
+
+        // Removed members are no longer found from new_epoch on
+        for (unsigned i = 0;  i < removing.size();  ++i) {
+            Member & member = members.find(removing[i])->second;
+            if (member.indexed)
+                member.current->second.valid_to = new_epoch;
+        }
+
+        return true;
+    }
+
+    virtual void commit(Epoch new_epoch) throw ()
+    {
+        ACE_Guard<Mutex> guard(lock);
+
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            Change & change = pending[i];
+            if (!change.changed) continue;
+            Member & member = *change.member;
+
+            if (member.indexed) retire(member);
+
+            member.current = change.new_entry;
+            member.indexed = true;
+            last_changed = new_epoch;
+        }
+
+        pending.clear();
+
+        for (unsigned i = 0;  i < removing.size();  ++i) {
+            typename Members::iterator it = members.find(removing[i]);
+            if (it->second.indexed) {
+                retire(it->second);
+                last_changed = new_epoch;
+            }
+            members.erase(it);
+        }
+        removing.clear();
+    }
+
+    virtual void rollback(Epoch new_epoch, void * data) throw ()
+    {
+        ACE_Guard<Mutex> guard(lock);
+
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            Change & change = pending[i];
+            if (!change.changed) continue;
+            Member & member = *change.member;
+            if (member.indexed)
+                member.current->second.valid_to
+                    = std::numeric_limits<Epoch>::max();
+            entries.erase(change.new_entry);
+        }
+
+        pending.clear();
+
+        // Still to be taken out, by the next commit that collects us
+        for (unsigned i = 0;  i < removing.size();  ++i) {
+            Member & member = members.find(removing[i])->second;
+            if (member.indexed)
+                member.current->second.valid_to
+                    = std::numeric_limits<Epoch>::max();
+        }
+    }
+
+    virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch)
+    {
+        ACE_Guard<Mutex> guard(lock);
+
+        // Of the entries retired with this valid_from, the one retired
+        // first is always the one that is no longer visible
+        typename Retired::iterator found = retired.end();
+        std::pair<typename Retired::iterator, typename Retired::iterator>
+            range = retired.equal_range(unused_valid_from);
+        for (; range.first != range.second;  ++range.first) {
+            if (found == retired.end()
+                || (range.first->second->second.valid_to
+                    < found->second->second.valid_to))
+                found = range.first;
+        }
+
+        if (found == retired.end())
+            throw ML::Exception("Secondary_Index: attempt to clean up "
+                                "something that didn't exist");
+
+        entries.erase(found->second);
+        retired.erase(found);
+    }
+
+    virtual size_t vacuum(const std::vector<Epoch> & snapshots,
+                          Epoch keep_after)
+    {
+        ACE_Guard<Mutex> guard(lock);
+
+        // Each retired entry stands alone, so it can go as soon as no
+        // snapshot is in [valid_from, valid_to)
+        for (typename Retired::iterator it = retired.begin();
+             it != retired.end();  /* no inc */) {
+            const Entry & entry = it->second->second;
+            std::vector<Epoch>::const_iterator s
+                = std::lower_bound(snapshots.begin(), snapshots.end(),
+                                   entry.valid_from);
+            if (entry.valid_to > keep_after
+                || (s != snapshots.end() && *s < entry.valid_to)) {
+                ++it;
+                continue;
+            }
+
+            entries.erase(it->second);
+            retired.erase(it++);
+        }
+
+        return retired.size();
+    }
+
+    virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
+        throw ()
+    {
+        ACE_Guard<Mutex> guard(lock);
+
+        std::pair<typename Retired::iterator, typename Retired::iterator>
+            range = retired.equal_range(old_valid_from);
+        std::vector<typename Entries::iterator> renamed;
+        for (typename Retired::iterator it = range.first;
+             it != range.second;  ++it) {
+            it->second->second.valid_from = new_valid_from;
+            renamed.push_back(it->second);
+        }
+        retired.erase(range.first, range.second);
+
+        for (unsigned i = 0;  i < renamed.size();  ++i)
+            retired.insert(std::make_pair(new_valid_from, renamed[i]));
+
+        return 0;
+    }
+
+    virtual Epoch latest_epoch() const
+    {
+        return last_changed;
+    }
+
+private:
+    Key_Function key_of;
+
+    struct Entry {
+        Entry(Var * obj, Epoch valid_from)
+            : obj(obj), valid_from(valid_from),
+              valid_to(std::numeric_limits<Epoch>::max()), destroyed(false)
+        {
+        }
+
+        Var * obj;
+        Epoch valid_from;   ///< First epoch in which obj had this key
+        Epoch valid_to;     ///< First epoch in which it no longer did
+        bool destroyed;     ///< obj has gone, and can't be returned
+
+        bool visible_at(Epoch epoch) const
+        {
+            return !destroyed && epoch >= valid_from && epoch < valid_to;
+        }
+    };
+
+    /// Entries by key.  Protected by lock.
+    typedef std::multimap<Key, Entry> Entries;
+    Entries entries;
+
+    /// Entries that are no longer current, by valid_from.  Protected by
+    /// lock.
+    typedef std::multimap<Epoch, typename Entries::iterator> Retired;
+    Retired retired;
+
+    struct Member {
+        explicit Member(Var * obj)
+            : obj(obj), indexed(false), removing(false)
+        {
+        }
+
+        Var * obj;
+        typename Entries::iterator current;  ///< Current entry, if indexed
+        bool indexed;
+        bool removing;  ///< Taken out by the next commit that collects us
+    };
+
+    /// These are protected by the domain's commit lock
+    typedef std::map<const Versioned_Object *, Member> Members;
+    Members members;
+
+    /// Members to take out, until a commit has done so.  There's always
+    /// room for all of the members, so that forget() can't fail.
+    std::vector<const Versioned_Object *> removing;
+
+    /// A member's new key in the commit being made
+    struct Change {
+        Change(Member * member, const Key & key)
+            : member(member), key(key), changed(false)
+        {
+        }
+
+        Member * member;
+        Key key;
+        bool changed;                          ///< Set up a new entry?
+        typename Entries::iterator new_entry;
+    };
+
+    std::vector<Change> pending;
+
+    Epoch last_changed;  ///< Epoch of the last commit that changed a key
+
+    mutable Mutex lock;
+
+    /// Keep a member's current entry until no snapshot can see it.  Must
+    /// be called with lock held.
+    void retire(const Member & member)
+    {
+        Epoch valid_from = member.current->second.valid_from;
+        retired.insert(std::make_pair(valid_from, member.current));
+        if (domain_->snapshot_info.vacuum_mode())
+            domain_->snapshot_info.register_dirty(this);
+        else domain_->snapshot_info.register_cleanup(this, valid_from);
+    }
+
+    void remove_member(const Versioned_Object * obj)
+    {
+        {
+            ACE_Guard<ACE_Mutex> guard(this->domain().commit_lock);
+            typename Members::iterator it = members.find(obj);
+            if (it == members.end() || it->second.removing)
+                throw ML::Exception("Secondary_Index: object isn't a member");
+            mark_removing(it);
+        }
+
+        take_out_removed();
+    }
+
+    /// Mark a member to be taken out.  Must be called with the commit lock
+    /// held.
+    void mark_removing(typename Members::iterator it) throw ()
+    {
+        if (it->second.removing) return;
+        it->second.removing = true;
+        removing.push_back(it->first);
+        count_member(it->first, -1);
+    }
+
+    /// Put ourself in a transaction, so that the commit collects us.  It
+    /// (or a commit of one of the members that beat it) takes the marked
+    /// members out.
+    void take_out_removed()
+    {
+        Local_Transaction trans(this->domain());
+        do {
+            Transaction * current = current_trans_for(this, *domain_);
+            current->local_value<int>(this, 0);
+        } while (!trans.commit());
+    }
+
+    /// Epoch that a lookup should see
+    Epoch lookup_epoch() const
+    {
+        if (!current_trans) return domain_->current_epoch();
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        return trans->epoch();
+    }
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__secondary_index_h__ */
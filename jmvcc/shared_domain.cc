@@ -0,0 +1,576 @@
+/* shared_domain.cc
+   Jeremy Barnes, 18 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Implementation of the shared memory domain.
+*/
+
+#include "shared_domain.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/utils/string_functions.h"
+#include <ace/Synch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace JMVCC {
+
+namespace {
+
+const uint64_t SHARED_DOMAIN_MAGIC = 0x4a4d5643435348ULL;  // "JMVCCSH"
+
+/** Start time of the given process, in clock ticks since boot, or zero if
+    it can't be found.  Together with the pid, this identifies a process
+    even once its pid has been reused. */
+uint64_t process_start_time(pid_t pid)
+{
+    ifstream stream(format("/proc/%d/stat", (int)pid).c_str());
+    string stat;
+    getline(stream, stat);
+
+    // The command name is in brackets and can contain anything, so we
+    // start from the last bracket; the start time is the 20th field after
+    // it.
+    string::size_type pos = stat.rfind(')');
+    if (pos == string::npos) return 0;
+
+    istringstream fields(stat.substr(pos + 1));
+    string field;
+    for (unsigned i = 0;  i < 19 && fields;  ++i)
+        fields >> field;
+
+    uint64_t result = 0;
+    fields >> result;
+    return fields ? result : 0;
+}
+
+/// Start time of our own process.  Looked up again after a fork.
+uint64_t my_start_time()
+{
+    static volatile pid_t cached_pid = 0;
+    static volatile uint64_t cached_start = 0;
+
+    pid_t pid = getpid();
+    if (cached_pid == pid) return cached_start;
+
+    uint64_t start = process_start_time(pid);
+    cached_start = start;
+    memory_barrier();
+    cached_pid = pid;
+    return start;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* ROBUST_LOCK                                                               */
+/*****************************************************************************/
+
+void
+Robust_Lock::
+init()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int res = pthread_mutex_init(&mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (res != 0)
+        throw Exception(format("Robust_Lock: pthread_mutex_init: %s", strerror(res)));
+}
+
+bool
+Robust_Lock::
+lock()
+{
+    int res = pthread_mutex_lock(&mutex);
+    if (res == EOWNERDEAD) return true;
+    if (res != 0)
+        throw Exception(format("Robust_Lock: lock: %s", strerror(res)));
+    return false;
+}
+
+void
+Robust_Lock::
+consistent()
+{
+    int res = pthread_mutex_consistent(&mutex);
+    if (res != 0)
+        throw Exception(format("Robust_Lock: consistent: %s", strerror(res)));
+}
+
+void
+Robust_Lock::
+unlock()
+{
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*****************************************************************************/
+/* SHARED_DOMAIN                                                             */
+/*****************************************************************************/
+
+Shared_Domain::
+Shared_Domain(const std::string & name, size_t size, int init_timeout_ms)
+    : header(0), name_(name), fd(-1)
+{
+    bool created = true;
+
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd == -1)
+        throw Exception("Shared_Domain: shm_open " + name + ": "
+                        + strerror(errno));
+
+    if (created) {
+        if (size < sizeof(Header))
+            throw Exception("Shared_Domain: size too small");
+        if (ftruncate(fd, size) == -1)
+            throw Exception(format("Shared_Domain: ftruncate: %s", strerror(errno)));
+    }
+    else {
+        // Wait for the creator to have sized the segment
+        struct stat st;
+        for (int waited = 0;  ;  ++waited) {
+            if (fstat(fd, &st) == -1) {
+                int err = errno;
+                close(fd);
+                throw Exception(format("Shared_Domain: fstat: %s",
+                                       strerror(err)));
+            }
+            if (st.st_size >= (off_t)sizeof(Header)) break;
+            if (waited >= init_timeout_ms) {
+                close(fd);
+                throw Exception("Shared_Domain: " + name + " was never "
+                                "sized; its creator may have died");
+            }
+            usleep(1000);
+        }
+        size = st.st_size;
+    }
+
+    void * addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        throw Exception(format("Shared_Domain: mmap: %s", strerror(errno)));
+
+    header = reinterpret_cast<Header *>(addr);
+
+    if (created) {
+        // A new segment from ftruncate is zero filled, so we only need to
+        // set up what isn't zero.
+        header->size = size;
+        header->allocated = (sizeof(Header) + 63) & ~63ULL;
+        header->commit_lock.init();
+        header->current_epoch = 1;
+        memory_barrier();
+        header->magic = SHARED_DOMAIN_MAGIC;
+    }
+    else {
+        for (int waited = 0;  header->magic != SHARED_DOMAIN_MAGIC;  ++waited) {
+            if (waited >= init_timeout_ms) {
+                munmap(addr, size);
+                close(fd);
+                throw Exception("Shared_Domain: " + name + " was never "
+                                "initialized; its creator may have died");
+            }
+            usleep(1000);
+        }
+        memory_barrier();
+    }
+}
+
+Shared_Domain::
+~Shared_Domain()
+{
+    if (header) munmap(header, header->size);
+    if (fd != -1) close(fd);
+}
+
+void
+Shared_Domain::
+unlink(const std::string & name)
+{
+    shm_unlink(name.c_str());
+}
+
+void *
+Shared_Domain::
+allocate_object(const std::string & name, size_t size,
+                void (*construct) (void * mem, const void * initial),
+                const void * initial)
+{
+    if (name.size() >= MAX_NAME)
+        throw Exception("Shared_Domain: object name too long: " + name);
+
+    Commit_Guard guard(*this);
+
+    for (int i = 0;  i < header->num_objects;  ++i) {
+        Directory_Entry & entry = header->directory[i];
+        if (name != entry.name) continue;
+        if (entry.size != size)
+            throw Exception("Shared_Domain: object " + name
+                            + " was created with a different type");
+        return entry.object.get();
+    }
+
+    if (header->num_objects == MAX_OBJECTS)
+        throw Exception("Shared_Domain: too many objects");
+
+    size_t offset = header->allocated;
+    size_t new_allocated = (offset + size + 63) & ~63ULL;
+    if (new_allocated > header->size)
+        throw Exception("Shared_Domain: segment is full");
+
+    header->allocated = new_allocated;
+
+    void * mem = (char *)header + offset;
+
+    // Anyone else looking for it waits on the commit lock, and only finds
+    // it once it's in the directory, by which time it's been constructed
+    construct(mem, initial);
+
+    Directory_Entry & entry = header->directory[header->num_objects];
+    strcpy(entry.name, name.c_str());
+    entry.size = size;
+    entry.object = (char *)mem;
+
+    ++header->num_objects;
+
+    return mem;
+}
+
+int
+Shared_Domain::
+claim_reader()
+{
+    pid_t pid = getpid();
+
+    for (int attempt = 0;  attempt < 2;  ++attempt) {
+        for (unsigned i = 0;  i < MAX_READERS;  ++i) {
+            Reader_Slot & slot = header->readers[i];
+            if (slot.pid != 0
+                || !__sync_bool_compare_and_swap(&slot.pid, 0, pid))
+                continue;
+
+            slot.epoch = 0;
+            slot.started = my_start_time();
+
+            int hw = header->reader_high_water;
+            while (hw <= (int)i
+                   && !__sync_bool_compare_and_swap(&header->reader_high_water,
+                                                    hw, i + 1))
+                hw = header->reader_high_water;
+
+            return i;
+        }
+
+        // Maybe somebody died and left their slots behind
+        reclaim_dead_readers();
+    }
+
+    throw Exception("Shared_Domain: too many snapshots");
+}
+
+Epoch
+Shared_Domain::
+pin(int slot)
+{
+    Reader_Slot & reader = header->readers[slot];
+
+    /* We need to make sure that a writer that is looking for free versions
+       sees our epoch before it could reuse a version that we can see.
+       Once we've published the epoch and checked that it's still current,
+       any later writer will see it; an earlier one can only have reused
+       versions that were already invisible at that epoch. */
+    for (;;) {
+        Epoch epoch = header->current_epoch;
+        reader.epoch = epoch;
+        memory_barrier();
+        if (header->current_epoch == epoch) return epoch;
+    }
+}
+
+void
+Shared_Domain::
+release_reader(int slot)
+{
+    Reader_Slot & reader = header->readers[slot];
+    reader.epoch = 0;
+    reader.started = 0;
+    memory_barrier();
+    reader.pid = 0;
+}
+
+int
+Shared_Domain::
+num_readers() const
+{
+    int result = 0;
+    for (int i = 0;  i < header->reader_high_water;  ++i)
+        result += (header->readers[i].pid > 0);
+    return result;
+}
+
+int
+Shared_Domain::
+reclaim_dead_readers()
+{
+    int result = 0;
+
+    for (int i = 0;  i < header->reader_high_water;  ++i) {
+        Reader_Slot & slot = header->readers[i];
+        pid_t pid = slot.pid;
+        uint64_t started = slot.started;
+        if (pid <= 0) continue;
+
+        // Still running, unless the pid now belongs to another process.
+        // A start time of zero means that the slot is still being claimed,
+        // or that it couldn't be found; either way, we leave it alone.
+        if (kill(pid, 0) == 0 || errno != ESRCH) {
+            if (started == 0 || process_start_time(pid) == started)
+                continue;
+        }
+
+        // Process has gone; its snapshot no longer pins anything.  We mark
+        // the slot as being reclaimed first, so that nobody can claim it
+        // before we've cleared it.
+        if (!__sync_bool_compare_and_swap(&slot.pid, pid, -1))
+            continue;
+
+        slot.epoch = 0;
+        slot.started = 0;
+        memory_barrier();
+        slot.pid = 0;
+        ++result;
+    }
+
+    return result;
+}
+
+void
+Shared_Domain::
+pinned_epochs(std::vector<Epoch> & epochs) const
+{
+    epochs.clear();
+    epochs.push_back(current_epoch());
+
+    for (int i = 0;  i < header->reader_high_water;  ++i) {
+        Epoch epoch = header->readers[i].epoch;
+        if (epoch != 0) epochs.push_back(epoch);
+    }
+
+    std::sort(epochs.begin(), epochs.end());
+    epochs.erase(std::unique(epochs.begin(), epochs.end()), epochs.end());
+}
+
+void
+Shared_Domain::
+record_pending(volatile Epoch & valid_from)
+{
+    int n = header->num_pending;
+    if (n == MAX_OBJECTS)
+        throw Exception("Shared_Domain: too many writes in one commit");
+
+    // The entry needs to be there before the count says so, and the count
+    // before anything is written
+    header->pending[n] = &valid_from;
+    memory_barrier();
+    header->num_pending = n + 1;
+    memory_barrier();
+}
+
+void
+Shared_Domain::
+clear_pending()
+{
+    memory_barrier();
+    header->num_pending = 0;
+}
+
+void
+Shared_Domain::
+recover_commit()
+{
+    // Whatever was written by the dead commit is later than the current
+    // epoch, as it never got to increment it.  Versions that made it into
+    // the log before it died may not have been written yet, and so may
+    // still be valid; they will have an earlier epoch.
+    Epoch current = header->current_epoch;
+
+    for (int i = 0;  i < header->num_pending;  ++i) {
+        volatile Epoch & valid_from = *header->pending[i];
+        if (valid_from > current) valid_from = 0;
+    }
+
+    clear_pending();
+}
+
+
+/*****************************************************************************/
+/* COMMIT_GUARD                                                              */
+/*****************************************************************************/
+
+Shared_Domain::Commit_Guard::
+Commit_Guard(Shared_Domain & domain)
+    : domain(domain)
+{
+    bool owner_died = domain.header->commit_lock.lock();
+
+    // A commit that threw part of the way through leaves its log behind
+    // too.  If we die in here, the next owner is told again and starts
+    // over.
+    if (owner_died || domain.header->num_pending != 0) {
+        try {
+            domain.recover_commit();
+            if (owner_died) domain.header->commit_lock.consistent();
+        } catch (...) {
+            domain.header->commit_lock.unlock();
+            throw;
+        }
+    }
+}
+
+Shared_Domain::Commit_Guard::
+~Commit_Guard()
+{
+    domain.header->commit_lock.unlock();
+}
+
+
+/*****************************************************************************/
+/* SHARED_SNAPSHOT                                                           */
+/*****************************************************************************/
+
+Shared_Snapshot::
+Shared_Snapshot(Shared_Domain & domain)
+    : domain(domain), slot(domain.claim_reader())
+{
+    epoch_ = domain.pin(slot);
+}
+
+Shared_Snapshot::
+~Shared_Snapshot()
+{
+    domain.release_reader(slot);
+}
+
+void
+Shared_Snapshot::
+restart()
+{
+    epoch_ = domain.pin(slot);
+}
+
+
+/*****************************************************************************/
+/* SHARED_TRANSACTION                                                        */
+/*****************************************************************************/
+
+Shared_Transaction::
+Shared_Transaction(Shared_Domain & domain)
+    : Shared_Snapshot(domain)
+{
+}
+
+Shared_Transaction::
+~Shared_Transaction()
+{
+    clear();
+}
+
+void
+Shared_Transaction::
+clear()
+{
+    for (Writes::iterator it = writes.begin(), end = writes.end();
+         it != end;  ++it)
+        free(it->second.value);
+    writes.clear();
+}
+
+bool
+Shared_Transaction::
+commit()
+{
+    bool result = true;
+
+    {
+        Shared_Domain::Commit_Guard guard(domain);
+
+        Epoch current = domain.current_epoch();
+        Epoch new_epoch = current + 1;
+
+        vector<Epoch> pinned;
+        domain.pinned_epochs(pinned);
+
+        // Phase 1: check for conflicts and find a slot for each new version.
+        // Nothing is modified, so there's nothing to undo on failure.
+        bool reclaimed = false;
+        for (Writes::iterator it = writes.begin(), end = writes.end();
+             result && it != end;  /* no inc */) {
+            Write & write = it->second;
+            write.slot = write.prepare(it->first, epoch_, current, pinned);
+
+            if (write.slot == Shared_Versioned_Base::CONFLICT)
+                result = false;
+            else if (write.slot == Shared_Versioned_Base::NO_SPACE) {
+                if (reclaimed)
+                    throw Exception("Shared_Transaction: all versions of an "
+                                    "object are still in use by snapshots");
+                // Versions pinned by dead processes are wasted; free them
+                // up and try again
+                domain.reclaim_dead_readers();
+                domain.pinned_epochs(pinned);
+                reclaimed = true;
+                continue;
+            }
+
+            ++it;
+        }
+
+        if (result && writes.size() > Shared_Domain::MAX_OBJECTS)
+            throw Exception("Shared_Transaction: too many objects written");
+
+        if (result) {
+            // Phase 2: write the new versions.  They aren't visible until
+            // the epoch is incremented.  Each one is logged first, so that
+            // if we die in here the next commit frees them.
+            for (Writes::iterator it = writes.begin(), end = writes.end();
+                 it != end;  ++it)
+                it->second.publish(it->first, it->second.slot,
+                                   it->second.value, new_epoch, domain);
+
+            memory_barrier();
+
+            domain.header->current_epoch = new_epoch;
+
+            domain.clear_pending();
+        }
+    }
+
+    clear();
+    restart();
+
+    return result;
+}
+
+} // namespace JMVCC
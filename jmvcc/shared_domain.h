@@ -0,0 +1,552 @@
+/* shared_domain.h                                                 -*- C++ -*-
+   Jeremy Barnes, 18 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   MVCC domain that lives in shared memory and is shared between processes.
+*/
+
+#ifndef __jmvcc__shared_domain_h__
+#define __jmvcc__shared_domain_h__
+
+#include "jmvcc_defs.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/utils/lightweight_hash.h"
+#include <boost/utility.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
+#include <boost/type_traits/has_trivial_destructor.hpp>
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+
+namespace JMVCC {
+
+
+/* Shared Memory Domains
+
+   A Shared_Domain keeps everything that is needed for MVCC (the epoch
+   counter, the commit lock, the table of live snapshots and the versions
+   of the objects themselves) in a POSIX shared memory segment.  Several
+   processes can map the same segment, and read a consistent snapshot of
+   the objects in it without copying them.
+
+   Since the segment is mapped at a different address in each process,
+   nothing in it contains an absolute pointer (or a vtable, which rules out
+   Versioned_Object); Offset_Ptr is used instead.  Objects must also be
+   trivially copyable.
+
+   The snapshot table is a fixed array of reader slots.  Each snapshot
+   claims one, tagged with the pid and start time of its process, and pins
+   its epoch in it.  A process that crashes leaves its slots behind; they
+   are reclaimed (and the versions that they pinned released) as soon as a
+   writer runs out of space for a new version.  The start time is there so
+   that a new process that happens to get the same pid doesn't keep them
+   alive.
+
+   Instead of cleanup lists, each Shared_Versioned object has a fixed
+   number of version slots.  A commit reuses any slot whose version is no
+   longer visible to a pinned snapshot, so the memory used by an object is
+   bounded and no cleanups need to be queued.
+
+   The commit lock is a robust, process-shared mutex.  A commit only
+   becomes visible once the epoch counter is incremented at the very end,
+   but the versions that it writes before that are already stamped with
+   the new epoch, and would become visible with the next commit to any
+   object.  So before each version is written, the commit records it in a
+   log in the header.  If a writer dies with the lock held, the next one
+   to take it goes through the log and frees every version that is later
+   than the current epoch before going on.
+*/
+
+
+/*****************************************************************************/
+/* OFFSET_PTR                                                                */
+/*****************************************************************************/
+
+/** A pointer that can be stored in shared memory.  It records the distance
+    from itself to its target, which is the same in every process that
+    maps the segment.  Since it can't point to itself, an offset of zero
+    is used for null.
+*/
+
+template<typename T>
+struct Offset_Ptr {
+    Offset_Ptr()
+        : offset(0)
+    {
+    }
+
+    Offset_Ptr(T * ptr)
+    {
+        set(ptr);
+    }
+
+    Offset_Ptr(const Offset_Ptr & other)
+    {
+        set(other.get());
+    }
+
+    Offset_Ptr & operator = (const Offset_Ptr & other)
+    {
+        set(other.get());
+        return *this;
+    }
+
+    Offset_Ptr & operator = (T * ptr)
+    {
+        set(ptr);
+        return *this;
+    }
+
+    T * get() const
+    {
+        if (!offset) return 0;
+        return reinterpret_cast<T *>((char *)this + offset);
+    }
+
+    T * operator -> () const { return get(); }
+    T & operator * () const { return *get(); }
+
+    void set(T * ptr)
+    {
+        offset = ptr ? (char *)ptr - (char *)this : 0;
+    }
+
+    ssize_t offset;
+};
+
+
+/*****************************************************************************/
+/* ROBUST_LOCK                                                               */
+/*****************************************************************************/
+
+/** A process-shared mutex that survives the death of the process holding
+    it.  Whatever the dead process was in the middle of doing under the
+    lock is left half done, so the next owner is told about it and needs
+    to repair it before calling consistent().
+*/
+
+struct Robust_Lock {
+    /// Initialize; must be done by exactly one process
+    void init();
+
+    /// Take the lock.  Returns true if its last owner died holding it.
+    bool lock();
+
+    /// Mark whatever the lock protects as repaired after lock() returned
+    /// true.  If the owner dies before calling it, the next one is told
+    /// again.
+    void consistent();
+
+    void unlock();
+
+    pthread_mutex_t mutex;
+};
+
+
+/*****************************************************************************/
+/* SHARED_DOMAIN                                                             */
+/*****************************************************************************/
+
+struct Shared_Domain : boost::noncopyable {
+
+    enum {
+        MAX_READERS = 1024,   ///< Maximum number of live snapshots
+        MAX_OBJECTS = 1024,   ///< Maximum number of named objects
+        MAX_NAME = 48         ///< Maximum length of an object name
+    };
+
+    /** Open the shared memory segment with the given name (as for
+        shm_open), creating it with the given size if it doesn't exist
+        yet.
+
+        If another process created it, we wait for up to init_timeout_ms
+        milliseconds for that process to finish setting it up.  If it
+        doesn't, it most likely died part of the way through, and we throw;
+        the segment needs to be unlinked before it can be used again.
+    */
+    explicit Shared_Domain(const std::string & name,
+                           size_t size = 64 * 1024 * 1024,
+                           int init_timeout_ms = 5000);
+
+    ~Shared_Domain();
+
+    /// Remove the segment with the given name.  Processes that have it
+    /// open keep using it.
+    static void unlink(const std::string & name);
+
+    Epoch current_epoch() const { return header->current_epoch; }
+
+    /** Return the object with the given name, constructing it from the
+        given initial value if it doesn't exist yet.  Every process needs
+        to use the same type for the same name.  The object is constructed
+        before anybody else can find it. */
+    template<typename Object, typename T>
+    Object & find_or_create(const std::string & name, const T & initial)
+    {
+        // It's shared between processes as raw memory, and never destroyed
+        BOOST_STATIC_ASSERT(boost::has_trivial_copy<Object>::value);
+        BOOST_STATIC_ASSERT(boost::has_trivial_destructor<Object>::value);
+
+        return *reinterpret_cast<Object *>
+            (allocate_object(name, sizeof(Object), &construct<Object, T>,
+                             &initial));
+    }
+
+    /// Number of reader slots that are currently claimed
+    int num_readers() const;
+
+    /** Free the reader slots of processes that have died, releasing any
+        versions that their snapshots pinned.  Returns the number freed.
+        Called automatically when a commit runs out of version slots. */
+    int reclaim_dead_readers();
+
+    /// Name of the segment
+    const std::string & name() const { return name_; }
+
+    /** Guard for the commit lock.  If the last process to hold it died part
+        of the way through a commit, its versions are freed before the
+        guard's owner goes on. */
+    struct Commit_Guard : boost::noncopyable {
+        explicit Commit_Guard(Shared_Domain & domain);
+        ~Commit_Guard();
+
+        Shared_Domain & domain;
+    };
+
+    struct Reader_Slot {
+        volatile pid_t pid;          ///< Owning process; zero if free
+        volatile uint64_t started;   ///< Its start time; zero if unknown
+        volatile Epoch epoch;        ///< Pinned epoch; zero if none yet
+    };
+
+    struct Directory_Entry {
+        char name[MAX_NAME];
+        uint64_t size;
+        Offset_Ptr<char> object;
+    };
+
+    /// Layout of the start of the segment
+    struct Header {
+        volatile uint64_t magic;       ///< Set once initialization is done
+        uint64_t size;                 ///< Size of the segment
+        uint64_t allocated;            ///< Bytes allocated (bump allocator)
+        Robust_Lock commit_lock;
+        volatile Epoch current_epoch;
+        volatile int reader_high_water;  ///< Slots above this are unused
+        int num_objects;
+        Reader_Slot readers[MAX_READERS];
+        Directory_Entry directory[MAX_OBJECTS];
+
+        /// Versions written by the commit in progress.  A commit writes at
+        /// most one version of each object, so there's room for them all.
+        volatile int num_pending;
+        Offset_Ptr<volatile Epoch> pending[MAX_OBJECTS];
+    };
+
+    Header * header;
+
+    /* Used by the snapshots and transactions. */
+
+    /// Claim a reader slot for a new snapshot
+    int claim_reader();
+
+    /// Pin the current epoch in the given reader slot, and return it
+    Epoch pin(int slot);
+
+    /// Free a reader slot
+    void release_reader(int slot);
+
+    /// Return the sorted list of epochs pinned by live snapshots, plus the
+    /// current epoch.  Must be called with the commit lock held.
+    void pinned_epochs(std::vector<Epoch> & epochs) const;
+
+    /** Record that the version with the given valid_from is about to be
+        written by the commit in progress.  Must be called with the commit
+        lock held, before anything is written. */
+    void record_pending(volatile Epoch & valid_from);
+
+    /// The commit in progress has finished; forget its versions
+    void clear_pending();
+
+private:
+    std::string name_;
+    int fd;
+
+    /// Free the versions of a commit whose process died with the lock held
+    void recover_commit();
+
+    /** Return the object with the given name, allocating it and calling
+        construct(mem, initial) on it if it doesn't exist yet.  Both are
+        done under the commit lock. */
+    void * allocate_object(const std::string & name, size_t size,
+                           void (*construct) (void * mem, const void * initial),
+                           const void * initial);
+
+    template<typename Object, typename T>
+    static void construct(void * mem, const void * initial)
+    {
+        new (mem) Object(*reinterpret_cast<const T *>(initial));
+    }
+};
+
+
+/*****************************************************************************/
+/* SHARED_VERSIONED                                                          */
+/*****************************************************************************/
+
+/** A versioned object that lives in a Shared_Domain.  T must be trivially
+    copyable.  Up to N versions can exist at once; a commit fails with an
+    exception if all of them are still visible to live snapshots.
+
+    Reads are lock free.  A version slot is only ever reused once no
+    pinned snapshot can see it, and it is marked invalid while it is
+    being rewritten, so a reader never sees a version that is changing
+    under it.
+*/
+
+struct Shared_Versioned_Base {
+    /// Special return values from prepare()
+    enum {
+        CONFLICT = -1,  ///< Written since the snapshot was taken
+        NO_SPACE = -2   ///< All version slots are still visible
+    };
+};
+
+template<typename T, int N = 8>
+struct Shared_Versioned : public Shared_Versioned_Base {
+    BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+    BOOST_STATIC_ASSERT(boost::has_trivial_destructor<T>::value);
+
+    typedef T value_type;
+
+    explicit Shared_Versioned(const T & val = T())
+    {
+        versions[0].valid_from = 1;
+        versions[0].value = val;
+        for (unsigned i = 1;  i < N;  ++i)
+            versions[i].valid_from = 0;
+    }
+
+    /// Value visible at the given epoch
+    T read(Epoch epoch) const
+    {
+        int best = -1;
+        Epoch best_from = 0;
+        for (unsigned i = 0;  i < N;  ++i) {
+            Epoch from = versions[i].valid_from;
+            if (from != 0 && from <= epoch && from > best_from) {
+                best = i;
+                best_from = from;
+            }
+        }
+
+        if (best == -1)
+            throw ML::Exception("Shared_Versioned: no version visible at epoch");
+
+        ML::memory_barrier();
+        return versions[best].value;
+    }
+
+    /// Number of versions being kept.  For testing.
+    int history_size(Epoch current_epoch) const
+    {
+        int result = 0;
+        for (unsigned i = 0;  i < N;  ++i)
+            result += (versions[i].valid_from != 0
+                       && versions[i].valid_from <= current_epoch);
+        return result - 1;
+    }
+
+    /** First phase of a commit.  Checks for a conflicting write after
+        old_epoch, and returns the version slot to use for the new value
+        (or CONFLICT or NO_SPACE).  Nothing is modified.  Must be called
+        with the commit lock held. */
+    int prepare(Epoch old_epoch, Epoch current_epoch,
+                const std::vector<Epoch> & pinned) const
+    {
+        // Versions with a valid_from after the current epoch were left
+        // behind by a commit that didn't finish; they are free.
+        Epoch froms[N];
+        int newest = -1;
+        for (unsigned i = 0;  i < N;  ++i) {
+            froms[i] = versions[i].valid_from;
+            if (froms[i] > current_epoch) froms[i] = 0;
+            if (froms[i] && (newest == -1 || froms[i] > froms[newest]))
+                newest = i;
+        }
+
+        if (froms[newest] > old_epoch) return CONFLICT;
+
+        for (int i = 0;  i < N;  ++i) {
+            if (froms[i] == 0) return i;
+            if (i == newest) continue;
+
+            // Version i is visible from froms[i] until the next one
+            Epoch to = froms[newest];
+            for (unsigned j = 0;  j < N;  ++j)
+                if (froms[j] > froms[i] && froms[j] < to)
+                    to = froms[j];
+
+            // Is any pinned epoch in [froms[i], to)?
+            std::vector<Epoch>::const_iterator it
+                = std::lower_bound(pinned.begin(), pinned.end(), froms[i]);
+            if (it == pinned.end() || *it >= to) return i;
+        }
+
+        return NO_SPACE;
+    }
+
+    /// Second phase of a commit: write the value into the slot returned
+    /// from prepare().  Becomes visible once the epoch is incremented.
+    /// Must be called with the commit lock held.
+    void publish(int slot, const T & value, Epoch new_epoch,
+                 Shared_Domain & domain)
+    {
+        Version & v = versions[slot];
+        domain.record_pending(v.valid_from);
+        v.valid_from = 0;
+        ML::memory_barrier();
+        v.value = value;
+        ML::memory_barrier();
+        v.valid_from = new_epoch;
+    }
+
+private:
+    struct Version {
+        volatile Epoch valid_from;  ///< Zero if the slot is free
+        T value;
+    };
+
+    Version versions[N];
+};
+
+
+/*****************************************************************************/
+/* SHARED_SNAPSHOT                                                           */
+/*****************************************************************************/
+
+/** A snapshot of a Shared_Domain.  Pins its epoch in the domain's reader
+    table for as long as it lives. */
+
+struct Shared_Snapshot : boost::noncopyable {
+    explicit Shared_Snapshot(Shared_Domain & domain);
+
+    ~Shared_Snapshot();
+
+    Epoch epoch() const { return epoch_; }
+
+    /// Move the snapshot forward to the current epoch
+    void restart();
+
+    template<typename Object>
+    typename Object::value_type read(const Object & obj) const
+    {
+        return obj.read(epoch_);
+    }
+
+    Shared_Domain & domain;
+
+protected:
+    int slot;
+    Epoch epoch_;
+};
+
+
+/*****************************************************************************/
+/* SHARED_TRANSACTION                                                        */
+/*****************************************************************************/
+
+/** A transaction on a Shared_Domain.  Writes are kept in (process local)
+    memory until the commit. */
+
+struct Shared_Transaction : public Shared_Snapshot {
+    explicit Shared_Transaction(Shared_Domain & domain);
+
+    ~Shared_Transaction();
+
+    template<typename Object>
+    typename Object::value_type & mutate(Object & obj)
+    {
+        typedef typename Object::value_type T;
+
+        bool inserted;
+        Writes::iterator it;
+        boost::tie(it, inserted)
+            = writes.insert(std::make_pair((void *)&obj, Write()));
+        if (inserted) {
+            it->second.value = malloc(sizeof(T));
+            new (it->second.value) T(obj.read(epoch_));
+            it->second.prepare = &do_prepare<Object>;
+            it->second.publish = &do_publish<Object>;
+        }
+        return *reinterpret_cast<T *>(it->second.value);
+    }
+
+    template<typename Object>
+    void write(Object & obj, const typename Object::value_type & val)
+    {
+        mutate(obj) = val;
+    }
+
+    template<typename Object>
+    typename Object::value_type read(const Object & obj) const
+    {
+        typedef typename Object::value_type T;
+
+        Writes::const_iterator it = writes.find((void *)&obj);
+        if (it != writes.end())
+            return *reinterpret_cast<const T *>(it->second.value);
+        return obj.read(epoch_);
+    }
+
+    /** Commit the transaction.  Returns false if there was a conflict, in
+        which case the writes are discarded and the snapshot moves forward
+        to the current epoch. */
+    bool commit();
+
+    void clear();
+
+private:
+    struct Write {
+        Write() : value(0), slot(-1), prepare(0), publish(0) {}
+        void * value;
+        int slot;
+        int (*prepare) (const void * obj, Epoch old_epoch, Epoch current,
+                        const std::vector<Epoch> & pinned);
+        void (*publish) (void * obj, int slot, const void * value,
+                         Epoch new_epoch, Shared_Domain & domain);
+    };
+
+    typedef ML::Lightweight_Hash<void *, Write> Writes;
+    Writes writes;
+
+    template<typename Object>
+    static int do_prepare(const void * obj, Epoch old_epoch, Epoch current,
+                          const std::vector<Epoch> & pinned)
+    {
+        return reinterpret_cast<const Object *>(obj)
+            ->prepare(old_epoch, current, pinned);
+    }
+
+    template<typename Object>
+    static void do_publish(void * obj, int slot, const void * value,
+                           Epoch new_epoch, Shared_Domain & domain)
+    {
+        typedef typename Object::value_type T;
+        reinterpret_cast<Object *>(obj)
+            ->publish(slot, *reinterpret_cast<const T *>(value), new_epoch,
+                      domain);
+    }
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__shared_domain_h__ */
@@ -7,6 +7,10 @@
 #include "transaction.h"
 #include "jml/utils/pair_utils.h"
 #include "jml/arch/atomic_ops.h"
+#include "garbage.h"
+#include "aggregate.h"
+#include <boost/bind.hpp>
+#include <sched.h>
 
 
 using namespace std;
@@ -14,10 +18,23 @@ using namespace std;
 
 namespace JMVCC {
 
-volatile Epoch current_epoch_ = 1;
-Epoch earliest_epoch_ = 1;
+/*****************************************************************************/
+/* DOMAIN                                                                    */
+/*****************************************************************************/
+
+Domain::
+Domain()
+    : current_epoch_(1), earliest_epoch_(1), snapshot_info(*this),
+      notifier(0)
+{
+}
+
+Domain default_domain;
 
-Snapshot_Info snapshot_info;
+volatile Epoch & current_epoch_ = default_domain.current_epoch_;
+Epoch & earliest_epoch_ = default_domain.earliest_epoch_;
+
+Snapshot_Info & snapshot_info = default_domain.snapshot_info;
 
 
 /*****************************************************************************/
@@ -159,7 +176,7 @@ Snapshot_Info::
 register_snapshot(Snapshot * snapshot)
 {
     ACE_Guard<Mutex> guard(lock);
-    snapshot->epoch_ = get_current_epoch();
+    snapshot->epoch_ = domain.current_epoch();
 
     // TODO: since we know it will be inserted at the end, we can do a more
     // efficient lookup that only looks at the end.
@@ -200,7 +217,7 @@ register_snapshot(Snapshot * snapshot)
 void Snapshot_Info::Entry::
 add_cleanup(const Cleanup_Entry & cleanup)
 {
-    ACE_Guard<Spinlock> guard(lock);
+    ACE_Guard<Internal_Spinlock> guard(lock);
     cleanups.push_back(cleanup);
 }
 
@@ -208,14 +225,14 @@ void
 Snapshot_Info::
 remove_snapshot(Snapshot * snapshot)
 {
-    snapshot->status = RESTARTING0;
+    if (debug_level) snapshot->status = RESTARTING0;
 
     ACE_Guard<Mutex> guard(lock);
 
     if (entries.empty())
         throw Exception("remove_snapshot: empty entries");
     
-    snapshot->status = RESTARTING0A;
+    if (debug_level) snapshot->status = RESTARTING0A;
     
     Entries::iterator it = entries.find(snapshot->epoch());
     if (it == entries.end()) {
@@ -223,7 +240,7 @@ remove_snapshot(Snapshot * snapshot)
         cerr << "snapshot = " << snapshot << endl;
         cerr << "current_trans = " << current_trans << endl;
         cerr << "snapshot->epoch() = " << snapshot->epoch() << endl;
-        snapshot_info.dump_unlocked();
+        dump_unlocked();
         //snapshot->dump();
         if (current_trans)
             current_trans->dump();
@@ -240,7 +257,7 @@ remove_snapshot(Snapshot * snapshot)
     
     if (!entry.snapshots.count(snapshot)) {
         cerr << "-------- snapshot out of sync -----------" << endl;
-        snapshot_info.dump();
+        dump_unlocked();
         //snapshot->dump();
         if (current_trans)
             current_trans->dump();
@@ -291,8 +308,8 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
         // and it just disappeared.
         try {
             if (itnext == entries.end())
-                set_earliest_epoch(get_current_epoch());
-            else set_earliest_epoch(itnext->first);
+                domain.set_earliest_epoch(domain.current_epoch());
+            else domain.set_earliest_epoch(itnext->first);
         } catch (const std::exception & exc) {
             cerr << "exception setting earliest epoch" << endl;
             dump_unlocked();
@@ -340,6 +357,8 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
 
     entries.erase(it);
 
+    bool lazy = lazy_snapshots_;
+
     // Release the guard so that we can lock the objects
     guard.release();
     
@@ -348,19 +367,42 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     for (unsigned i = 0;  i < to_clean_up.size();  ++i) {
         Versioned_Object * obj = to_clean_up[i].object;
         Epoch valid_from = to_clean_up[i].valid_from;
-        
-        try {
-            obj->cleanup(valid_from, snapshot_epoch);
-        }
-        catch (const std::exception & exc) {
-            ostringstream obj_stream;
-            obj->dump(obj_stream);
-            cerr << "got exception: " << exc.what() << endl;
-            cerr << "object after cleanup: " << endl;
-            cerr << obj_stream.str();
-            throw;
-       }
+
+        // Lazy transactions that could still see the version aren't in
+        // the table, but they are in critical sections
+        if (lazy)
+            schedule_cleanup(boost::bind(&Snapshot_Info::run_deferred_cleanup,
+                                         obj, valid_from, snapshot_epoch));
+        else run_cleanup(obj, valid_from, snapshot_epoch);
+    }
+}
+
+void
+Snapshot_Info::
+run_cleanup(Versioned_Object * obj, Epoch valid_from, Epoch snapshot_epoch)
+{
+    try {
+        obj->cleanup(valid_from, snapshot_epoch);
     }
+    catch (const std::exception & exc) {
+        ostringstream obj_stream;
+        obj->dump(obj_stream);
+        cerr << "got exception: " << exc.what() << endl;
+        cerr << "object after cleanup: " << endl;
+        cerr << obj_stream.str();
+        throw;
+    }
+}
+
+void
+Snapshot_Info::
+run_deferred_cleanup(Versioned_Object * obj, Epoch valid_from,
+                     Epoch snapshot_epoch)
+{
+    // The garbage collector runs it outside of any critical section, but
+    // the object may free what it unlinks with schedule_cleanup()
+    In_Out_Critical critical;
+    run_cleanup(obj, valid_from, snapshot_epoch);
 }
 
 void
@@ -385,15 +427,170 @@ register_cleanup(Versioned_Object * obj, Epoch valid_from_to_cleanup)
     }
 }
 
+void
+Snapshot_Info::
+set_vacuum_mode(bool vacuum_mode)
+{
+    {
+        ACE_Guard<Mutex> guard(lock);
+        if (!entries.empty())
+            throw Exception("vacuum mode can only be changed with no "
+                            "snapshots");
+        if (vacuum_mode && lazy_snapshots_)
+            throw Exception("vacuum mode can't be used with lazy snapshots");
+        vacuum_mode_ = vacuum_mode;
+    }
+
+    // Nothing else will clean up the history of the dirty objects
+    if (!vacuum_mode) vacuum();
+}
+
+void
+Snapshot_Info::
+set_lazy_snapshots(bool lazy_snapshots)
+{
+    ACE_Guard<Mutex> guard(lock);
+    if (!entries.empty())
+        throw Exception("lazy snapshots can only be turned on or off with "
+                        "no snapshots");
+    if (lazy_snapshots && vacuum_mode_)
+        throw Exception("lazy snapshots can't be used in vacuum mode");
+    lazy_snapshots_ = lazy_snapshots;
+}
+
+void
+Snapshot_Info::
+register_dirty(Versioned_Object * obj)
+{
+    // The commit has already added its version.  The barrier makes sure
+    // that if a vacuum takes the object off the list after we look, it
+    // sees that version and so puts the object back.
+    memory_barrier();
+    if (obj->vacuum_state_ & Versioned_Object::VACUUM_DIRTY) return;
+
+    ACE_Guard<Internal_Spinlock> guard(dirty_lock);
+    if (obj->vacuum_state_ & Versioned_Object::VACUUM_DIRTY) return;
+    obj->vacuum_state_ |= Versioned_Object::VACUUM_DIRTY;
+    dirty.insert(obj);
+}
+
+void
+Snapshot_Info::
+forget_dirty(Versioned_Object * obj)
+{
+    // A vacuum in progress puts the object back on the list if it still
+    // has history, so we take it off again each time round
+    for (;;) {
+        {
+            ACE_Guard<Internal_Spinlock> guard(dirty_lock);
+            if (obj->vacuum_state_ & Versioned_Object::VACUUM_DIRTY) {
+                dirty.erase(obj);
+                obj->vacuum_state_ &= ~Versioned_Object::VACUUM_DIRTY;
+            }
+            if (obj->vacuum_state_ == 0) return;
+        }
+        sched_yield();
+    }
+}
+
+size_t
+Snapshot_Info::
+vacuum(size_t max_objects)
+{
+    /* The epochs that the live snapshots see, and the current epoch, which
+       is the earliest one that a snapshot taken from now on can see.  They
+       are read together, so every snapshot is covered by one or the other.
+       Epochs only go up, as compress_epochs() isn't allowed while there
+       are objects to vacuum. */
+    vector<Epoch> epochs;
+    Epoch keep_after;
+    {
+        ACE_Guard<Mutex> guard(lock);
+        keep_after = domain.current_epoch();
+        epochs.reserve(entries.size());
+        for (Entries::const_iterator it = entries.begin(), end = entries.end();
+             it != end;  ++it)
+            epochs.push_back(it->first);
+    }
+
+    // Take the objects off the list before we look at them, so that any
+    // commit after that puts its object back.  Each one is pinned until
+    // we've finished with it, so that it can't be destroyed under us.
+    vector<Versioned_Object *> objects;
+    {
+        ACE_Guard<Internal_Spinlock> guard(dirty_lock);
+        Dirty::iterator it = dirty.upper_bound(vacuum_cursor);
+        while (!dirty.empty()
+               && (max_objects == 0 || objects.size() < max_objects)) {
+            if (it == dirty.end()) it = dirty.begin();
+            Versioned_Object * obj = *it;
+            obj->vacuum_state_ += Versioned_Object::VACUUM_PIN
+                                - Versioned_Object::VACUUM_DIRTY;
+            objects.push_back(obj);
+            dirty.erase(it++);
+        }
+        if (!objects.empty()) vacuum_cursor = objects.back();
+    }
+
+    // Objects can read their history without a lock, and old versions
+    // can only be freed once they've finished
+    In_Out_Critical critical;
+
+    unsigned i = 0;
+    try {
+        for (;  i < objects.size();  ++i) {
+            if (objects[i]->vacuum(epochs, keep_after) != 0)
+                register_dirty(objects[i]);
+            unpin(objects[i]);
+        }
+    } catch (...) {
+        // Don't lose the ones that we haven't done
+        for (;  i < objects.size();  ++i) {
+            register_dirty(objects[i]);
+            unpin(objects[i]);
+        }
+        throw;
+    }
+
+    return objects.size();
+}
+
+void
+Snapshot_Info::
+unpin(Versioned_Object * obj)
+{
+    ACE_Guard<Internal_Spinlock> guard(dirty_lock);
+    obj->vacuum_state_ -= Versioned_Object::VACUUM_PIN;
+}
+
+size_t
+Snapshot_Info::
+dirty_count() const
+{
+    ACE_Guard<Internal_Spinlock> guard(dirty_lock);
+    return dirty.size();
+}
+
 void
 Snapshot_Info::
 compress_epochs()
 {
     // We have to block any commits that are happening so that we can't get
     // any new epochs
-    ACE_Guard<ACE_Mutex> commit_guard(commit_lock);
+    ACE_Guard<ACE_Mutex> commit_guard(domain.commit_lock);
 
     ACE_Guard<Mutex> guard(lock);
+
+    // Lazy transactions hold on to epochs that we don't know about
+    if (lazy_snapshots_)
+        throw Exception("compress_epochs() can't be used with lazy "
+                        "snapshots");
+
+    // Nor can indexes rename all of theirs
+    for (unsigned i = 0;  i < domain.aggregates.size();  ++i)
+        if (!domain.aggregates[i]->can_compress_epochs())
+            throw Exception("compress_epochs() can't be used on a domain "
+                            "with indexes");
     
     /* There could be any number of snapshots that are currently happening
        concurrently with us doing this.  We have to make sure that we don't
@@ -449,6 +646,12 @@ compress_epochs()
     if (entries.empty())
         return;
 
+    // The dirty objects aren't on the cleanup lists, so there's no way to
+    // find the versions to rename
+    if (vacuum_mode_ && dirty_count() != 0)
+        throw Exception("compress_epochs() with objects waiting to be "
+                        "vacuumed");
+
     // TODO: must have strong exception guarantee here, but it needs to be
     // implemented
 
@@ -594,8 +797,8 @@ compress_epochs()
         dump_unlocked();
     }
 
-    current_epoch_ = i;
-    earliest_epoch_ = 1;
+    domain.current_epoch_ = i;
+    domain.earliest_epoch_ = 1;
 }
 
 void
@@ -604,12 +807,17 @@ dump_unlocked(std::ostream & stream)
 {
 
     stream << "global state: " << endl;
-    stream << "  current_epoch: " << get_current_epoch() << endl;
-    stream << "  earliest_epoch: " << get_earliest_epoch() << endl;
+    stream << "  current_epoch: " << domain.current_epoch() << endl;
+    stream << "  earliest_epoch: " << domain.earliest_epoch() << endl;
     stream << "  current_trans: " << current_trans << " epoch "
            << (current_trans ? current_trans->epoch() : 0)
            << endl;
     stream << "  snapshot epochs: " << entries.size() << endl;
+    if (vacuum_mode_)
+        stream << "  vacuum mode: " << dirty_count() << " dirty objects"
+               << endl;
+    if (lazy_snapshots_)
+        stream << "  lazy snapshots" << endl;
     int i = 0;
     for (map<Epoch, Entry>::const_iterator
              it = entries.begin(), end = entries.end();
@@ -26,46 +26,10 @@ namespace JMVCC {
 
 template<class Var> void test0_type();  // testing code
 
-using namespace ML;
-
-/// Global variable giving the number of committed transactions since the
-/// beginning of the program
-extern volatile Epoch current_epoch_;
-
-inline Epoch get_current_epoch()
-{
-    return current_epoch_;
-}
-
-inline void set_current_epoch(Epoch val)
-{
-    if (val < current_epoch_)
-        throw Exception("current_epoch_ is decreasing");
-    current_epoch_ = val;
-}
-
-/// Global variable giving the earliest epoch for which there is a snapshot
-extern Epoch earliest_epoch_;
-
-inline void set_earliest_epoch(Epoch val)
-{
-    if (val < earliest_epoch_) {
-        using namespace std;
-        cerr << "val = " << val << endl;
-        cerr << "earliest_epoch = " << earliest_epoch_ << endl;
-        throw Exception("earliest epoch was not increasing");
-    }
-    if (val > current_epoch_) {
-        throw Exception("earliest epoch after current epoch");
-    }
-    earliest_epoch_ = val;
-}
-
-inline Epoch get_earliest_epoch()
-{
-    return earliest_epoch_;
-}
+struct Retry_Waiter;
+struct Aggregate_Base;
 
+using namespace ML;
 
 /*****************************************************************************/
 /* SNAPSHOT_INFO                                                             */
@@ -82,8 +46,14 @@ inline Epoch get_earliest_epoch()
 
  */
 
-/// Information about transactions in progress
+/// Information about transactions in progress within a domain
 struct Snapshot_Info {
+    explicit Snapshot_Info(Domain & domain)
+        : domain(domain), vacuum_mode_(false), lazy_snapshots_(false),
+          vacuum_cursor(0)
+    {
+    }
+
     // Register the snapshot for the current epoch.  Returns the number of
     // the epoch it was registered under.
     Epoch register_snapshot(Snapshot * snapshot);
@@ -93,6 +63,64 @@ struct Snapshot_Info {
     void register_cleanup(Versioned_Object * obj,
                           Epoch valid_from_to_cleanup);
 
+    /** Vacuum mode.  Instead of registering a cleanup for each old
+        version, a commit puts the object on a list of dirty objects (once
+        until it is next vacuumed), and vacuum() cleans up each object's
+        history in one go, keeping only the versions that the snapshots
+        that are live at the time can see.  For objects written often,
+        that's one call and one lock per object for many versions, instead
+        of one for each.  Until vacuum() is called, the old versions stay;
+        it can be called a few objects at a time from anywhere outside a
+        light critical section, or in a loop by a background thread.
+        Objects must implement Versioned_Object::vacuum().
+
+        The mode can only be changed when there are no snapshots.  Turning
+        it off vacuums the objects that are dirty.  compress_epochs() can't
+        be used while there are dirty objects.
+    */
+    void set_vacuum_mode(bool vacuum_mode);
+    bool vacuum_mode() const { return vacuum_mode_; }
+
+    /// Called on commit in vacuum mode, instead of register_cleanup()
+    void register_dirty(Versioned_Object * obj);
+
+    /// Called when a dirty object is destroyed.  Takes it off the list,
+    /// and waits for any vacuum in progress on it to finish.
+    void forget_dirty(Versioned_Object * obj);
+
+    /** Vacuum up to the given number of dirty objects (all of them if
+        zero), starting where the last call left off.  Those that still
+        have versions that a snapshot needs stay dirty.  Returns the
+        number of objects that were vacuumed. */
+    size_t vacuum(size_t max_objects = 0);
+
+    /// Number of objects waiting to be vacuumed
+    size_t dirty_count() const;
+
+    /** Lazy snapshots.  A Local_Transaction only records the current
+        epoch when it starts, instead of registering its snapshot here, and
+        registers it just before it commits something.  Read-only
+        transactions therefore never take the lock or touch the table.
+
+        What keeps the versions that a lazy transaction reads alive is its
+        critical section: the cleanups that a snapshot going away triggers
+        are scheduled with the garbage collector instead of being done
+        there and then, so a version that was current at any point during
+        a critical section isn't cleaned up until that section has
+        finished.  A lazy transaction must therefore stay in its critical
+        section for as long as it reads at its epoch, which
+        Local_Transaction does.  The cost is that a long critical section
+        now holds up cleanups of old versions, not just the freeing of
+        memory.
+
+        The mode can only be changed when there are no transactions in the
+        domain.  It can't be used with vacuum mode, whose vacuum() doesn't
+        know about lazy transactions, nor with compress_epochs(), which
+        can't rename their epochs.
+    */
+    void set_lazy_snapshots(bool lazy_snapshots);
+    bool lazy_snapshots() const { return lazy_snapshots_; }
+
     void dump(std::ostream & stream = std::cerr);
 
     void validate() const
@@ -107,6 +135,8 @@ struct Snapshot_Info {
         start back at zero.  Used once the epochs start to get too high:
         we can't allow a wrap around, and we would prefer not to use
         64 bits.
+
+        Throws with lazy snapshots, and on domains with secondary indexes.
     */
     void compress_epochs();
 
@@ -119,6 +149,9 @@ private:
     typedef ACE_Mutex Mutex;
     mutable Mutex lock;
 
+    /// Domain whose epochs we keep track of
+    Domain & domain;
+
     struct Cleanup_Entry {
         Cleanup_Entry(Versioned_Object * object = 0,
                       Epoch valid_from = 0)
@@ -133,27 +166,165 @@ private:
     typedef std::vector<Cleanup_Entry> Cleanups;
 
     struct Entry {
+        /// Protects cleanups.  Entries are in map nodes, which are only
+        /// aligned to what malloc gives, so the lock is padded on both
+        /// sides to keep the node's links and our vectors off its line.
+        char padding1[CACHE_LINE_SIZE];
+        mutable Internal_Spinlock lock;
+        char padding2[CACHE_LINE_SIZE];
+
         std::set<Snapshot *> snapshots;
         Cleanups cleanups;
 
         void add_cleanup(const Cleanup_Entry & cleanup);
-        mutable Spinlock lock;
     };
 
     typedef std::map<Epoch, Entry> Entries;
     Entries entries;
 
+    bool vacuum_mode_;
+    bool lazy_snapshots_;
+
+    /// Protects dirty and vacuum_cursor
+    mutable Internal_Spinlock dirty_lock;
+
+    /// Objects with history to vacuum.  Ordered by address, so that
+    /// vacuum() can go round them from vacuum_cursor.
+    typedef std::set<Versioned_Object *> Dirty;
+    Dirty dirty;
+    Versioned_Object * vacuum_cursor;
+
     void dump_unlocked(std::ostream & stream = std::cerr);
 
     void validate_unlocked() const;
 
     void perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard);
+
+    /// Finished vacuuming an object; its destructor can go ahead
+    void unpin(Versioned_Object * obj);
+
+    static void run_cleanup(Versioned_Object * obj, Epoch valid_from,
+                            Epoch snapshot_epoch);
+    static void run_deferred_cleanup(Versioned_Object * obj,
+                                     Epoch valid_from, Epoch snapshot_epoch);
     
     friend class ::test0;
     template<class Var> friend void test0_type();
 };
 
-extern Snapshot_Info snapshot_info;
+
+
+/*****************************************************************************/
+/* DOMAIN                                                                    */
+/*****************************************************************************/
+
+/** An independent MVCC domain.  A domain has its own epoch clock, its own
+    table of live snapshots and cleanups, and its own commit lock.  Each
+    versioned object and each transaction belongs to exactly one domain.
+
+    Commits in one domain never advance the epoch of another, and a
+    long-lived snapshot in one domain never keeps the old versions of
+    another domain's objects alive.  Unrelated data sets can therefore
+    be put in separate domains so that they don't contend with each other.
+*/
+struct Domain : boost::noncopyable {
+    Domain();
+
+    Epoch current_epoch() const
+    {
+        return current_epoch_;
+    }
+
+    void set_current_epoch(Epoch val)
+    {
+        if (debug_level && val < current_epoch_)
+            throw Exception("current_epoch_ is decreasing");
+        current_epoch_ = val;
+    }
+
+    Epoch earliest_epoch() const
+    {
+        return earliest_epoch_;
+    }
+
+    void set_earliest_epoch(Epoch val)
+    {
+        if (debug_level && val < earliest_epoch_) {
+            using namespace std;
+            cerr << "val = " << val << endl;
+            cerr << "earliest_epoch = " << earliest_epoch_ << endl;
+            throw Exception("earliest epoch was not increasing");
+        }
+        if (debug_level && val > current_epoch_) {
+            throw Exception("earliest epoch after current epoch");
+        }
+        earliest_epoch_ = val;
+    }
+
+    /* The members are in three groups that each start a new cache line:
+       the epochs, which every transaction reads and only commits and
+       snapshot cleanups write; the snapshot list, which is written as
+       snapshots come and go; and the commit state, which only committers
+       touch.  Taking a snapshot therefore doesn't slow down readers of the
+       current epoch, and committing doesn't slow down taking snapshots. */
+
+    /// Number of committed transactions since the domain was created
+    volatile Epoch current_epoch_ JMVCC_CACHE_ALIGNED;
+
+    /// Earliest epoch for which there is a snapshot
+    Epoch earliest_epoch_;
+
+    /// Snapshots that are live in this domain, and their cleanups
+    Snapshot_Info snapshot_info JMVCC_CACHE_ALIGNED;
+
+    /// For the moment, only one commit can happen at a time in a domain
+    ACE_Mutex commit_lock JMVCC_CACHE_ALIGNED;
+
+    /// Transactions blocked in retry().  Protected by commit_lock.
+    std::vector<Retry_Waiter *> waiters;
+
+    /// Notifier to tell about changes made by commits, if any.  Protected
+    /// by commit_lock.
+    Change_Notifier * notifier;
+
+    /// Aggregates and indexes over objects in this domain, which commits
+    /// need to keep up to date.  Protected by commit_lock.
+    std::vector<Aggregate_Base *> aggregates;
+};
+
+
+/* The default domain.  The following globals and functions all refer to it;
+   they are kept for code that only ever needs a single domain. */
+
+/// Global variable giving the number of committed transactions since the
+/// beginning of the program
+extern volatile Epoch & current_epoch_;
+
+inline Epoch get_current_epoch()
+{
+    return default_domain.current_epoch();
+}
+
+inline void set_current_epoch(Epoch val)
+{
+    default_domain.set_current_epoch(val);
+}
+
+/// Global variable giving the earliest epoch for which there is a snapshot
+extern Epoch & earliest_epoch_;
+
+inline void set_earliest_epoch(Epoch val)
+{
+    default_domain.set_earliest_epoch(val);
+}
+
+inline Epoch get_earliest_epoch()
+{
+    return default_domain.earliest_epoch();
+}
+
+extern Snapshot_Info & snapshot_info;
+
 
 /// A snapshot provides a view of all objects that is frozen at the moment
 /// the shapshot was created.  Provides a read-only view.
@@ -187,7 +358,7 @@ std::ostream & operator << (std::ostream & stream, const Status & status);
     done.
 */
 struct Snapshot : boost::noncopyable {
-    Snapshot();
+    explicit Snapshot(Domain & domain = default_domain);
 
     ~Snapshot();
 
@@ -201,12 +372,55 @@ struct Snapshot : boost::noncopyable {
 
     void rename_epoch(Epoch old_epoch, Epoch new_epoch);
 
+    Domain & domain() const { return *domain_; }
+
+protected:
+    struct Unregistered {};
+
+    /// Construct without registering the snapshot.  The caller must call
+    /// register_me() before the snapshot is used.
+    Snapshot(Domain & domain, Unregistered);
+
+    struct Lazy {};
+
+    /// Construct a snapshot that is lazy if the domain has lazy snapshots
+    /// (see Snapshot_Info::set_lazy_snapshots()).  The caller must already
+    /// be in a critical section, and stay in it while the snapshot is used.
+    Snapshot(Domain & domain, Lazy);
+
+    struct Borrowed {};
+
+    /// Construct a snapshot at the same epoch as another one, which is
+    /// never registered.  The other one keeps the versions at that epoch
+    /// alive, so it must stay registered (or, if it's lazy, in its
+    /// critical section) for as long as this one is used.
+    Snapshot(const Snapshot & other, Borrowed);
+
+    /// Registers the snapshot at the current epoch; a lazy one only
+    /// records the epoch
+    void register_me();
+
+    /// Remove the snapshot from the domain while it's not being used, so
+    /// that it doesn't keep old versions alive.  register_me() puts it
+    /// back at the current epoch.
+    void unregister_me();
+
+    /** Register a lazy snapshot that has only recorded its epoch.  It's
+        registered at the current epoch, which moves epoch() on; nothing
+        may be read through the snapshot afterwards until it's restarted.
+        Does nothing for a snapshot that is already registered. */
+    void pin();
+
+    /// Is the snapshot in the domain's table?
+    bool registered() const { return epoch_ != 0 && (!lazy_ || pinned_); }
+
 private:
     friend class Snapshot_Info;
+    Domain * domain_;  ///< Domain in which the snapshot was taken
     Epoch epoch_;  ///< Epoch at which snapshot was taken
     int retries_;
-
-    void register_me();
+    bool lazy_;    ///< Only registered once pinned
+    bool pinned_;  ///< Lazy snapshot that has been registered
 
 public:
     Status status;
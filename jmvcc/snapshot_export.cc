@@ -0,0 +1,374 @@
+/* snapshot_export.cc
+   Jeremy Barnes, 20 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Export of a snapshot to a file that can be memory mapped.
+*/
+
+#include "snapshot_export.h"
+#include "jml/arch/exception.h"
+#include "jml/utils/string_functions.h"
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace JMVCC {
+
+namespace {
+
+const uint64_t IMAGE_MAGIC = 0x4a4d5643434d4150ULL;  // "JMVCCMAP"
+
+uint64_t align(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* SNAPSHOT_EXPORT                                                           */
+/*****************************************************************************/
+
+/** Writes a contiguous range of the entries into the mapped image.  Runs in
+    its own thread, reading through a shadow of the transaction that was
+    passed to write(), as reads update the transaction they go through. */
+
+struct Snapshot_Export::Write_Job {
+    const Snapshot_Export * exporter;
+    const Transaction * trans;
+    const vector<int> * order;      ///< Entries in index order
+    char * data;                    ///< Start of the data in the image
+    const Image_Entry * index;
+    int begin, end;
+    string * error;
+
+    void operator () ()
+    {
+        try {
+            In_Out_Critical critical;
+            Shadow_Transaction shadow(*trans);
+            current_trans = &shadow;
+
+            for (int i = begin;  i < end;  ++i) {
+                const Entry & entry = exporter->entries[(*order)[i]];
+                entry.copy_value(data + index[i].data_offset);
+            }
+
+            current_trans = 0;
+        } catch (const std::exception & exc) {
+            current_trans = 0;
+            *error = exc.what();
+        }
+    }
+};
+
+namespace {
+
+struct Compare_Names {
+    Compare_Names(const vector<string> & names)
+        : names(names)
+    {
+    }
+
+    const vector<string> & names;
+
+    bool operator () (int i1, int i2) const
+    {
+        return names[i1] < names[i2];
+    }
+};
+
+} // file scope
+
+void
+Snapshot_Export::
+write(const std::string & filename, Transaction & trans,
+      int num_threads) const
+{
+    size_t n = entries.size();
+
+    // The index is sorted by name so that readers can binary search it
+    vector<string> entry_names(n);
+    for (unsigned i = 0;  i < n;  ++i)
+        entry_names[i] = entries[i].name;
+
+    vector<int> order(n);
+    for (unsigned i = 0;  i < n;  ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), Compare_Names(entry_names));
+
+    for (unsigned i = 1;  i < n;  ++i)
+        if (entry_names[order[i]] == entry_names[order[i - 1]])
+            throw Exception("Snapshot_Export: duplicate name "
+                            + entry_names[order[i]]);
+
+    // Lay out the file.  Everything is known up front, as the values are
+    // all of fixed size.
+    Image_Header header;
+    header.magic = 0;
+    header.epoch = trans.epoch();
+    header.num_entries = n;
+    header.index_offset = align(sizeof(Image_Header), IMAGE_ALIGN);
+    header.names_offset = header.index_offset + n * sizeof(Image_Entry);
+
+    vector<Image_Entry> index(n);
+    uint64_t names_size = 0, data_size = 0;
+    for (unsigned i = 0;  i < n;  ++i) {
+        const Entry & entry = entries[order[i]];
+        index[i].name_offset = names_size;
+        index[i].data_offset = data_size;
+        index[i].size = entry.size;
+        names_size += entry.name.size() + 1;
+        data_size = align(data_size + entry.size, IMAGE_ALIGN);
+    }
+
+    header.data_offset = align(header.names_offset + names_size, IMAGE_ALIGN);
+    header.size = header.data_offset + data_size;
+
+    string tmp_filename = filename + ".tmp";
+
+    int fd = open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw Exception("Snapshot_Export: open " + tmp_filename + ": "
+                        + strerror(errno));
+
+    if (ftruncate(fd, header.size) == -1) {
+        int err = errno;
+        close(fd);
+        throw Exception(format("Snapshot_Export: ftruncate: %s",
+                               strerror(err)));
+    }
+
+    void * addr = mmap(0, header.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        throw Exception(format("Snapshot_Export: mmap: %s", strerror(errno)));
+
+    char * mem = reinterpret_cast<char *>(addr);
+
+    std::copy(index.begin(), index.end(),
+              reinterpret_cast<Image_Entry *>(mem + header.index_offset));
+
+    for (unsigned i = 0;  i < n;  ++i) {
+        const string & name = entries[order[i]].name;
+        memcpy(mem + header.names_offset + index[i].name_offset,
+               name.c_str(), name.size() + 1);
+    }
+
+    // Write the values in parallel, each thread taking a contiguous range
+    // of entries so that they write to different parts of the file.  The
+    // other threads can't see the transaction's own writes, so if it has
+    // any then we write everything ourselves.
+    if (num_threads < 1 || trans.num_local_values()) num_threads = 1;
+    if ((size_t)num_threads > n) num_threads = std::max<int>(n, 1);
+
+    vector<string> errors(num_threads);
+
+    if (num_threads == 1) {
+        Transaction * old_trans = current_trans;
+        try {
+            In_Out_Critical critical;
+            current_trans = &trans;
+            for (unsigned i = 0;  i < n;  ++i)
+                entries[order[i]].copy_value(mem + header.data_offset
+                                             + index[i].data_offset);
+            current_trans = old_trans;
+        } catch (const std::exception & exc) {
+            current_trans = old_trans;
+            errors[0] = exc.what();
+        }
+    }
+    else {
+        boost::thread_group threads;
+
+        for (int i = 0;  i < num_threads;  ++i) {
+            Write_Job job;
+            job.exporter = this;
+            job.trans = &trans;
+            job.order = &order;
+            job.data = mem + header.data_offset;
+            job.index = &index[0];
+            job.begin = n * i / num_threads;
+            job.end = n * (i + 1) / num_threads;
+            job.error = &errors[i];
+            threads.create_thread(job);
+        }
+
+        threads.join_all();
+    }
+
+    for (int i = 0;  i < num_threads;  ++i) {
+        if (errors[i].empty()) continue;
+        munmap(addr, header.size);
+        unlink(tmp_filename.c_str());
+        throw Exception("Snapshot_Export: error writing values: " + errors[i]);
+    }
+
+    // The magic goes in last, so that a reader can tell a complete image
+    header.magic = IMAGE_MAGIC;
+    memcpy(mem, &header, sizeof(header));
+
+    int res = msync(addr, header.size, MS_SYNC);
+    munmap(addr, header.size);
+    if (res == -1)
+        throw Exception(format("Snapshot_Export: msync: %s", strerror(errno)));
+
+    if (rename(tmp_filename.c_str(), filename.c_str()) == -1)
+        throw Exception("Snapshot_Export: rename to " + filename + ": "
+                        + strerror(errno));
+}
+
+
+/*****************************************************************************/
+/* SNAPSHOT_IMAGE                                                            */
+/*****************************************************************************/
+
+namespace {
+
+/** Check that everything the header and the index point to is inside an
+    image of the given size, and that every name is terminated within it.
+    Returns what's wrong, or zero if nothing is.  The header must already
+    be known to fit. */
+const char * check_image(const char * mem, uint64_t size)
+{
+    const Image_Header & header = *reinterpret_cast<const Image_Header *>(mem);
+
+    if (header.magic != IMAGE_MAGIC || header.size != size)
+        return "is not a complete snapshot image";
+
+    if (header.index_offset < sizeof(Image_Header)
+        || header.index_offset > size
+        || header.index_offset % sizeof(uint64_t) != 0
+        || header.num_entries > (size - header.index_offset)
+                                / sizeof(Image_Entry))
+        return "has an index outside of the image";
+
+    uint64_t index_end
+        = header.index_offset + header.num_entries * sizeof(Image_Entry);
+    if (header.names_offset < index_end || header.names_offset > size
+        || header.data_offset < header.names_offset
+        || header.data_offset > size)
+        return "has sections outside of the image";
+
+    const Image_Entry * index
+        = reinterpret_cast<const Image_Entry *>(mem + header.index_offset);
+    const char * names = mem + header.names_offset;
+    uint64_t names_size = header.data_offset - header.names_offset;
+    uint64_t data_size = size - header.data_offset;
+
+    for (uint64_t i = 0;  i < header.num_entries;  ++i) {
+        const Image_Entry & entry = index[i];
+        if (entry.name_offset >= names_size
+            || !memchr(names + entry.name_offset, 0,
+                       names_size - entry.name_offset))
+            return "has a name outside of the image";
+        if (entry.data_offset > data_size
+            || entry.size > data_size - entry.data_offset)
+            return "has a value outside of the image";
+    }
+
+    return 0;
+}
+
+} // file scope
+
+Snapshot_Image::
+Snapshot_Image(const std::string & filename)
+    : header(0), index(0), names(0), values(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw Exception("Snapshot_Image: open " + filename + ": "
+                        + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        throw Exception(format("Snapshot_Image: fstat: %s", strerror(err)));
+    }
+
+    if ((uint64_t)st.st_size < sizeof(Image_Header)) {
+        close(fd);
+        throw Exception("Snapshot_Image: " + filename + " is too short");
+    }
+
+    void * addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        throw Exception(format("Snapshot_Image: mmap: %s", strerror(errno)));
+
+    const char * mem = reinterpret_cast<const char *>(addr);
+
+    // Nothing in the file is trusted until it's been checked
+    const char * error = check_image(mem, st.st_size);
+    if (error) {
+        munmap(addr, st.st_size);
+        throw Exception("Snapshot_Image: " + filename + " " + error);
+    }
+
+    header = reinterpret_cast<const Image_Header *>(mem);
+
+    index = reinterpret_cast<const Image_Entry *>(mem + header->index_offset);
+    names = mem + header->names_offset;
+    values = mem + header->data_offset;
+}
+
+Snapshot_Image::
+~Snapshot_Image()
+{
+    if (header)
+        munmap(const_cast<Image_Header *>(header), header->size);
+}
+
+const char *
+Snapshot_Image::
+name(int i) const
+{
+    if (i < 0 || (uint64_t)i >= header->num_entries)
+        throw Exception("Snapshot_Image: entry out of range");
+    return names + index[i].name_offset;
+}
+
+const void *
+Snapshot_Image::
+data(int i) const
+{
+    if (i < 0 || (uint64_t)i >= header->num_entries)
+        throw Exception("Snapshot_Image: entry out of range");
+    return values + index[i].data_offset;
+}
+
+const void *
+Snapshot_Image::
+find(const std::string & name, size_t & size) const
+{
+    uint64_t lo = 0, hi = header->num_entries;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name.c_str(), names + index[mid].name_offset);
+        if (cmp == 0) {
+            size = index[mid].size;
+            return values + index[mid].data_offset;
+        }
+        if (cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+
+    return 0;
+}
+
+} // namespace JMVCC
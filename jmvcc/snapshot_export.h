@@ -0,0 +1,194 @@
+/* snapshot_export.h                                               -*- C++ -*-
+   Jeremy Barnes, 20 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Export of a snapshot to a file that can be memory mapped.
+*/
+
+#ifndef __jmvcc__snapshot_export_h__
+#define __jmvcc__snapshot_export_h__
+
+#include "transaction.h"
+#include "versioned.h"
+#include "versioned2.h"
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/utility.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
+#include <boost/type_traits/has_trivial_destructor.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+
+namespace JMVCC {
+
+
+/* Snapshot Images
+
+   A snapshot image is a flat file containing the values of a set of
+   named objects as they were in a single snapshot.  It is laid out so
+   that it can be memory mapped and used directly, without any parsing or
+   copying:
+
+       Header    magic, epoch, number of entries, offsets of the rest
+       Index     one Image_Entry per object, sorted by name
+       Names     the object names, null terminated
+       Data      the values, each aligned to IMAGE_ALIGN bytes
+
+   All offsets are from the start of the file, so the image can be mapped
+   anywhere.  Only types that are trivially copyable can be exported, as
+   their bytes are written out directly.
+
+   This lets analysis programs read a consistent image of the state
+   without needing to run inside one of our transactions.
+*/
+
+enum {
+    IMAGE_ALIGN = 16   ///< Alignment of the values in the image
+};
+
+struct Image_Header {
+    uint64_t magic;
+    uint64_t epoch;            ///< Epoch of the snapshot
+    uint64_t num_entries;
+    uint64_t index_offset;     ///< Offset of the Image_Entry array
+    uint64_t names_offset;     ///< Offset of the names
+    uint64_t data_offset;      ///< Offset of the values
+    uint64_t size;             ///< Total size of the file
+};
+
+struct Image_Entry {
+    uint64_t name_offset;      ///< Offset of the name, from names_offset
+    uint64_t data_offset;      ///< Offset of the value, from data_offset
+    uint64_t size;             ///< Size of the value in bytes
+};
+
+
+/*****************************************************************************/
+/* SNAPSHOT_EXPORT                                                           */
+/*****************************************************************************/
+
+/** Writes the values of a set of objects, as seen by a transaction, to a
+    snapshot image.  The objects are added once, and then the export can be
+    written as many times as needed.
+
+    The values are written by several threads at once, straight into the
+    mapped file.  Each of them reads through a Shadow_Transaction at the
+    epoch of the same transaction, so the image is consistent.
+*/
+
+struct Snapshot_Export : boost::noncopyable {
+
+    template<typename T, typename Lock>
+    void add(const std::string & name, const Versioned<T, Lock> & var)
+    {
+        add_entry<T>(name, var);
+    }
+
+    template<typename T>
+    void add(const std::string & name, const Versioned2<T> & var)
+    {
+        add_entry<T>(name, var);
+    }
+
+    size_t size() const { return entries.size(); }
+
+    /** Write the image, as seen by the given transaction, to the given
+        file.  The transaction must not be used by anything else while
+        this is happening.  If it has uncommitted writes, which the other
+        threads can't see, the values are all written by the calling
+        thread.  The image is written under a temporary name and renamed
+        once it is complete, so a reader never sees a partial image. */
+    void write(const std::string & filename, Transaction & trans,
+               int num_threads = 4) const;
+
+private:
+    typedef boost::function<void (void * dest)> Copy_Value;
+
+    struct Entry {
+        std::string name;
+        size_t size;
+        Copy_Value copy_value;
+    };
+
+    std::vector<Entry> entries;
+
+    template<typename T, typename Var>
+    static void copy_value(const Var * var, void * dest)
+    {
+        T value = var->read();
+        std::memcpy(dest, &value, sizeof(T));
+    }
+
+    template<typename T, typename Var>
+    void add_entry(const std::string & name, const Var & var)
+    {
+        BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+        BOOST_STATIC_ASSERT(boost::has_trivial_destructor<T>::value);
+
+        Entry entry;
+        entry.name = name;
+        entry.size = sizeof(T);
+        entry.copy_value = boost::bind(&copy_value<T, Var>, &var, _1);
+        entries.push_back(entry);
+    }
+
+    struct Write_Job;
+};
+
+
+/*****************************************************************************/
+/* SNAPSHOT_IMAGE                                                            */
+/*****************************************************************************/
+
+/** A snapshot image, mapped read-only into memory.  Values are returned
+    in place; they stay valid for as long as the image is open.  Every
+    offset in the file is checked against its size when it's opened, so a
+    corrupt image is rejected rather than read outside of the mapping. */
+
+struct Snapshot_Image : boost::noncopyable {
+    explicit Snapshot_Image(const std::string & filename);
+
+    ~Snapshot_Image();
+
+    Epoch epoch() const { return header->epoch; }
+
+    size_t size() const { return header->num_entries; }
+
+    /// Name of the ith object.  Throws if i is out of range.
+    const char * name(int i) const;
+
+    /// Value of the ith object.  Throws if i is out of range.
+    const void * data(int i) const;
+
+    /// Return the value of the given object and its size, or zero if there
+    /// is no object of that name.
+    const void * find(const std::string & name, size_t & size) const;
+
+    /// Return the value of the given object, checking its size
+    template<typename T>
+    const T & get(const std::string & name) const
+    {
+        size_t size;
+        const void * result = find(name, size);
+        if (!result)
+            throw ML::Exception("Snapshot_Image: no object " + name);
+        if (size != sizeof(T))
+            throw ML::Exception("Snapshot_Image: object " + name
+                                + " has the wrong size");
+        return *reinterpret_cast<const T *>(result);
+    }
+
+private:
+    const Image_Header * header;
+    const Image_Entry * index;
+    const char * names;
+    const char * values;
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__snapshot_export_h__ */
@@ -17,17 +17,46 @@ namespace JMVCC {
 
 inline
 Snapshot::
-Snapshot()
-    : retries_(0), status(UNINITIALIZED)
+Snapshot(Domain & domain)
+    : domain_(&domain), retries_(0), lazy_(false), pinned_(false),
+      status(UNINITIALIZED)
 {
     register_me();
 }
 
+inline
+Snapshot::
+Snapshot(Domain & domain, Unregistered)
+    : domain_(&domain), epoch_(0), retries_(0), lazy_(false), pinned_(false),
+      status(UNINITIALIZED)
+{
+}
+
+inline
+Snapshot::
+Snapshot(Domain & domain, Lazy)
+    : domain_(&domain), retries_(0),
+      lazy_(domain.snapshot_info.lazy_snapshots()), pinned_(false),
+      status(UNINITIALIZED)
+{
+    register_me();
+}
+
+inline
+Snapshot::
+Snapshot(const Snapshot & other, Borrowed)
+    : domain_(other.domain_), epoch_(other.epoch_), retries_(0),
+      lazy_(true), pinned_(false), status(UNINITIALIZED)
+{
+    // As a lazy snapshot that isn't pinned, it's not in the table
+}
+
 inline
 Snapshot::
 ~Snapshot()
 {
-    snapshot_info.remove_snapshot(this);
+    if (registered())
+        domain_->snapshot_info.remove_snapshot(this);
 }
 
 inline
@@ -35,9 +64,9 @@ void
 Snapshot::
 restart()
 {
-    status = RESTARTING;
+    if (debug_level) status = RESTARTING;
     ++retries_;
-    set_epoch(get_current_epoch());
+    set_epoch(domain_->current_epoch());
 }
 
 inline
@@ -45,12 +74,41 @@ void
 Snapshot::
 register_me()
 {
-    snapshot_info.register_snapshot(this);
+    if (lazy_) {
+        // Entering the critical section was a full barrier, so a cleanup
+        // scheduled before it could only be of a version older than this
+        epoch_ = domain_->current_epoch();
+        pinned_ = false;
+    }
+    else domain_->snapshot_info.register_snapshot(this);
+
+    if (debug_level) {
+        if (status == UNINITIALIZED)
+            status = INITIALIZED;
+        else if (status == RESTARTING)
+            status = RESTARTED;
+    }
+}
+
+inline
+void
+Snapshot::
+unregister_me()
+{
+    if (registered())
+        domain_->snapshot_info.remove_snapshot(this);
+    epoch_ = 0;
+    pinned_ = false;
+}
 
-    if (status == UNINITIALIZED)
-        status = INITIALIZED;
-    else if (status == RESTARTING)
-        status = RESTARTED;
+inline
+void
+Snapshot::
+pin()
+{
+    if (!lazy_ || pinned_) return;
+    domain_->snapshot_info.register_snapshot(this);
+    pinned_ = true;
 }
 
 inline
@@ -59,7 +117,8 @@ Snapshot::
 set_epoch(Epoch new_epoch)
 {
     if (new_epoch != epoch_) {
-        snapshot_info.remove_snapshot(this);
+        if (registered())
+            domain_->snapshot_info.remove_snapshot(this);
         register_me();
     }        
 }
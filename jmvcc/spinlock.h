@@ -6,8 +6,39 @@
 #ifndef __jmvcc__spinlock_h__
 #define __jmvcc__spinlock_h__
 
+#include "jmvcc_defs.h"
+#include <sched.h>
+
+
+/** Set to one to use the Ticket_Spinlock inside the library instead of the
+    plain test-and-set Spinlock.  Only do so when each thread that uses the
+    library has a CPU to itself and fair access to the locks matters more
+    than throughput.  When there are more threads than CPUs, a thread that
+    takes its ticket and is then descheduled holds up everyone behind it,
+    and every acquisition becomes a trip through the scheduler; with two
+    threads on one CPU the ticket lock is several times slower than the
+    Spinlock (see spinlock_test).
+*/
+#ifndef JMVCC_TICKET_SPINLOCK
+#  define JMVCC_TICKET_SPINLOCK 0
+#endif
+
+
 namespace JMVCC {
 
+enum { CACHE_LINE_SIZE = JMVCC_CACHE_LINE_SIZE };
+
+/// Tell the CPU that we're spinning, so that it can let the other
+/// hyperthread run and doesn't punish us on the way out of the loop
+inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__ ("pause" : : : "memory");
+#else
+    __asm__ __volatile__ ("" : : : "memory");
+#endif
+}
+
 struct Spinlock {
     Spinlock()
         : value(0)
@@ -35,7 +66,177 @@ struct Spinlock {
     volatile int value;
 };
 
+
+/*****************************************************************************/
+/* TICKET_SPINLOCK                                                           */
+/*****************************************************************************/
+
+/** Spinlock that is granted in the order that it was asked for.  Each thread
+    takes a ticket and waits until it is being served, only reading the lock
+    while it waits; the line is only written once per acquire and release.
+    Waiters back off in proportion to the number of threads in front of
+    them, and give up the CPU as soon as the queue stops moving.
+
+    The lock takes up a whole cache line so that spinning on it doesn't
+    slow down access to the data next to it.
+
+    The lock can only be handed on to a thread that's running, so it's fair
+    but slower than the Spinlock when there are more threads than CPUs;
+    see JMVCC_TICKET_SPINLOCK.
+*/
+
+struct Ticket_Spinlock {
+    Ticket_Spinlock()
+        : next(0), serving(0)
+    {
+    }
+
+    int acquire()
+    {
+        unsigned ticket = __sync_fetch_and_add(&next, 1);
+
+        for (unsigned last = serving, spun = 0;  ;) {
+            unsigned now = serving;
+            if (now == ticket) break;
+
+            // Only keep spinning while the queue is moving.  If it has
+            // stopped then whoever is at the front isn't running, and
+            // we're most likely standing in the way of it getting the CPU.
+            if (now != last) {
+                last = now;
+                spun = 0;
+            }
+            else if (spun >= MAX_SPIN) {
+                spun = 0;
+                sched_yield();
+                continue;
+            }
+
+            unsigned pauses = (ticket - now) * BACKOFF;
+            if (pauses > MAX_SPIN) pauses = MAX_SPIN;
+            for (unsigned i = 0;  i < pauses;  ++i)
+                cpu_relax();
+            spun += pauses;
+        }
+
+        __asm__ __volatile__ ("" : : : "memory");
+        return 0;
+    }
+
+    int tryacquire()
+    {
+        unsigned now = serving;
+        return __sync_bool_compare_and_swap(&next, now, now + 1) ? 0 : -1;
+    }
+
+    int release()
+    {
+        __sync_fetch_and_add(&serving, 1);
+        return 0;
+    }
+
+private:
+    enum {
+        BACKOFF = 16,     ///< Pauses per waiter in front of us
+        MAX_SPIN = 128    ///< Pauses without progress before we yield
+    };
+
+    volatile unsigned next;     ///< Next ticket to give out
+    volatile unsigned serving;  ///< Ticket that holds the lock
+    char padding[CACHE_LINE_SIZE - 2 * sizeof(unsigned)];
+} JMVCC_CACHE_ALIGNED;
+
+
+/*****************************************************************************/
+/* RW_SPINLOCK                                                               */
+/*****************************************************************************/
+
+/** Reader-writer spinlock in a single word, small enough to go in each
+    versioned object.  Readers never wait for each other, only for a writer.
+    A writer first stops new readers from coming in and then waits for the
+    ones inside to leave, so a stream of readers can't starve it.
+
+    It works with ACE_Read_Guard and ACE_Write_Guard, which both call
+    release(); the lock works out which kind of holder is releasing it.
+    ACE_Guard takes it for writing.
+*/
+
+struct RW_Spinlock {
+    RW_Spinlock()
+        : value(0)
+    {
+    }
+
+    int acquire_read()
+    {
+        for (unsigned spun = 0;  ;  ++spun) {
+            unsigned v = value;
+            if (!(v & WRITER)
+                && __sync_bool_compare_and_swap(&value, v, v + 1))
+                return 0;
+            wait(spun);
+        }
+    }
+
+    int acquire_write()
+    {
+        // Stop any more readers from getting in...
+        for (unsigned spun = 0;  ;  ++spun) {
+            unsigned v = value;
+            if (!(v & WRITER)
+                && __sync_bool_compare_and_swap(&value, v, v | WRITER))
+                break;
+            wait(spun);
+        }
+
+        // ... and wait for the ones that are in to leave
+        for (unsigned spun = 0;  value != WRITER;  ++spun)
+            wait(spun);
+
+        __asm__ __volatile__ ("" : : : "memory");
+        return 0;
+    }
+
+    int acquire()
+    {
+        return acquire_write();
+    }
+
+    int release()
+    {
+        // A writer only holds the lock when there are no readers in it, and
+        // no reader can get in while it does
+        if (value == WRITER) __sync_fetch_and_and(&value, ~WRITER);
+        else __sync_fetch_and_add(&value, -1);
+        return 0;
+    }
+
+private:
+    enum {
+        WRITER = 1u << 31,  ///< Writer holds or is waiting; rest is readers
+        MAX_SPIN = 128      ///< Times around before we give up the CPU
+    };
+
+    static void wait(unsigned & spun)
+    {
+        cpu_relax();
+        if (spun == MAX_SPIN) {
+            spun = 0;
+            sched_yield();
+        }
+    }
+
+    volatile unsigned value;
+};
+
+
+/// Spinlock used inside the library
+#if JMVCC_TICKET_SPINLOCK
+typedef Ticket_Spinlock Internal_Spinlock;
+#else
+typedef Spinlock Internal_Spinlock;
+#endif
+
 } // namespace JMVCC
 
 #endif /* __jmvcc__spinlock_h__ */
-
@@ -0,0 +1,401 @@
+/* aggregate_test.cc
+   Jeremy Barnes, 26 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of incrementally maintained aggregates.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/demangle.h"
+#include "jmvcc/aggregate.h"
+#include <new>
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+template<class Var>
+void do_basic_test()
+{
+    cerr << "basic test class " << demangle(typeid(Var).name()) << endl;
+
+    Var a(3), b(7), c(5), other(100);
+
+    Aggregate<int> agg;
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 0);
+        BOOST_CHECK_EQUAL(agg.sum(), 0);
+    }
+
+    agg.add(a);
+    agg.add(b);
+    agg.add(c);
+
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(agg.add(a), Exception);
+    }
+
+    Local_Transaction before;
+    BOOST_CHECK_EQUAL(agg.count(), 3);
+    BOOST_CHECK_EQUAL(agg.sum(), 15);
+    BOOST_CHECK_EQUAL(agg.min(), 3);
+    BOOST_CHECK_EQUAL(agg.max(), 7);
+
+    // Writes to objects that aren't members don't change it
+    {
+        Local_Transaction trans;
+        other.write(-1000);
+        BOOST_CHECK(trans.commit());
+    }
+
+    // Increasing the minimum moves it to the next smallest
+    {
+        Local_Transaction trans;
+        a.write(6);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 3);
+        BOOST_CHECK_EQUAL(agg.sum(), 18);
+        BOOST_CHECK_EQUAL(agg.min(), 5);
+        BOOST_CHECK_EQUAL(agg.max(), 7);
+    }
+
+    // Several members in one commit
+    {
+        Local_Transaction trans;
+        b.write(-2);
+        c.write(20);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.sum(), 24);
+        BOOST_CHECK_EQUAL(agg.min(), -2);
+        BOOST_CHECK_EQUAL(agg.max(), 20);
+    }
+
+    // Duplicate values are each counted
+    {
+        Local_Transaction trans;
+        a.write(20);
+        BOOST_CHECK(trans.commit());
+    }
+    {
+        Local_Transaction trans;
+        c.write(1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.sum(), 19);
+        BOOST_CHECK_EQUAL(agg.min(), -2);
+        BOOST_CHECK_EQUAL(agg.max(), 20);
+    }
+
+    // The old snapshot still sees the old aggregate
+    BOOST_CHECK_EQUAL(agg.sum(), 15);
+    BOOST_CHECK_EQUAL(agg.min(), 3);
+    BOOST_CHECK_EQUAL(agg.max(), 7);
+
+    // Transactions that write different members don't conflict, even
+    // though both of them change the aggregate
+    Transaction * old_trans = current_trans;
+    Transaction t1(default_domain, false), t2(default_domain, false);
+
+    current_trans = &t1;
+    a.write(0);
+    current_trans = &t2;
+    b.write(0);
+
+    current_trans = &t1;
+    BOOST_CHECK(t1.commit());
+    current_trans = &t2;
+    BOOST_CHECK(t2.commit());
+    current_trans = old_trans;
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.sum(), 1);
+        BOOST_CHECK_EQUAL(agg.min(), 0);
+        BOOST_CHECK_EQUAL(agg.max(), 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_basic )
+{
+    do_basic_test<Versioned<int> >();
+    do_basic_test<Versioned2<int> >();
+}
+
+template<class Var>
+void do_remove_test()
+{
+    cerr << "remove test class " << demangle(typeid(Var).name()) << endl;
+
+    Aggregate<int> agg;
+    Var a(3), b(7), c(5);
+
+    agg.add(a);
+    agg.add(b);
+    agg.add(c);
+
+    {
+        Local_Transaction before;
+
+        agg.remove(b);
+
+        {
+            JML_TRACE_EXCEPTIONS(false);
+            BOOST_CHECK_THROW(agg.remove(b), Exception);
+        }
+
+        {
+            Local_Transaction trans;
+            BOOST_CHECK_EQUAL(agg.count(), 2);
+            BOOST_CHECK_EQUAL(agg.sum(), 8);
+            BOOST_CHECK_EQUAL(agg.min(), 3);
+            BOOST_CHECK_EQUAL(agg.max(), 5);
+        }
+
+        // Like any other commit, the removal isn't seen by older snapshots
+        BOOST_CHECK_EQUAL(agg.count(), 3);
+        BOOST_CHECK_EQUAL(agg.max(), 7);
+    }
+
+    // Writes to it are no longer counted
+    {
+        Local_Transaction trans;
+        b.write(100);
+        a.write(4);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 2);
+        BOOST_CHECK_EQUAL(agg.sum(), 9);
+        BOOST_CHECK_EQUAL(agg.max(), 5);
+    }
+
+    // A member that is destroyed is taken out by the next commit that
+    // writes a member
+    {
+        Var d(50);
+        agg.add(d);
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 3);
+        BOOST_CHECK_EQUAL(agg.max(), 50);
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 3);
+    }
+
+    {
+        Local_Transaction trans;
+        a.write(4);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 2);
+        BOOST_CHECK_EQUAL(agg.sum(), 9);
+        BOOST_CHECK_EQUAL(agg.max(), 5);
+    }
+
+    // A new member can be at the address of one that is waiting to be
+    // taken out
+    {
+        void * mem = operator new (sizeof(Var));
+        Var * d = new (mem) Var(60);
+        agg.add(*d);
+        d->~Var();
+
+        Var * e = new (mem) Var(70);
+        agg.add(*e);
+
+        {
+            Local_Transaction trans;
+            BOOST_CHECK_EQUAL(agg.count(), 3);
+            BOOST_CHECK_EQUAL(agg.max(), 70);
+        }
+
+        e->~Var();
+        operator delete (mem);
+    }
+
+    {
+        Local_Transaction trans;
+        a.write(4);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 2);
+        BOOST_CHECK_EQUAL(agg.max(), 5);
+    }
+
+    // An empty aggregate has no minimum or maximum
+    agg.remove(a);
+    agg.remove(c);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 0);
+        BOOST_CHECK_EQUAL(agg.sum(), 0);
+
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(agg.min(), Exception);
+        BOOST_CHECK_THROW(agg.max(), Exception);
+    }
+
+    // They can be added back
+    agg.add(c);
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(agg.count(), 1);
+        BOOST_CHECK_EQUAL(agg.min(), 5);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_remove )
+{
+    do_remove_test<Versioned<int> >();
+    do_remove_test<Versioned2<int> >();
+}
+
+template<class Var>
+struct Aggregate_Test_Thread {
+    Var * vars;
+    int nvars;
+    Aggregate<int> & agg;
+    int iter;
+    boost::barrier & barrier;
+    size_t & failures;
+    size_t & errors;
+
+    Aggregate_Test_Thread(Var * vars, int nvars, Aggregate<int> & agg,
+                          int iter, boost::barrier & barrier,
+                          size_t & failures, size_t & errors)
+        : vars(vars), nvars(nvars), agg(agg), iter(iter), barrier(barrier),
+          failures(failures), errors(errors)
+    {
+    }
+
+    void operator () ()
+    {
+        barrier.wait();
+
+        int local_errors = 0;
+        int local_failures = 0;
+
+        for (unsigned i = 0;  i < iter;  ++i) {
+            int var1 = random() % nvars, var2 = random() % nvars;
+
+            bool succeeded = false;
+
+            while (!succeeded) {
+                Local_Transaction trans;
+
+                // The aggregate must agree with the values in our snapshot
+                Aggregate_Value<int> value = agg.read();
+
+                int total = 0, min = vars[0].read(), max = min;
+                for (unsigned j = 0;  j < nvars;  ++j) {
+                    int val = vars[j].read();
+                    total += val;
+                    min = std::min(min, val);
+                    max = std::max(max, val);
+                }
+
+                if (value.sum != 0 || total != 0 || value.min != min
+                    || value.max != max || value.count != nvars) {
+                    cerr << "aggregate " << value << " total " << total
+                         << " min " << min << " max " << max << endl;
+                    ++local_errors;
+                }
+
+                vars[var1].mutate() -= 1;
+                vars[var2].mutate() += 1;
+
+                succeeded = trans.commit();
+                local_failures += !succeeded;
+            }
+        }
+
+        static Lock lock;
+        Guard guard(lock);
+
+        errors += local_errors;
+        failures += local_failures;
+    }
+};
+
+template<class Var>
+void run_aggregate_test(int nvars, int nthreads, int niter)
+{
+    cerr << "aggregate test with " << nvars << " vars, " << nthreads
+         << " threads class " << demangle(typeid(Var).name()) << endl;
+
+    Var vars[nvars];
+    for (unsigned i = 0;  i < nvars;  ++i) {
+        Local_Transaction trans;
+        vars[i].write(0);
+        trans.commit();
+    }
+
+    Aggregate<int> agg;
+    for (unsigned i = 0;  i < nvars;  ++i)
+        agg.add(vars[i]);
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+    size_t failures = 0, errors = 0;
+
+    Timer timer;
+
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(Aggregate_Test_Thread<Var>(vars, nvars, agg, niter,
+                                                    barrier, failures,
+                                                    errors));
+
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+    cerr << "failures: " << failures << endl;
+
+    BOOST_CHECK_EQUAL(errors, 0);
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(agg.sum(), 0);
+    BOOST_CHECK_EQUAL(agg.count(), nvars);
+}
+
+BOOST_AUTO_TEST_CASE( test_threaded )
+{
+    run_aggregate_test<Versioned<int> >(100, 8, 2000);
+    run_aggregate_test<Versioned2<int> >(100, 8, 2000);
+    run_aggregate_test<Versioned<int> >(10, 8, 2000);
+    run_aggregate_test<Versioned2<int> >(10, 8, 2000);
+}
@@ -0,0 +1,209 @@
+/* change_notifier_test.cc
+   Jeremy Barnes, 24 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of change notifications.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jmvcc/change_notifier.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+/// Records the notifications that it gets
+struct Recorder {
+    Recorder()
+        : calls(0), out_of_order(0), last_epoch(0)
+    {
+    }
+
+    void operator () (Epoch epoch, const Change_Notifier::Objects & objects)
+    {
+        ACE_Guard<ACE_Mutex> guard(lock);
+        ++calls;
+        if (epoch <= last_epoch) ++out_of_order;
+        last_epoch = epoch;
+        last_objects = objects;
+        std::sort(last_objects.begin(), last_objects.end());
+        thread = boost::this_thread::get_id();
+    }
+
+    int calls;
+    int out_of_order;
+    Epoch last_epoch;
+    Change_Notifier::Objects last_objects;
+    boost::thread::id thread;
+    ACE_Mutex lock;
+};
+
+BOOST_AUTO_TEST_CASE( test_notifications )
+{
+    Domain domain;
+    Versioned<int> var1(domain, 0), var2(domain, 0), var3(domain, 0);
+
+    Change_Notifier notifier(domain);
+
+    Recorder r1, r2;
+    int id1 = notifier.subscribe(var1, boost::ref(r1));
+
+    Change_Notifier::Objects objects;
+    objects.push_back(&var1);
+    objects.push_back(&var2);
+    notifier.subscribe(objects, boost::ref(r2));
+
+    {
+        Local_Transaction trans(domain);
+        var1.write(1);
+        var2.write(2);
+        BOOST_CHECK(trans.commit());
+    }
+
+    notifier.wait_until_idle();
+
+    // One call per subscriber for the epoch, with everything that changed
+    BOOST_CHECK_EQUAL(notifier.batches_delivered(), 1);
+    BOOST_CHECK_EQUAL(r1.calls, 1);
+    BOOST_CHECK_EQUAL(r1.last_epoch, domain.current_epoch());
+    BOOST_CHECK_EQUAL(r1.last_objects.size(), 1);
+    BOOST_CHECK_EQUAL(r2.calls, 1);
+    BOOST_CHECK_EQUAL(r2.last_objects.size(), 2);
+
+    // Delivered on the notifier's thread, not the committing one
+    BOOST_CHECK(r1.thread != boost::this_thread::get_id());
+
+    // Nobody is subscribed to var3
+    {
+        Local_Transaction trans(domain);
+        var3.write(3);
+        BOOST_CHECK(trans.commit());
+    }
+
+    notifier.wait_until_idle();
+    BOOST_CHECK_EQUAL(notifier.batches_delivered(), 1);
+
+    notifier.unsubscribe(id1);
+
+    {
+        Local_Transaction trans(domain);
+        var1.write(4);
+        BOOST_CHECK(trans.commit());
+    }
+
+    notifier.wait_until_idle();
+    BOOST_CHECK_EQUAL(notifier.batches_delivered(), 2);
+    BOOST_CHECK_EQUAL(r1.calls, 1);
+    BOOST_CHECK_EQUAL(r2.calls, 2);
+    BOOST_CHECK_EQUAL(r2.last_objects.size(), 1);
+
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(notifier.unsubscribe(id1), Exception);
+        BOOST_CHECK_THROW(Change_Notifier notifier2(domain), Exception);
+    }
+}
+
+/// Keeps a derived value up to date with a transaction of its own, which
+/// would deadlock if it were called with the commit lock held.
+struct Doubler {
+    Doubler(Versioned2<int> & source, Versioned2<int> & doubled)
+        : source(source), doubled(doubled)
+    {
+    }
+
+    Versioned2<int> & source;
+    Versioned2<int> & doubled;
+
+    void operator () (Epoch epoch, const Change_Notifier::Objects & objects)
+    {
+        Local_Transaction trans(source.domain());
+        do {
+            doubled.write(source.read() * 2);
+        } while (!trans.commit());
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_notification_commits )
+{
+    Domain domain;
+    Versioned2<int> source(domain, 0), doubled(domain, 0);
+
+    Change_Notifier notifier(domain);
+    notifier.subscribe(source, Doubler(source, doubled));
+
+    {
+        Local_Transaction trans(domain);
+        source.write(21);
+        BOOST_CHECK(trans.commit());
+    }
+
+    notifier.wait_until_idle();
+
+    Local_Transaction trans(domain);
+    BOOST_CHECK_EQUAL(doubled.read(), 42);
+}
+
+template<class Var>
+void notification_test_thread(Var & var, int iter, boost::barrier & barrier)
+{
+    barrier.wait();
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans(var.domain());
+        do {
+            var.mutate() += 1;
+        } while (!trans.commit());
+    }
+}
+
+template<class Var>
+void run_notification_threads_test(int nthreads, int niter)
+{
+    cerr << "notification test with " << nthreads << " threads" << endl;
+
+    Domain domain;
+    Var var(domain, 0);
+
+    Change_Notifier notifier(domain);
+    Recorder recorder;
+    notifier.subscribe(var, boost::ref(recorder));
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&notification_test_thread<Var>,
+                                     boost::ref(var), niter,
+                                     boost::ref(barrier)));
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+
+    notifier.wait_until_idle();
+
+    // One notification per commit, delivered in epoch order
+    BOOST_CHECK_EQUAL(recorder.calls, nthreads * niter);
+    BOOST_CHECK_EQUAL(recorder.out_of_order, 0);
+    BOOST_CHECK_EQUAL(recorder.last_epoch, domain.current_epoch());
+}
+
+BOOST_AUTO_TEST_CASE( test_notification_threads )
+{
+    run_notification_threads_test<Versioned<int> >(4, 1000);
+    run_notification_threads_test<Versioned2<int> >(4, 1000);
+}
@@ -0,0 +1,339 @@
+/* domain_test.cc
+   Jeremy Barnes, 13 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of independent MVCC domains.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/threads.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jml/arch/demangle.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+template<class Var>
+void do_domain_test()
+{
+    Domain d1, d2;
+
+    Var v1(d1, 0), v2(d2, 0);
+
+    BOOST_CHECK_EQUAL(&v1.domain(), &d1);
+    BOOST_CHECK_EQUAL(&v2.domain(), &d2);
+
+    Epoch e1 = d1.current_epoch(), e2 = d2.current_epoch();
+
+    // A long-lived snapshot in domain 1
+    auto_ptr<Transaction> t1(new Transaction(d1, false /* use_critical */));
+
+    for (unsigned i = 0;  i < 10;  ++i) {
+        Local_Transaction trans(d2);
+        v2.mutate() += 1;
+        BOOST_CHECK(trans.commit());
+    }
+
+    // Commits in domain 2 don't move domain 1 or the default domain
+    BOOST_CHECK_EQUAL(d1.current_epoch(), e1);
+    BOOST_CHECK_EQUAL(d2.current_epoch(), e2 + 10);
+
+    // The snapshot in domain 1 doesn't keep domain 2's versions alive
+    BOOST_CHECK_EQUAL(v2.history_size(), 0);
+    BOOST_CHECK_EQUAL(d1.snapshot_info.entry_count(), 1);
+    BOOST_CHECK_EQUAL(d2.snapshot_info.entry_count(), 0);
+
+    {
+        Local_Transaction trans(d1);
+        v1.mutate() = 5;
+        BOOST_CHECK(trans.commit());
+    }
+
+    // ... but it does keep those in its own domain
+    BOOST_CHECK_EQUAL(v1.history_size(), 1);
+
+    {
+        current_trans = t1.get();
+        BOOST_CHECK_EQUAL(v1.read(), 0);
+
+        // Objects can only be accessed from their own domain's transactions
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(v2.read(), Exception);
+        BOOST_CHECK_THROW(v2.mutate(), Exception);
+        current_trans = 0;
+    }
+
+    delete t1.release();
+
+    BOOST_CHECK_EQUAL(v1.history_size(), 0);
+    BOOST_CHECK_EQUAL(d1.snapshot_info.entry_count(), 0);
+
+    {
+        Local_Transaction trans(d2);
+        BOOST_CHECK_EQUAL(v2.read(), 10);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_domains )
+{
+    do_domain_test<Versioned<int> >();
+    do_domain_test<Versioned2<int> >();
+}
+
+template<class Var>
+void domain_test_thread(Var & var, int iter, boost::barrier & barrier)
+{
+    barrier.wait();
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans(var.domain());
+        do {
+            var.mutate() += 1;
+        } while (!trans.commit());
+    }
+}
+
+template<class Var>
+void run_parallel_domains_test(int ndomains, int niter)
+{
+    cerr << "testing with " << ndomains << " domains and " << niter
+         << " iter class " << demangle(typeid(Var).name()) << endl;
+
+    vector<Domain *> domains;
+    vector<Var *> vars;
+    for (unsigned i = 0;  i < ndomains;  ++i) {
+        domains.push_back(new Domain());
+        vars.push_back(new Var(*domains.back(), 0));
+    }
+
+    boost::barrier barrier(ndomains);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (unsigned i = 0;  i < ndomains;  ++i)
+        tg.create_thread(boost::bind(&domain_test_thread<Var>,
+                                     boost::ref(*vars[i]),
+                                     niter,
+                                     boost::ref(barrier)));
+
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+
+    for (unsigned i = 0;  i < ndomains;  ++i) {
+        // Each domain has seen exactly its own commits
+        BOOST_CHECK_EQUAL(domains[i]->current_epoch(), niter + 1);
+        BOOST_CHECK_EQUAL(domains[i]->snapshot_info.entry_count(), 0);
+        BOOST_CHECK_EQUAL(vars[i]->history_size(), 0);
+
+        {
+            Local_Transaction trans(*domains[i]);
+            BOOST_CHECK_EQUAL(vars[i]->read(), niter);
+        }
+
+        delete vars[i];
+        delete domains[i];
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_domains )
+{
+    run_parallel_domains_test<Versioned<int> >(4, 10000);
+    run_parallel_domains_test<Versioned2<int> >(4, 10000);
+}
+
+template<class Var>
+void do_multi_domain_test()
+{
+    Domain d1, d2;
+
+    Var v1(d1, 0), v2(d2, 0);
+
+    Epoch e1 = d1.current_epoch(), e2 = d2.current_epoch();
+
+    {
+        Local_Multi_Domain_Transaction trans(d1, d2);
+        BOOST_CHECK_EQUAL(trans.num_domains(), 2);
+        BOOST_CHECK_EQUAL(&trans.for_domain(d2)->domain(), &d2);
+
+        v1.mutate() -= 1;
+        v2.mutate() += 1;
+        BOOST_CHECK_EQUAL(v1.read(), -1);
+        BOOST_CHECK_EQUAL(v2.read(), 1);
+
+        BOOST_CHECK(trans.commit());
+    }
+
+    // Both domains moved forward
+    BOOST_CHECK_EQUAL(d1.current_epoch(), e1 + 1);
+    BOOST_CHECK_EQUAL(d2.current_epoch(), e2 + 1);
+
+    {
+        Local_Multi_Domain_Transaction trans(d1, d2);
+        BOOST_CHECK_EQUAL(v1.read(), -1);
+        BOOST_CHECK_EQUAL(v2.read(), 1);
+
+        // Read-only in domain 1: only domain 2 gets a new epoch
+        v2.mutate() += 1;
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(d1.current_epoch(), e1 + 1);
+        BOOST_CHECK_EQUAL(d2.current_epoch(), e2 + 2);
+    }
+
+    // A conflict in one domain means that nothing is committed in either
+    {
+        Local_Multi_Domain_Transaction trans(d1, d2);
+
+        v1.mutate() -= 1;
+        v2.mutate() += 1;
+
+        {
+            Local_Transaction trans2(d2);
+            v2.mutate() = 100;
+            BOOST_CHECK(trans2.commit());
+        }
+
+        BOOST_CHECK(!trans.commit());
+        BOOST_CHECK_EQUAL(trans.retries(), 1);
+        BOOST_CHECK_EQUAL(v1.read(), -1);
+        BOOST_CHECK_EQUAL(v2.read(), 100);
+    }
+
+    BOOST_CHECK_EQUAL(v1.history_size(), 0);
+    BOOST_CHECK_EQUAL(v2.history_size(), 0);
+    BOOST_CHECK_EQUAL(d1.snapshot_info.entry_count(), 0);
+    BOOST_CHECK_EQUAL(d2.snapshot_info.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_multi_domain )
+{
+    do_multi_domain_test<Versioned<int> >();
+    do_multi_domain_test<Versioned2<int> >();
+}
+
+template<class Var>
+struct Multi_Domain_Test_Thread {
+    Var ** vars1;
+    Var ** vars2;
+    int nvars;
+    int iter;
+    boost::barrier & barrier;
+    int & errors;
+
+    Multi_Domain_Test_Thread(Var ** vars1, Var ** vars2, int nvars, int iter,
+                             boost::barrier & barrier, int & errors)
+        : vars1(vars1), vars2(vars2), nvars(nvars), iter(iter),
+          barrier(barrier), errors(errors)
+    {
+    }
+
+    void operator () ()
+    {
+        barrier.wait();
+
+        int local_errors = 0;
+
+        for (unsigned i = 0;  i < iter;  ++i) {
+            int var1 = random() % nvars, var2 = random() % nvars;
+
+            Local_Multi_Domain_Transaction
+                trans(vars1[0]->domain(), vars2[0]->domain());
+
+            do {
+                // Money only moves between the domains atomically, so the
+                // total over both of them is always zero
+                ssize_t total = 0;
+                for (unsigned j = 0;  j < nvars;  ++j)
+                    total += vars1[j]->read() + vars2[j]->read();
+
+                if (total != 0) {
+                    cerr << "total is " << total << endl;
+                    ++local_errors;
+                }
+
+                vars1[var1]->mutate() -= 1;
+                vars2[var2]->mutate() += 1;
+            } while (!trans.commit());
+        }
+
+        atomic_add(errors, local_errors);
+    }
+};
+
+template<class Var>
+void run_multi_domain_test(int nthreads, int niter, int nvars)
+{
+    cerr << "testing multi domain with " << nthreads << " threads and "
+         << niter << " iter class " << demangle(typeid(Var).name()) << endl;
+
+    Domain d1, d2;
+
+    Var * vals1[nvars];
+    Var * vals2[nvars];
+    for (unsigned i = 0;  i < nvars;  ++i) {
+        vals1[i] = new Var(d1, 0);
+        vals2[i] = new Var(d2, 0);
+    }
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    int errors = 0;
+
+    Timer timer;
+    for (unsigned i = 0;  i < nthreads;  ++i) {
+        // Alternate the order of the domains, so that they are given to the
+        // transactions in both orders
+        if (i % 2)
+            tg.create_thread(Multi_Domain_Test_Thread<Var>
+                             (vals1, vals2, nvars, niter, barrier, errors));
+        else
+            tg.create_thread(Multi_Domain_Test_Thread<Var>
+                             (vals2, vals1, nvars, niter, barrier, errors));
+    }
+
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+
+    BOOST_CHECK_EQUAL(errors, 0);
+    BOOST_CHECK_EQUAL(d1.snapshot_info.entry_count(), 0);
+    BOOST_CHECK_EQUAL(d2.snapshot_info.entry_count(), 0);
+
+    ssize_t total = 0;
+    {
+        Local_Multi_Domain_Transaction trans(d1, d2);
+        for (unsigned i = 0;  i < nvars;  ++i)
+            total += vals1[i]->read() + vals2[i]->read();
+    }
+
+    BOOST_CHECK_EQUAL(total, 0);
+
+    for (unsigned i = 0;  i < nvars;  ++i) {
+        BOOST_CHECK_EQUAL(vals1[i]->history_size(), 0);
+        BOOST_CHECK_EQUAL(vals2[i]->history_size(), 0);
+        delete vals1[i];
+        delete vals2[i];
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_multi_domain_threads )
+{
+    run_multi_domain_test<Versioned<int> >(2, 5000, 2);
+    run_multi_domain_test<Versioned2<int> >(2, 5000, 2);
+    run_multi_domain_test<Versioned<int> >(10, 1000, 10);
+    run_multi_domain_test<Versioned2<int> >(10, 1000, 10);
+}
@@ -28,6 +28,8 @@
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/versioned3.h"
+#include "jml/arch/demangle.h"
 
 
 using namespace ML;
@@ -95,16 +97,18 @@ struct In_Trans_Context : public In_Out_Critical {
     
 };
 
+template<class Var>
 void run_test(int test_num)
 {
-    cerr << "test_num = " << test_num << endl;
+    cerr << "test_num = " << test_num << " class "
+         << demangle(typeid(Var).name()) << endl;
 
     BOOST_REQUIRE_EQUAL(snapshot_info.entry_count(), 0);
     
     current_epoch_ = 600;
     earliest_epoch_ = 600;
 
-    Versioned2<int> var(0);
+    Var var(0);
 
     BOOST_CHECK_EQUAL(var.history_size(), 0);
     {
@@ -517,22 +521,26 @@ void run_test(int test_num)
 
 BOOST_AUTO_TEST_CASE( test1 )
 {
-    run_test(1);
+    run_test<Versioned2<int> >(1);
+    run_test<Versioned3<int> >(1);
 }
 
 BOOST_AUTO_TEST_CASE( test2 )
 {
-    run_test(2);
+    run_test<Versioned2<int> >(2);
+    run_test<Versioned3<int> >(2);
 }
 
 BOOST_AUTO_TEST_CASE( test3 )
 {
-    run_test(3);
+    run_test<Versioned2<int> >(3);
+    run_test<Versioned3<int> >(3);
 }
 
 BOOST_AUTO_TEST_CASE( test4 )
 {
-    run_test(3);
+    run_test<Versioned2<int> >(3);
+    run_test<Versioned3<int> >(3);
 }
 
 
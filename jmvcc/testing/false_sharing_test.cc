@@ -0,0 +1,262 @@
+/* false_sharing_test.cc
+   Jeremy Barnes, 1 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of the cache line layout of the hot data, and benchmark of what
+   false sharing costs.  Build with JMVCC_PAD_OBJECTS=0 and 1 to compare the
+   object layouts.  The numbers only mean something with more than one CPU.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jmvcc/garbage.h"
+#include "jmvcc/spinlock.h"
+
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+size_t line_of(const volatile void * p)
+{
+    return (size_t)p / CACHE_LINE_SIZE;
+}
+
+BOOST_AUTO_TEST_CASE( test_domain_layout )
+{
+    Domain & d = default_domain;
+
+    // Each group starts a new line
+    BOOST_CHECK_EQUAL((size_t)&d.current_epoch_ % CACHE_LINE_SIZE, 0);
+    BOOST_CHECK_EQUAL((size_t)&d.snapshot_info % CACHE_LINE_SIZE, 0);
+    BOOST_CHECK_EQUAL((size_t)&d.commit_lock % CACHE_LINE_SIZE, 0);
+
+    BOOST_CHECK_EQUAL(line_of(&d.current_epoch_), line_of(&d.earliest_epoch_));
+    BOOST_CHECK_NE(line_of(&d.earliest_epoch_), line_of(&d.snapshot_info));
+}
+
+BOOST_AUTO_TEST_CASE( test_object_layout )
+{
+#if JMVCC_PAD_OBJECTS
+    BOOST_CHECK_EQUAL(sizeof(Versioned2<int>) % CACHE_LINE_SIZE, 0);
+    BOOST_CHECK_EQUAL(sizeof(Versioned<int>) % CACHE_LINE_SIZE, 0);
+
+    Versioned2<int> vars[2];
+    BOOST_CHECK_EQUAL((size_t)&vars[0] % CACHE_LINE_SIZE, 0);
+    BOOST_CHECK_NE(line_of(&vars[0]), line_of(&vars[1]));
+
+    Versioned<int> vars2[2];
+    BOOST_CHECK_EQUAL((size_t)&vars2[1] % CACHE_LINE_SIZE, 0);
+#endif
+}
+
+
+/*****************************************************************************/
+/* COUNTERS                                                                  */
+/*****************************************************************************/
+
+/// Counters for each thread next to each other
+struct Packed_Counters {
+    volatile size_t counter[64];
+    volatile size_t & operator [] (int i) { return counter[i]; }
+};
+
+/// Counters for each thread on their own lines
+struct Padded_Counters {
+    struct Counter {
+        volatile size_t value;
+    } JMVCC_CACHE_ALIGNED;
+
+    Counter counter[64];
+    volatile size_t & operator [] (int i) { return counter[i].value; }
+};
+
+template<class Counters>
+void increment_counter(Counters & counters, int i, int n,
+                       boost::barrier & barrier)
+{
+    barrier.wait();
+    for (int j = 0;  j < n;  ++j)
+        counters[i] = counters[i] + 1;
+}
+
+template<class Counters>
+double run_counters(int nthreads, int n)
+{
+    Counters * counters = new Counters();
+    for (int i = 0;  i < nthreads;  ++i)
+        (*counters)[i] = 0;
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&increment_counter<Counters>,
+                                     boost::ref(*counters), i, n,
+                                     boost::ref(barrier)));
+    tg.join_all();
+    double elapsed = timer.elapsed_wall();
+
+    for (int i = 0;  i < nthreads;  ++i)
+        BOOST_CHECK_EQUAL((*counters)[i], n);
+
+    delete counters;
+    return elapsed;
+}
+
+int max_threads()
+{
+    // More threads than CPUs measures the scheduler, not the caches
+    int cpus = boost::thread::hardware_concurrency();
+    return std::min(64, std::max(2, cpus));
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_counters )
+{
+    for (int nthreads = 1;  nthreads <= max_threads();  nthreads *= 2) {
+        double packed = run_counters<Packed_Counters>(nthreads, 10000000);
+        double padded = run_counters<Padded_Counters>(nthreads, 10000000);
+        cerr << nthreads << " threads: packed counters " << packed
+             << "s, padded counters " << padded << "s" << endl;
+    }
+}
+
+
+/*****************************************************************************/
+/* NEIGHBOURING OBJECTS                                                      */
+/*****************************************************************************/
+
+/** One thread commits to the first object while the others read their own
+    object next to it.  With the objects padded, the readers don't see the
+    commits.
+*/
+
+template<class Var>
+void commit_loop(Var & var, volatile bool & finished, boost::barrier & barrier)
+{
+    barrier.wait();
+    for (int i = 0;  !finished;  ++i) {
+        Local_Transaction trans;
+        var.write(i);
+        trans.commit();
+    }
+}
+
+template<class Var>
+void read_loop(Var & var, int expected, int n, boost::barrier & barrier)
+{
+    barrier.wait();
+    size_t errors = 0;
+    for (int i = 0;  i < n;  ++i) {
+        Local_Transaction trans;
+        errors += (var.read() != expected);
+    }
+    BOOST_CHECK_EQUAL(errors, 0);
+}
+
+template<class Var>
+double run_neighbours(int nreaders, int n)
+{
+    Var vars[65];
+    for (int i = 1;  i <= nreaders;  ++i) {
+        Local_Transaction trans;
+        vars[i].write(i);
+        trans.commit();
+    }
+
+    volatile bool finished = false;
+    boost::barrier barrier(nreaders + 1);
+    boost::thread writer(boost::bind(&commit_loop<Var>, boost::ref(vars[0]),
+                                     boost::ref(finished),
+                                     boost::ref(barrier)));
+
+    boost::thread_group readers;
+    Timer timer;
+    for (int i = 1;  i <= nreaders;  ++i)
+        readers.create_thread(boost::bind(&read_loop<Var>,
+                                          boost::ref(vars[i]), i, n,
+                                          boost::ref(barrier)));
+    readers.join_all();
+    double elapsed = timer.elapsed_wall();
+
+    finished = true;
+    writer.join();
+
+    return elapsed;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_neighbouring_objects )
+{
+    int nreaders = std::max(1, max_threads() - 1);
+    cerr << "JMVCC_PAD_OBJECTS=" << JMVCC_PAD_OBJECTS << " "
+         << nreaders << " readers next to a committer: Versioned "
+         << run_neighbours<Versioned<int> >(nreaders, 200000)
+         << "s, Versioned2 "
+         << run_neighbours<Versioned2<int> >(nreaders, 200000)
+         << "s" << endl;
+}
+
+
+/*****************************************************************************/
+/* EPOCH POLLING                                                             */
+/*****************************************************************************/
+
+/// Enters and leaves critical sections, which writes the garbage collector's
+/// section state, until told to stop
+void critical_loop(volatile bool & finished, boost::barrier & barrier)
+{
+    barrier.wait();
+    while (!finished) {
+        enter_critical();
+        leave_critical();
+    }
+}
+
+void poll_epoch(int n, boost::barrier & barrier)
+{
+    barrier.wait();
+    size_t errors = 0;
+    for (int i = 0;  i < n;  ++i)
+        errors += (default_domain.current_epoch() == 0);
+    BOOST_CHECK_EQUAL(errors, 0);
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_epoch_polling )
+{
+    int npollers = std::max(1, max_threads() - 1);
+    int n = 50000000;
+
+    volatile bool finished = false;
+    boost::barrier barrier(npollers + 1);
+    boost::thread writer(boost::bind(&critical_loop, boost::ref(finished),
+                                     boost::ref(barrier)));
+
+    boost::thread_group pollers;
+    Timer timer;
+    for (int i = 0;  i < npollers;  ++i)
+        pollers.create_thread(boost::bind(&poll_epoch, n,
+                                          boost::ref(barrier)));
+    pollers.join_all();
+    double elapsed = timer.elapsed_wall();
+
+    finished = true;
+    writer.join();
+
+    cerr << npollers << " threads polling current_epoch() next to a thread "
+         << "entering critical sections: "
+         << elapsed / n * 1e9 << "ns per read" << endl;
+
+    BOOST_CHECK_EQUAL(get_num_in_critical(), 0);
+}
@@ -86,6 +86,517 @@ BOOST_AUTO_TEST_CASE(test_cleanup_no_critical_section)
     BOOST_CHECK_EQUAL(v, 1);
 }
 
+/// Enters a critical section, schedules a cleanup that sets var to 1, and
+/// waits until leave is set before leaving
+void hold_critical(int & var, volatile int & entered, volatile int & leave)
+{
+    enter_critical();
+    schedule_cleanup(Set_Var(var, 1));
+    entered = 1;
+    while (!leave)
+        sched_yield();
+    leave_critical();
+}
+
+void run_and_flag(void (*fn) (), volatile int & done)
+{
+    fn();
+    done = 1;
+}
+
+BOOST_AUTO_TEST_CASE(test_synchronize_critical)
+{
+    // Nothing active: returns straight away
+    synchronize_critical();
+    cleanup_barrier();
+
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        enter_critical();
+        BOOST_CHECK_THROW(synchronize_critical(), Exception);
+        BOOST_CHECK_THROW(cleanup_barrier(), Exception);
+        leave_critical();
+    }
+
+    typedef void (*Fn) ();
+    Fn fns[2] = { &synchronize_critical, &cleanup_barrier };
+
+    for (unsigned i = 0;  i < 2;  ++i) {
+        int var = 0;
+        volatile int entered = 0, leave = 0, done = 0;
+
+        boost::thread holder(boost::bind(&hold_critical, boost::ref(var),
+                                         boost::ref(entered),
+                                         boost::ref(leave)));
+        while (!entered)
+            sched_yield();
+
+        boost::thread waiter(boost::bind(&run_and_flag, fns[i],
+                                         boost::ref(done)));
+
+        // Can't finish while the critical section is still active
+        for (unsigned j = 0;  j < 100;  ++j)
+            sched_yield();
+        BOOST_CHECK_EQUAL(done, 0);
+
+        if (fns[i] == &synchronize_critical) {
+            // A critical section that started afterwards doesn't hold it up
+            enter_critical();
+            leave = 1;
+            waiter.join();
+            BOOST_CHECK_EQUAL(done, 1);
+            leave_critical();
+        }
+        else {
+            // The barrier may have to wait for later critical sections, as
+            // the cleanups can be handed on to them
+            leave = 1;
+            waiter.join();
+            BOOST_CHECK_EQUAL(done, 1);
+            BOOST_CHECK_EQUAL(var, 1);
+        }
+
+        holder.join();
+
+        // The cleanup is run once nothing could need it
+        BOOST_CHECK_EQUAL(var, 1);
+    }
+}
+
+void schedule_and_barrier(int iter, size_t & errors)
+{
+    size_t local_errors = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        int var = 0;
+        enter_critical();
+        schedule_cleanup(Set_Var(var, 1));
+        leave_critical();
+        cleanup_barrier();
+        local_errors += (var != 1);
+    }
+
+    static Lock lock;
+    Guard guard(lock);
+    errors += local_errors;
+}
+
+void churn_critical(volatile int & finished)
+{
+    while (!finished) {
+        enter_critical();
+        leave_critical();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_cleanup_barrier_threaded)
+{
+    // Every cleanup that a thread scheduled has run once its barrier
+    // returns, even with other threads entering and leaving all the time
+    volatile int finished = 0;
+    size_t errors = 0;
+
+    boost::thread_group churners;
+    for (unsigned i = 0;  i < 2;  ++i)
+        churners.create_thread(boost::bind(&churn_critical,
+                                           boost::ref(finished)));
+
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < 4;  ++i)
+        tg.create_thread(boost::bind(&schedule_and_barrier, 200,
+                                     boost::ref(errors)));
+    tg.join_all();
+
+    finished = 1;
+    churners.join_all();
+
+    BOOST_CHECK_EQUAL(errors, 0);
+}
+
+int num_reports = 0;
+string last_report;
+
+void record_report(const std::string & message)
+{
+    ++num_reports;
+    last_report = message;
+}
+
+void do_nothing()
+{
+}
+
+void schedule_many(int iter, int per_iter, volatile int & done,
+                   size_t & max_queued)
+{
+    for (unsigned i = 0;  i < iter;  ++i) {
+        enter_critical();
+        for (unsigned j = 0;  j < per_iter;  ++j)
+            schedule_cleanup(&do_nothing);
+        leave_critical();
+        max_queued = std::max(max_queued, get_num_cleanups_queued());
+    }
+    done = 1;
+}
+
+BOOST_AUTO_TEST_CASE(test_cleanup_high_water_mark)
+{
+    set_cleanup_high_water_mark(1000);
+    set_stall_reporter(&record_report);
+
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    // A reader that stays in its critical section holds up all of the
+    // cleanups scheduled after it started
+    int var = 0;
+    volatile int entered = 0, leave = 0, done = 0;
+    boost::thread holder(boost::bind(&hold_critical, boost::ref(var),
+                                     boost::ref(entered),
+                                     boost::ref(leave)));
+    while (!entered)
+        sched_yield();
+
+    size_t max_queued = 0;
+    boost::thread writer(boost::bind(&schedule_many, 1000, 10,
+                                     boost::ref(done),
+                                     boost::ref(max_queued)));
+
+    // The writer gets held up once it reaches the high water mark
+    while (get_num_cleanups_queued() <= 1000)
+        sched_yield();
+    for (unsigned i = 0;  i < 1000;  ++i)
+        sched_yield();
+
+    BOOST_CHECK_EQUAL(done, 0);
+    BOOST_CHECK_LE(get_num_cleanups_queued(), 1010);
+    BOOST_CHECK_EQUAL(num_reports, 1);
+    cerr << last_report << endl;
+
+    // Once the reader finishes, everything drains and it continues
+    leave = 1;
+    holder.join();
+    writer.join();
+
+    BOOST_CHECK_EQUAL(done, 1);
+    BOOST_CHECK_LE(max_queued, 1010);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+    BOOST_CHECK_EQUAL(var, 1);
+
+    set_cleanup_high_water_mark(0);
+    set_stall_reporter(Stall_Reporter());
+}
+
+int num_counted = 0;
+
+void count_cleanup()
+{
+    atomic_add(num_counted, 1);
+}
+
+void schedule_counted(int iter, int per_iter)
+{
+    for (unsigned i = 0;  i < iter;  ++i) {
+        enter_critical();
+        for (unsigned j = 0;  j < per_iter;  ++j)
+            schedule_cleanup(&count_cleanup);
+        leave_critical();
+    }
+}
+
+void release_after(volatile int & leave, int ms)
+{
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+    leave = 1;
+}
+
+BOOST_AUTO_TEST_CASE(test_max_cleanups_per_call)
+{
+    set_max_cleanups_per_call(100);
+    num_counted = 0;
+
+    // Leaving the oldest critical section only runs the first chunk
+    enter_critical();
+    for (unsigned i = 0;  i < 1000;  ++i)
+        schedule_cleanup(&count_cleanup);
+    leave_critical();
+
+    BOOST_CHECK_EQUAL(num_counted, 100);
+    BOOST_CHECK_EQUAL(get_num_cleanups_ready(), 900);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 900);
+
+    // Scheduling a cleanup does a chunk of what's left, and so does
+    // leaving, even with nothing of our own to run
+    enter_critical();
+    schedule_cleanup(&count_cleanup);
+    BOOST_CHECK_EQUAL(num_counted, 200);
+    leave_critical();
+    BOOST_CHECK_EQUAL(num_counted, 201);
+
+    enter_critical();
+    leave_critical();
+    BOOST_CHECK_EQUAL(num_counted, 301);
+    BOOST_CHECK_EQUAL(get_num_cleanups_ready(), 700);
+
+    // A reclaimer can run as many as it likes
+    BOOST_CHECK_EQUAL(run_ready_cleanups(50), 50);
+    BOOST_CHECK_EQUAL(num_counted, 351);
+
+    // The barrier runs whatever is left
+    cleanup_barrier();
+    BOOST_CHECK_EQUAL(num_counted, 1001);
+    BOOST_CHECK_EQUAL(get_num_cleanups_ready(), 0);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    enter_critical();
+    for (unsigned i = 0;  i < 1000;  ++i)
+        schedule_cleanup(&count_cleanup);
+    leave_critical();
+    BOOST_CHECK_EQUAL(run_ready_cleanups(), 900);
+    BOOST_CHECK_EQUAL(num_counted, 2001);
+    BOOST_CHECK_EQUAL(run_ready_cleanups(), 0);
+
+    // Lots of threads sharing the work
+    num_counted = 0;
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < 8;  ++i)
+        tg.create_thread(boost::bind(&schedule_counted, 1000, 50));
+    tg.join_all();
+
+    cleanup_barrier();
+    BOOST_CHECK_EQUAL(num_counted, 8 * 1000 * 50);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    // Cleanups scheduled from outside a critical section are held up by the
+    // one that's active, and then run a chunk at a time like the others
+    num_counted = 0;
+    int var = 0;
+    volatile int entered = 0, leave = 0;
+    boost::thread holder(boost::bind(&hold_critical, boost::ref(var),
+                                     boost::ref(entered),
+                                     boost::ref(leave)));
+    while (!entered)
+        sched_yield();
+
+    for (unsigned i = 0;  i < 1000;  ++i)
+        schedule_cleanup(&count_cleanup);
+    BOOST_CHECK_EQUAL(num_counted, 0);
+
+    leave = 1;
+    holder.join();
+    BOOST_CHECK_EQUAL(num_counted + var, 100);
+    BOOST_CHECK_EQUAL(get_num_cleanups_ready(), 901);
+
+    // With nothing active, a new one is run straight away, but not the
+    // rest of them
+    schedule_cleanup(&count_cleanup);
+    BOOST_CHECK_EQUAL(num_counted + var, 101);
+    BOOST_CHECK_EQUAL(get_num_cleanups_ready(), 901);
+
+    cleanup_barrier();
+    BOOST_CHECK_EQUAL(num_counted, 1001);
+    BOOST_CHECK_EQUAL(var, 1);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    // A grace period that ends behind the first chunk still ends, even if
+    // nobody else comes along to run the rest
+    num_counted = var = entered = leave = 0;
+    boost::thread holder2(boost::bind(&hold_critical, boost::ref(var),
+                                      boost::ref(entered),
+                                      boost::ref(leave)));
+    while (!entered)
+        sched_yield();
+
+    for (unsigned i = 0;  i < 1000;  ++i)
+        schedule_cleanup(&count_cleanup);
+
+    boost::thread releaser(boost::bind(&release_after, boost::ref(leave),
+                                       50));
+    synchronize_critical();
+    BOOST_CHECK_EQUAL(num_counted + var, 1001);
+    releaser.join();
+    holder2.join();
+
+    cleanup_barrier();
+    BOOST_CHECK_EQUAL(num_counted, 1000);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    set_max_cleanups_per_call(0);
+}
+
+void schedule_outside(int n)
+{
+    for (unsigned i = 0;  i < n;  ++i)
+        schedule_cleanup(&count_cleanup);
+}
+
+BOOST_AUTO_TEST_CASE(test_schedule_outside_critical_threaded)
+{
+    num_counted = 0;
+
+    int var = 0;
+    volatile int entered = 0, leave = 0;
+    boost::thread holder(boost::bind(&hold_critical, boost::ref(var),
+                                     boost::ref(entered),
+                                     boost::ref(leave)));
+    while (!entered)
+        sched_yield();
+
+    // Lots of threads scheduling from outside a critical section; they're
+    // all held up by the one that's active
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < 8;  ++i)
+        tg.create_thread(boost::bind(&schedule_outside, 10000));
+    tg.join_all();
+
+    BOOST_CHECK_EQUAL(num_counted, 0);
+
+    // Once it's finished, they're all run
+    leave = 1;
+    holder.join();
+
+    BOOST_CHECK_EQUAL(num_counted, 8 * 10000);
+    BOOST_CHECK_EQUAL(var, 1);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    // With nothing active, they're run straight away
+    schedule_cleanup(&count_cleanup);
+    BOOST_CHECK_EQUAL(num_counted, 8 * 10000 + 1);
+}
+
+/** Each thread schedules cleanups from outside a critical section and
+    goes in and out of critical sections of its own.  With a global count,
+    every thread bumps one word to schedule and reads it to leave, as the
+    cleanups in the shards used to be counted; that word is emulated here
+    to show what it costs next to the count that each shard keeps now.
+*/
+
+volatile int global_count = 0;
+
+void schedule_and_leave(int n, bool global, boost::barrier & barrier)
+{
+    barrier.wait();
+    for (int i = 0;  i < n;  ++i) {
+        enter_critical();
+        if (global && global_count < 0) throw Exception("impossible");
+        leave_critical();
+
+        schedule_cleanup(&count_cleanup);
+        if (global) atomic_add(global_count, 1);
+    }
+}
+
+double run_schedule_and_leave(int nthreads, int n, bool global)
+{
+    num_counted = 0;
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&schedule_and_leave, n, global,
+                                     boost::ref(barrier)));
+    tg.join_all();
+    double elapsed = timer.elapsed_wall();
+
+    cleanup_barrier();
+    BOOST_CHECK_EQUAL(num_counted, nthreads * n);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+
+    return elapsed;
+}
+
+BOOST_AUTO_TEST_CASE(test_schedule_outside_contention)
+{
+    int nthreads = 8, n = 20000;
+
+    double sharded_time = run_schedule_and_leave(nthreads, n, false);
+    double global_time = run_schedule_and_leave(nthreads, n, true);
+
+    cerr << nthreads << " threads x " << n << " schedules outside and "
+         << "leaves: global count " << global_time << "s, per shard "
+         << sharded_time << "s" << endl;
+}
+
+void exit_in_critical()
+{
+    enter_critical();
+    enter_critical();
+    schedule_cleanup(&count_cleanup);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_churn)
+{
+    size_t allocated_before = get_num_critical_info_allocated();
+    num_counted = 0;
+
+    // Threads that come and go reuse each other's structures
+    for (unsigned i = 0;  i < 100;  ++i) {
+        boost::thread_group tg;
+        for (unsigned j = 0;  j < 10;  ++j)
+            tg.create_thread(boost::bind(&schedule_counted, 10, 10));
+        tg.join_all();
+    }
+
+    BOOST_CHECK_EQUAL(num_counted, 100 * 10 * 10 * 10);
+    BOOST_CHECK_LE(get_num_critical_info_allocated(), allocated_before + 10);
+
+    // A thread that exits in its critical section doesn't hold everything
+    // up, and its cleanups still get run
+    num_counted = 0;
+    boost::thread thread(&exit_in_critical);
+    thread.join();
+
+    BOOST_CHECK_EQUAL(get_num_in_critical(), 0);
+    BOOST_CHECK_EQUAL(num_counted, 1);
+    BOOST_CHECK_EQUAL(get_num_cleanups_queued(), 0);
+}
+
+void hold_light_critical(volatile int & entered, volatile int & leave)
+{
+    enter_light_critical();
+    entered = 1;
+    while (!leave)
+        sched_yield();
+    leave_light_critical();
+}
+
+BOOST_AUTO_TEST_CASE(test_light_critical)
+{
+    num_counted = 0;
+
+    // Nothing in a light section; run straight away
+    {
+        Light_Critical_Guard guard;
+    }
+    schedule_cleanup(&count_cleanup);
+    BOOST_CHECK_EQUAL(num_counted, 1);
+
+    // A light section that is in progress holds up cleanups until it ends
+    volatile int entered = 0, leave = 0;
+    boost::thread holder(boost::bind(&hold_light_critical,
+                                     boost::ref(entered),
+                                     boost::ref(leave)));
+    while (!entered)
+        sched_yield();
+
+    boost::thread scheduler(boost::bind(&schedule_counted, 1, 1));
+    for (unsigned i = 0;  i < 1000;  ++i)
+        sched_yield();
+    BOOST_CHECK_EQUAL(num_counted, 1);
+
+    leave = 1;
+    holder.join();
+    scheduler.join();
+    BOOST_CHECK_EQUAL(num_counted, 2);
+
+    // Light sections can go inside ordinary ones
+    enter_critical();
+    {
+        Light_Critical_Guard guard;
+    }
+    leave_critical();
+}
+
 size_t num_live = 0;
 size_t max_num_live = 0;
 
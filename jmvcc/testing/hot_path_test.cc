@@ -0,0 +1,99 @@
+/* hot_path_test.cc
+   Jeremy Barnes, 31 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Benchmark of the paths that every transaction goes through.  Build with
+   JMVCC_DEBUG=0 and JMVCC_DEBUG=1 to see what the checks cost.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jmvcc/versioned3.h"
+#include "jml/arch/demangle.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+void report(const std::string & what, int n, const Timer & timer)
+{
+    cerr << "JMVCC_DEBUG=" << JMVCC_DEBUG << " " << what << ": "
+         << timer.elapsed_wall() / n * 1e9 << "ns" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_critical_section )
+{
+    int n = 1000000;
+
+    Timer timer;
+    for (int i = 0;  i < n;  ++i) {
+        enter_critical();
+        leave_critical();
+    }
+    report("enter/leave critical", n, timer);
+
+    BOOST_CHECK_EQUAL(get_num_in_critical(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_read_only_transaction )
+{
+    int n = 1000000;
+    Versioned<int> var(1);
+
+    Timer timer;
+    int total = 0;
+    for (int i = 0;  i < n;  ++i) {
+        Local_Transaction trans;
+        total += var.read();
+    }
+    report("read-only transaction", n, timer);
+
+    BOOST_CHECK_EQUAL(total, n);
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_read_latest )
+{
+    int n = 1000000;
+    Versioned2<int> var(1);
+
+    Timer timer;
+    int total = 0;
+    for (int i = 0;  i < n;  ++i)
+        total += var.read_latest();
+    report("read_latest()", n, timer);
+
+    BOOST_CHECK_EQUAL(total, n);
+}
+
+template<class Var>
+void benchmark_commit()
+{
+    int n = 200000;
+    Var var(0);
+
+    Timer timer;
+    for (int i = 0;  i < n;  ++i) {
+        Local_Transaction trans;
+        var.write(i);
+        if (!trans.commit())
+            BOOST_FAIL("commit failed with no contention");
+    }
+    report("commit " + demangle(typeid(Var).name()), n, timer);
+
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_commit_transaction )
+{
+    benchmark_commit<Versioned<int> >();
+    benchmark_commit<Versioned2<int> >();
+    benchmark_commit<Versioned3<int> >();
+}
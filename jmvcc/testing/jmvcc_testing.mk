@@ -2,3 +2,18 @@ $(eval $(call test,object_test,jmvcc arch boost_thread-mt,boost))
 $(eval $(call test,versioned_test,jmvcc arch boost_thread-mt,boost))
 $(eval $(call test,epoch_compression_test,jmvcc arch boost_thread-mt,boost))
 $(eval $(call test,garbage_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,domain_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,shared_domain_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,snapshot_export_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,retry_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,change_notifier_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,aggregate_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,secondary_index_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,versioned_ptr_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,node_pool_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,spinlock_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,hot_path_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,false_sharing_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,vacuum_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,lazy_snapshot_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,versioned_striped_test,jmvcc arch boost_thread-mt,boost))
@@ -0,0 +1,308 @@
+/* lazy_snapshot_test.cc
+   Jeremy Barnes, 4 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of lazy snapshots, where transactions only register their snapshot
+   when they commit something.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/demangle.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jmvcc/versioned3.h"
+#include "jmvcc/garbage.h"
+
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+template<class Var>
+void write_value(Domain & domain, Var & var, int value)
+{
+    Local_Transaction trans(domain);
+    var.write(value);
+    BOOST_REQUIRE(trans.commit());
+}
+
+template<class Var>
+int read_value(Domain & domain, Var & var)
+{
+    Local_Transaction trans(domain);
+    return var.read();
+}
+
+template<class Var>
+void test_lazy_type()
+{
+    cerr << "testing " << demangle(typeid(Var).name()) << endl;
+
+    Domain domain;
+    domain.snapshot_info.set_lazy_snapshots(true);
+
+    Var var1(domain, 0), var2(domain, 0);
+
+    // A commit registers its snapshot, and takes it away again afterwards
+    write_value(domain, var1, 1);
+    write_value(domain, var2, 1);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+    BOOST_CHECK_EQUAL(var1.history_size(), 0);
+
+    // Reading never goes near the table
+    {
+        Local_Transaction trans(domain);
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+        BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+    }
+
+    {
+        Local_Transaction trans(domain);
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+
+        // Both objects get a new version after our epoch, and the commits'
+        // snapshots go away, but the old versions stay while we're in our
+        // critical section
+        write_value(domain, var1, 2);
+        write_value(domain, var2, 2);
+        BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+        BOOST_CHECK_EQUAL(var1.history_size(), 1);
+        BOOST_CHECK_EQUAL(var2.history_size(), 1);
+
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+        BOOST_CHECK_EQUAL(var2.read(), 1);
+        BOOST_CHECK_EQUAL(read_value(domain, var2), 2);
+
+        // What we write is checked against what we read
+        var1.write(10);
+        BOOST_CHECK(!trans.commit());
+        BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+
+        // Restarted at the current epoch
+        BOOST_CHECK_EQUAL(var1.read(), 2);
+        BOOST_CHECK_EQUAL(var2.read(), 2);
+        var1.write(3);
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(var1.read(), 3);
+        BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+    }
+
+    // Once it's finished, nothing holds on to the old versions
+    BOOST_CHECK_EQUAL(var1.history_size(), 0);
+    BOOST_CHECK_EQUAL(var2.history_size(), 0);
+    BOOST_CHECK_EQUAL(read_value(domain, var1), 3);
+
+    // A transaction that isn't lazy is registered as always, and keeps
+    // what it sees alive
+    {
+        Transaction trans(domain);
+        BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 1);
+
+        write_value(domain, var1, 4);
+        BOOST_CHECK_EQUAL(var1.history_size(), 1);
+    }
+
+    BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+    BOOST_CHECK_EQUAL(var1.history_size(), 0);
+    BOOST_CHECK_EQUAL(read_value(domain, var1), 4);
+}
+
+BOOST_AUTO_TEST_CASE( test_lazy )
+{
+    test_lazy_type<Versioned<int> >();
+    test_lazy_type<Versioned2<int> >();
+    test_lazy_type<Versioned3<int> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_lazy_modes )
+{
+    Domain domain;
+    domain.snapshot_info.set_lazy_snapshots(true);
+
+    JML_TRACE_EXCEPTIONS(false);
+
+    BOOST_CHECK_THROW(domain.snapshot_info.set_vacuum_mode(true),
+                      ML::Exception);
+    BOOST_CHECK_THROW(domain.snapshot_info.compress_epochs(), ML::Exception);
+
+    {
+        Transaction trans(domain);
+        BOOST_CHECK_THROW(domain.snapshot_info.set_lazy_snapshots(false),
+                          ML::Exception);
+    }
+
+    domain.snapshot_info.set_lazy_snapshots(false);
+    domain.snapshot_info.set_vacuum_mode(true);
+    BOOST_CHECK_THROW(domain.snapshot_info.set_lazy_snapshots(true),
+                      ML::Exception);
+
+    // Without lazy snapshots, a Local_Transaction is registered
+    {
+        Local_Transaction trans(domain);
+        BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 1);
+    }
+}
+
+
+/*****************************************************************************/
+/* CONCURRENT LAZY TRANSACTIONS                                              */
+/*****************************************************************************/
+
+/** Writers keep the two variables equal, and readers check that they see
+    them equal, with a while between the two reads so that writers can
+    commit in between. */
+
+template<class Var>
+struct Lazy_Test {
+    Domain & domain;
+    Var & var1;
+    Var & var2;
+    volatile bool finished;
+    size_t errors;
+
+    Lazy_Test(Domain & domain, Var & var1, Var & var2)
+        : domain(domain), var1(var1), var2(var2), finished(false), errors(0)
+    {
+    }
+
+    void writer(int n, boost::barrier & barrier)
+    {
+        barrier.wait();
+        for (int i = 0;  i < n;  ) {
+            Local_Transaction trans(domain);
+            int val = var1.read() + 1;
+            var1.write(val);
+            var2.write(val);
+            if (trans.commit()) ++i;
+        }
+    }
+
+    void reader(boost::barrier & barrier)
+    {
+        barrier.wait();
+        while (!finished) {
+            Local_Transaction trans(domain);
+            int val1 = var1.read();
+            for (unsigned i = 0;  i < 100;  ++i)
+                sched_yield();
+            int val2 = var2.read();
+            if (val1 != val2) atomic_add(errors, 1);
+        }
+    }
+
+    void run(int nwriters, int nreaders, int n)
+    {
+        boost::barrier barrier(nwriters + nreaders);
+        boost::thread_group writers, readers;
+
+        for (int i = 0;  i < nwriters;  ++i)
+            writers.create_thread(boost::bind(&Lazy_Test::writer, this, n,
+                                              boost::ref(barrier)));
+        for (int i = 0;  i < nreaders;  ++i)
+            readers.create_thread(boost::bind(&Lazy_Test::reader, this,
+                                              boost::ref(barrier)));
+
+        writers.join_all();
+        finished = true;
+        readers.join_all();
+    }
+};
+
+template<class Var>
+void test_lazy_threaded_type()
+{
+    Domain domain;
+    domain.snapshot_info.set_lazy_snapshots(true);
+
+    Var var1(domain, 0), var2(domain, 0);
+
+    int nwriters = 2, n = 2000;
+    Lazy_Test<Var> test(domain, var1, var2);
+    test.run(nwriters, 2, n);
+
+    BOOST_CHECK_EQUAL(test.errors, 0);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.entry_count(), 0);
+
+    cleanup_barrier();
+    BOOST_CHECK_EQUAL(var1.history_size(), 0);
+    BOOST_CHECK_EQUAL(var2.history_size(), 0);
+    BOOST_CHECK_EQUAL(read_value(domain, var1), nwriters * n);
+    BOOST_CHECK_EQUAL(read_value(domain, var2), nwriters * n);
+}
+
+BOOST_AUTO_TEST_CASE( test_lazy_threaded )
+{
+    test_lazy_threaded_type<Versioned<int> >();
+    test_lazy_threaded_type<Versioned2<int> >();
+    test_lazy_threaded_type<Versioned3<int> >();
+}
+
+
+/*****************************************************************************/
+/* BENCHMARK                                                                 */
+/*****************************************************************************/
+
+/** Short read-only transactions from several threads.  Registered, each
+    one takes the snapshot lock twice; lazy, none of them do. */
+
+template<class Var>
+void read_loop(Domain & domain, Var & var, int n, boost::barrier & barrier)
+{
+    barrier.wait();
+    int total = 0;
+    for (int i = 0;  i < n;  ++i) {
+        Local_Transaction trans(domain);
+        total += var.read();
+    }
+    BOOST_CHECK_EQUAL(total, n);
+}
+
+template<class Var>
+double run_read_only(bool lazy, int nthreads, int n)
+{
+    Domain domain;
+    domain.snapshot_info.set_lazy_snapshots(lazy);
+
+    Var var(domain, 1);
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&read_loop<Var>, boost::ref(domain),
+                                     boost::ref(var), n,
+                                     boost::ref(barrier)));
+    tg.join_all();
+    return timer.elapsed_wall();
+}
+
+template<class Var>
+void benchmark_lazy_type()
+{
+    int nthreads = std::max(2u, boost::thread::hardware_concurrency());
+    int n = 200000;
+
+    double registered = run_read_only<Var>(false, nthreads, n);
+    double lazy = run_read_only<Var>(true, nthreads, n);
+    cerr << demangle(typeid(Var).name()) << " " << nthreads << " threads x "
+         << n << " read-only transactions: registered " << registered
+         << "s, lazy " << lazy << "s" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_lazy )
+{
+    benchmark_lazy_type<Versioned<int> >();
+    benchmark_lazy_type<Versioned2<int> >();
+    benchmark_lazy_type<Versioned3<int> >();
+}
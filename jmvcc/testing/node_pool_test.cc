@@ -0,0 +1,178 @@
+/* node_pool_test.cc
+   Jeremy Barnes, 29 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of the NUMA node memory pools.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/node_pool.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned2.h"
+#include <cstring>
+
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE( test_topology )
+{
+    cerr << "num_numa_nodes = " << num_numa_nodes() << endl;
+    BOOST_CHECK_GE(num_numa_nodes(), 1);
+    BOOST_CHECK_LT(current_numa_node(), num_numa_nodes());
+}
+
+BOOST_AUTO_TEST_CASE( test_sizes )
+{
+    vector<pair<char *, size_t> > blocks;
+
+    for (size_t size = 0;  size < 2000;  size += 7) {
+        char * mem = (char *)pool_allocate(size);
+        BOOST_CHECK_EQUAL((size_t)mem % 16, 0);
+        BOOST_CHECK_LT(pool_node(mem), num_numa_nodes());
+        memset(mem, size % 256, size);
+        blocks.push_back(make_pair(mem, size));
+    }
+
+    size_t errors = 0;
+    for (unsigned i = 0;  i < blocks.size();  ++i) {
+        char * mem = blocks[i].first;
+        size_t size = blocks[i].second;
+        for (unsigned j = 0;  j < size;  ++j)
+            errors += (mem[j] != (char)(size % 256));
+        pool_free(mem);
+    }
+
+    BOOST_CHECK_EQUAL(errors, 0);
+
+    pool_free(0);
+}
+
+BOOST_AUTO_TEST_CASE( test_reuse )
+{
+    // A block that's freed is the next one handed out on its node
+    void * mem = pool_allocate(40);
+    int node = pool_node(mem);
+    pool_free(mem);
+    void * mem2 = pool_allocate(33);
+    if (pool_node(mem2) == node)
+        BOOST_CHECK_EQUAL(mem, mem2);
+    pool_free(mem2);
+}
+
+/// Allocates blocks and hands them over to be freed by another thread
+struct Producer {
+    vector<int *> & blocks;
+    boost::mutex & lock;
+    int n;
+
+    Producer(vector<int *> & blocks, boost::mutex & lock, int n)
+        : blocks(blocks), lock(lock), n(n)
+    {
+    }
+
+    void operator () ()
+    {
+        for (int i = 0;  i < n;  ++i) {
+            int size = 1 + i % 20;
+            int * mem = (int *)pool_allocate(size * sizeof(int));
+            mem[0] = size;
+            for (int j = 1;  j < size;  ++j)
+                mem[j] = i;
+
+            boost::mutex::scoped_lock guard(lock);
+            blocks.push_back(mem);
+        }
+    }
+};
+
+struct Consumer {
+    vector<int *> & blocks;
+    boost::mutex & lock;
+    volatile bool & finished;
+    size_t & errors;
+
+    Consumer(vector<int *> & blocks, boost::mutex & lock,
+             volatile bool & finished, size_t & errors)
+        : blocks(blocks), lock(lock), finished(finished), errors(errors)
+    {
+    }
+
+    void operator () ()
+    {
+        size_t local_errors = 0;
+
+        for (;;) {
+            vector<int *> mine;
+            {
+                boost::mutex::scoped_lock guard(lock);
+                mine.swap(blocks);
+            }
+
+            if (mine.empty()) {
+                if (finished) break;
+                sched_yield();
+                continue;
+            }
+
+            for (unsigned i = 0;  i < mine.size();  ++i) {
+                int * mem = mine[i];
+                int size = mem[0];
+                for (int j = 2;  j < size;  ++j)
+                    local_errors += (mem[j] != mem[1]);
+                pool_free(mem);
+            }
+        }
+
+        boost::mutex::scoped_lock guard(lock);
+        errors += local_errors;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_free_on_other_thread )
+{
+    vector<int *> blocks;
+    boost::mutex lock;
+    volatile bool finished = false;
+    size_t errors = 0;
+
+    boost::thread_group producers, consumers;
+    for (unsigned i = 0;  i < 4;  ++i)
+        producers.create_thread(Producer(blocks, lock, 100000));
+    for (unsigned i = 0;  i < 4;  ++i)
+        consumers.create_thread(Consumer(blocks, lock, finished, errors));
+
+    producers.join_all();
+    finished = true;
+    consumers.join_all();
+
+    BOOST_CHECK_EQUAL(errors, 0);
+    BOOST_CHECK(blocks.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_versions_from_pool )
+{
+    Versioned2<int> var(3);
+
+    {
+        Local_Transaction trans;
+        var.write(4);
+        BOOST_CHECK_EQUAL(var.read(), 4);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var.read(), 4);
+    }
+}
@@ -28,6 +28,7 @@
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/versioned3.h"
 #include "jml/arch/demangle.h"
 
 using namespace ML;
@@ -519,10 +520,18 @@ BOOST_AUTO_TEST_CASE( test1 )
     run_object_test<Versioned2<int> >(2,  50000);
     run_object_test<Versioned2<int> >(10, 10000);
 
+    run_object_test<Versioned3<int> >(1, 100000);
+    run_object_test<Versioned3<int> >(2,  50000);
+    run_object_test<Versioned3<int> >(10, 10000);
+
     run_object_test<Versioned<int> >(1, 100000);
     run_object_test<Versioned<int> >(10, 10000);
     run_object_test<Versioned<int> >(100, 1000);
     run_object_test<Versioned<int> >(1000, 100);
+
+    run_object_test<Versioned<int, RW_Spinlock> >(1, 100000);
+    run_object_test<Versioned<int, RW_Spinlock> >(10, 10000);
+    run_object_test<Versioned<int, RW_Spinlock> >(100, 1000);
 }
 #endif
 
@@ -647,12 +656,18 @@ BOOST_AUTO_TEST_CASE( test2 )
     //run_object_test2(2, 20, 10);
     run_object_test2<Versioned<int> >(2,  5000, 2);
     run_object_test2<Versioned2<int> >(2,  5000, 2);
+    run_object_test2<Versioned3<int> >(2,  5000, 2);
     run_object_test2<Versioned<int> >(10, 10000, 100);
     run_object_test2<Versioned2<int> >(10, 10000, 100);
+    run_object_test2<Versioned3<int> >(10, 10000, 100);
     run_object_test2<Versioned<int> >(100, 1000, 10);
     run_object_test2<Versioned2<int> >(100, 1000, 10);
+    run_object_test2<Versioned3<int> >(100, 1000, 10);
     run_object_test2<Versioned<int> >(1000, 100, 100);
     run_object_test2<Versioned2<int> >(1000, 100, 100);
+    run_object_test2<Versioned3<int> >(1000, 100, 100);
+    run_object_test2<Versioned<int, RW_Spinlock> >(10, 10000, 100);
+    run_object_test2<Versioned<int, RW_Spinlock> >(100, 1000, 10);
 
     boost::timer t;
     run_object_test2<Versioned<int> >(1, 1000000, 1);
@@ -665,6 +680,12 @@ BOOST_AUTO_TEST_CASE( test2 )
     cerr << "elapsed for 1000000 iterations: " << t.elapsed() << endl;
     cerr << "for 2^32 iterations: " << (1ULL << 32) / 1000000.0 * t.elapsed()
          << "s" << endl;
+
+    t.restart();
+    run_object_test2<Versioned3<int> >(1, 1000000, 1);
+    cerr << "elapsed for 1000000 iterations: " << t.elapsed() << endl;
+    cerr << "for 2^32 iterations: " << (1ULL << 32) / 1000000.0 * t.elapsed()
+         << "s" << endl;
 }
 
 #endif
@@ -0,0 +1,208 @@
+/* retry_test.cc
+   Jeremy Barnes, 22 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of blocking transactions with retry().
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/demangle.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+size_t num_waiters()
+{
+    ACE_Guard<ACE_Mutex> guard(default_domain.commit_lock);
+    return default_domain.waiters.size();
+}
+
+template<class Var>
+void wait_for_flag(Var & flag, Var & other, volatile int & passes,
+                   int & result)
+{
+    Local_Transaction trans;
+    trans.record_reads();
+
+    for (;;) {
+        ++passes;
+        other.read();
+        if (flag.read() == 0) {
+            trans.retry();
+            continue;
+        }
+        result = flag.read();
+        break;
+    }
+}
+
+template<class Var>
+void do_retry_test()
+{
+    cerr << "retry test class " << demangle(typeid(Var).name()) << endl;
+
+    Var flag(0), other(0), unrelated(0);
+
+    volatile int passes = 0;
+    int result = 0;
+
+    boost::thread thread(boost::bind(&wait_for_flag<Var>,
+                                     boost::ref(flag),
+                                     boost::ref(other),
+                                     boost::ref(passes),
+                                     boost::ref(result)));
+
+    // Wait for it to block
+    while (num_waiters() == 0)
+        sched_yield();
+    BOOST_CHECK_EQUAL(passes, 1);
+
+    // Commits to objects that it didn't read don't wake it up
+    for (unsigned i = 0;  i < 100;  ++i) {
+        Local_Transaction trans;
+        unrelated.mutate() += 1;
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(passes, 1);
+    BOOST_CHECK_EQUAL(num_waiters(), 1);
+
+    // The blocked transaction doesn't keep any old versions alive
+    BOOST_CHECK_EQUAL(unrelated.history_size(), 0);
+
+    // A commit to another object that it read wakes it up, but the
+    // condition is still false so it blocks again
+    {
+        Local_Transaction trans;
+        other.mutate() += 1;
+        BOOST_CHECK(trans.commit());
+    }
+
+    while (passes < 2 || num_waiters() == 0)
+        sched_yield();
+    BOOST_CHECK_EQUAL(passes, 2);
+
+    {
+        Local_Transaction trans;
+        flag.write(5);
+        BOOST_CHECK(trans.commit());
+    }
+
+    thread.join();
+
+    BOOST_CHECK_EQUAL(passes, 3);
+    BOOST_CHECK_EQUAL(result, 5);
+    BOOST_CHECK_EQUAL(num_waiters(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_retry )
+{
+    do_retry_test<Versioned<int> >();
+    do_retry_test<Versioned2<int> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_retry_not_recording )
+{
+    Versioned<int> var(0);
+
+    Local_Transaction trans;
+    var.mutate() = 1;
+
+    // Reads weren't being recorded, so the first retry restarts straight
+    // away and turns recording on
+    trans.retry();
+    BOOST_CHECK_EQUAL(trans.num_local_values(), 0);
+    BOOST_CHECK_EQUAL(var.read(), 0);
+
+    // Already changed since the snapshot: doesn't block
+    {
+        Local_Transaction trans2;
+        var.write(2);
+        BOOST_CHECK(trans2.commit());
+    }
+
+    trans.retry();
+    BOOST_CHECK_EQUAL(var.read(), 2);
+
+    // Nothing read: nothing to wait for
+    trans.record_reads(false);
+    trans.record_reads();
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(trans.retry(), Exception);
+    }
+}
+
+template<class Var>
+void consumer_thread(Var & queue_size, Var & consumed, int total)
+{
+    Local_Transaction trans;
+    trans.record_reads();
+
+    int done = 0;
+    while (done < total) {
+        if (queue_size.read() == 0) {
+            trans.retry();
+            continue;
+        }
+
+        queue_size.mutate() -= 1;
+        consumed.mutate() += 1;
+        if (trans.commit()) ++done;
+    }
+}
+
+template<class Var>
+void run_producer_consumer_test(int nconsumers, int nitems)
+{
+    cerr << "producer consumer test with " << nconsumers << " consumers "
+         << "class " << demangle(typeid(Var).name()) << endl;
+
+    Var queue_size(0), consumed(0);
+
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < nconsumers;  ++i)
+        tg.create_thread(boost::bind(&consumer_thread<Var>,
+                                     boost::ref(queue_size),
+                                     boost::ref(consumed),
+                                     nitems));
+
+    Timer timer;
+
+    for (unsigned i = 0;  i < nitems * nconsumers;  ++i) {
+        Local_Transaction trans;
+        do {
+            queue_size.mutate() += 1;
+        } while (!trans.commit());
+    }
+
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(queue_size.read(), 0);
+    BOOST_CHECK_EQUAL(consumed.read(), nitems * nconsumers);
+    BOOST_CHECK_EQUAL(num_waiters(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_producer_consumer )
+{
+    run_producer_consumer_test<Versioned<int> >(1, 10000);
+    run_producer_consumer_test<Versioned2<int> >(1, 10000);
+    run_producer_consumer_test<Versioned<int> >(4, 2000);
+    run_producer_consumer_test<Versioned2<int> >(4, 2000);
+}
@@ -0,0 +1,348 @@
+/* secondary_index_test.cc
+   Jeremy Barnes, 27 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of transactional secondary indexes.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/demangle.h"
+#include "jmvcc/secondary_index.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+int bucket(int value)
+{
+    return value / 10;
+}
+
+template<class Var>
+void do_basic_test()
+{
+    cerr << "basic test class " << demangle(typeid(Var).name()) << endl;
+
+    Var a(3), b(7), c(15);
+
+    Secondary_Index<Var, int> index(&bucket);
+
+    index.add(a);
+    index.add(b);
+    index.add(c);
+
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(index.add(a), Exception);
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 3);
+
+    auto_ptr<Local_Transaction> before(new Local_Transaction());
+
+    BOOST_CHECK_EQUAL(index.count(0), 2);
+    BOOST_CHECK_EQUAL(index.count(1), 1);
+    BOOST_CHECK_EQUAL(index.count(2), 0);
+
+    vector<Var *> found = index.find(1);
+    BOOST_REQUIRE_EQUAL(found.size(), 1);
+    BOOST_CHECK_EQUAL(found[0], &c);
+
+    // A write that doesn't change the key doesn't add an entry
+    {
+        Local_Transaction trans;
+        a.write(4);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 3);
+
+    // Move a from bucket 0 to bucket 2
+    {
+        Local_Transaction trans;
+        a.write(25);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(index.count(0), 1);
+        BOOST_CHECK_EQUAL(index.count(2), 1);
+        BOOST_REQUIRE_EQUAL(index.find(2).size(), 1);
+        BOOST_CHECK_EQUAL(index.find(2)[0], &a);
+    }
+
+    // The old snapshot still sees it where it was
+    BOOST_CHECK_EQUAL(index.count(0), 2);
+    BOOST_CHECK_EQUAL(index.count(2), 0);
+
+    // The old entry is kept until that snapshot goes away
+    BOOST_CHECK_EQUAL(index.entry_count(), 4);
+    before.reset();
+    BOOST_CHECK_EQUAL(index.entry_count(), 3);
+
+    // With no snapshots to keep them, old entries go straight away
+    {
+        Local_Transaction trans;
+        b.write(35);
+        c.write(36);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 3);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(index.count(0), 0);
+        BOOST_CHECK_EQUAL(index.count(1), 0);
+        BOOST_CHECK_EQUAL(index.count(2), 1);
+        BOOST_CHECK_EQUAL(index.count(3), 2);
+    }
+
+    // A commit that fails doesn't change the index
+    {
+        Local_Transaction t1;
+        a.write(45);
+
+        {
+            Local_Transaction t2;
+            a.write(55);
+            BOOST_CHECK(t2.commit());
+        }
+
+        BOOST_CHECK(!t1.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(index.count(2), 0);
+        BOOST_CHECK_EQUAL(index.count(4), 0);
+        BOOST_CHECK_EQUAL(index.count(5), 1);
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 3);
+}
+
+BOOST_AUTO_TEST_CASE( test_basic )
+{
+    do_basic_test<Versioned<int> >();
+    do_basic_test<Versioned2<int> >();
+}
+
+template<class Var>
+void do_remove_test()
+{
+    cerr << "remove test class " << demangle(typeid(Var).name()) << endl;
+
+    Secondary_Index<Var, int> index(&bucket);
+    Var a(3), b(7), c(15);
+
+    index.add(a);
+    index.add(b);
+    index.add(c);
+
+    {
+        Local_Transaction before;
+
+        index.remove(b);
+
+        {
+            JML_TRACE_EXCEPTIONS(false);
+            BOOST_CHECK_THROW(index.remove(b), Exception);
+        }
+
+        {
+            Local_Transaction trans;
+            BOOST_CHECK_EQUAL(index.count(0), 1);
+            BOOST_REQUIRE_EQUAL(index.find(0).size(), 1);
+            BOOST_CHECK_EQUAL(index.find(0)[0], &a);
+        }
+
+        // Like any other commit, the removal isn't seen by older snapshots
+        BOOST_CHECK_EQUAL(index.count(0), 2);
+        BOOST_CHECK_EQUAL(index.entry_count(), 3);
+    }
+
+    // Its entry goes once nothing can see it, and writes to it no longer
+    // add any
+    BOOST_CHECK_EQUAL(index.entry_count(), 2);
+
+    {
+        Local_Transaction trans;
+        b.write(15);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(index.count(0), 1);
+        BOOST_CHECK_EQUAL(index.count(1), 1);
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 2);
+
+    // A member that is destroyed is no longer found, and is taken out by
+    // the next commit that writes a member
+    {
+        Var d(16);
+        index.add(d);
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(index.count(1), 2);
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(index.count(1), 1);
+        BOOST_REQUIRE_EQUAL(index.find(1).size(), 1);
+        BOOST_CHECK_EQUAL(index.find(1)[0], &c);
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 3);
+
+    {
+        Local_Transaction trans;
+        a.write(a.read());
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(index.entry_count(), 2);
+
+    // And so does one that outlives the index
+    Var * e = new Var(17);
+    {
+        Secondary_Index<Var, int> index2(&bucket);
+        index2.add(*e);
+    }
+    delete e;
+}
+
+BOOST_AUTO_TEST_CASE( test_remove )
+{
+    do_remove_test<Versioned<int> >();
+    do_remove_test<Versioned2<int> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_no_compress_epochs )
+{
+    Domain domain;
+
+    {
+        Secondary_Index<Versioned<int>, int> index(&bucket, domain);
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(domain.snapshot_info.compress_epochs(), Exception);
+    }
+
+    BOOST_CHECK_NO_THROW(domain.snapshot_info.compress_epochs());
+}
+
+template<class Var>
+struct Index_Test_Thread {
+    Var * vars;
+    int nvars;
+    int nbuckets;
+    Secondary_Index<Var, int> & index;
+    int iter;
+    boost::barrier & barrier;
+    size_t & errors;
+
+    Index_Test_Thread(Var * vars, int nvars, int nbuckets,
+                      Secondary_Index<Var, int> & index,
+                      int iter, boost::barrier & barrier, size_t & errors)
+        : vars(vars), nvars(nvars), nbuckets(nbuckets), index(index),
+          iter(iter), barrier(barrier), errors(errors)
+    {
+    }
+
+    void operator () ()
+    {
+        barrier.wait();
+
+        int local_errors = 0;
+
+        for (unsigned i = 0;  i < iter;  ++i) {
+            int var = random() % nvars, to = random() % nbuckets;
+
+            bool succeeded = false;
+
+            while (!succeeded) {
+                Local_Transaction trans;
+
+                // Every object is in exactly one bucket, and the one that
+                // its value in our snapshot says
+                size_t total = 0;
+                for (unsigned b = 0;  b < nbuckets;  ++b) {
+                    vector<Var *> found = index.find(b);
+                    total += found.size();
+                    for (unsigned j = 0;  j < found.size();  ++j)
+                        if (bucket(found[j]->read()) != b)
+                            ++local_errors;
+                }
+
+                if (total != nvars) {
+                    cerr << "total " << total << " nvars " << nvars << endl;
+                    ++local_errors;
+                }
+
+                vars[var].write(to * 10 + i % 10);
+
+                succeeded = trans.commit();
+            }
+        }
+
+        static Lock lock;
+        Guard guard(lock);
+
+        errors += local_errors;
+    }
+};
+
+template<class Var>
+void run_index_test(int nvars, int nbuckets, int nthreads, int niter)
+{
+    cerr << "index test with " << nvars << " vars, " << nbuckets
+         << " buckets, " << nthreads << " threads class "
+         << demangle(typeid(Var).name()) << endl;
+
+    Var vars[nvars];
+    Secondary_Index<Var, int> index(&bucket);
+    for (unsigned i = 0;  i < nvars;  ++i)
+        index.add(vars[i]);
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+    size_t errors = 0;
+
+    Timer timer;
+
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(Index_Test_Thread<Var>(vars, nvars, nbuckets, index,
+                                                niter, barrier, errors));
+
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+
+    BOOST_CHECK_EQUAL(errors, 0);
+
+    // Only the current entries are left
+    BOOST_CHECK_EQUAL(index.entry_count(), nvars);
+    BOOST_CHECK_EQUAL(default_domain.snapshot_info.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_threaded )
+{
+    run_index_test<Versioned<int> >(100, 10, 8, 1000);
+    run_index_test<Versioned2<int> >(100, 10, 8, 1000);
+    run_index_test<Versioned<int> >(10, 3, 8, 1000);
+    run_index_test<Versioned2<int> >(10, 3, 8, 1000);
+}
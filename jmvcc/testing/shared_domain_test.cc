@@ -0,0 +1,409 @@
+/* shared_domain_test.cc
+   Jeremy Barnes, 18 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of MVCC in shared memory between processes.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include "jml/arch/exception_handler.h"
+#include "jmvcc/shared_domain.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+namespace {
+
+string segment_name(const string & test)
+{
+    return format("/jmvcc_%s_%d", test.c_str(), getpid());
+}
+
+/// Wait for a child process and return its exit status
+int wait_child(pid_t pid)
+{
+    int status;
+    if (waitpid(pid, &status, 0) != pid)
+        throw Exception("waitpid failed");
+    if (!WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_shared_snapshot )
+{
+    string name = segment_name("snapshot");
+    Shared_Domain::unlink(name);
+
+    Shared_Domain domain(name, 1024 * 1024);
+    Shared_Versioned<int> & var
+        = domain.find_or_create<Shared_Versioned<int> >("var", 0);
+
+    BOOST_CHECK_EQUAL(&domain.find_or_create<Shared_Versioned<int> >("var", 1),
+                      &var);
+
+    {
+        typedef Shared_Versioned<int, 4> Other;
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(domain.find_or_create<Other>("var", 1), Exception);
+    }
+
+    Shared_Snapshot snapshot(domain);
+    BOOST_CHECK_EQUAL(domain.num_readers(), 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Map the segment separately, as another program would
+        Shared_Domain domain2(name);
+        Shared_Versioned<int> & var2
+            = domain2.find_or_create<Shared_Versioned<int> >("var", 0);
+        Shared_Transaction trans(domain2);
+        trans.write(var2, 10);
+        _exit(trans.commit() ? 0 : 1);
+    }
+
+    BOOST_CHECK_EQUAL(wait_child(pid), 0);
+
+    // Our snapshot still sees the old value; a new one sees the new one
+    BOOST_CHECK_EQUAL(snapshot.read(var), 0);
+    BOOST_CHECK_EQUAL(var.history_size(domain.current_epoch()), 1);
+
+    {
+        Shared_Snapshot snapshot2(domain);
+        BOOST_CHECK_EQUAL(snapshot2.read(var), 10);
+    }
+
+    // A transaction started before the write conflicts with it
+    {
+        Shared_Transaction trans(domain);
+        trans.mutate(var) += 1;
+        BOOST_CHECK_EQUAL(trans.read(var), 11);
+        BOOST_CHECK(trans.commit());
+
+        trans.mutate(var) += 1;
+        {
+            Shared_Transaction trans2(domain);
+            trans2.write(var, 20);
+            BOOST_CHECK(trans2.commit());
+        }
+        BOOST_CHECK(!trans.commit());
+        BOOST_CHECK_EQUAL(trans.read(var), 20);
+    }
+
+    snapshot.restart();
+    BOOST_CHECK_EQUAL(snapshot.read(var), 20);
+
+    Shared_Domain::unlink(name);
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_processes )
+{
+    string name = segment_name("processes");
+    Shared_Domain::unlink(name);
+
+    Shared_Domain domain(name, 1024 * 1024);
+
+    typedef Shared_Versioned<int> Var;
+
+    domain.find_or_create<Var>("var1", 0);
+    domain.find_or_create<Var>("var2", 0);
+
+    int nprocesses = 4, niter = 1000;
+
+    vector<pid_t> children;
+    for (int i = 0;  i < nprocesses;  ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            Shared_Domain domain2(name);
+            Var & var1 = domain2.find_or_create<Var>("var1", 0);
+            Var & var2 = domain2.find_or_create<Var>("var2", 0);
+
+            int errors = 0;
+            {
+                Shared_Transaction trans(domain2);
+
+                for (int j = 0;  j < niter;  ++j) {
+                    do {
+                        // Both variables move together, so they always sum
+                        // to zero in a consistent snapshot
+                        if (trans.read(var1) != -trans.read(var2)) ++errors;
+                        trans.mutate(var1) += 1;
+                        trans.mutate(var2) -= 1;
+                    } while (!trans.commit());
+                }
+            }
+
+            _exit(errors ? 1 : 0);
+        }
+        children.push_back(pid);
+    }
+
+    for (int i = 0;  i < nprocesses;  ++i)
+        BOOST_CHECK_EQUAL(wait_child(children[i]), 0);
+
+    Var & var1 = domain.find_or_create<Var>("var1", 0);
+    Var & var2 = domain.find_or_create<Var>("var2", 0);
+
+    Shared_Snapshot snapshot(domain);
+    BOOST_CHECK_EQUAL(snapshot.read(var1), nprocesses * niter);
+    BOOST_CHECK_EQUAL(snapshot.read(var2), -nprocesses * niter);
+    BOOST_CHECK_EQUAL(domain.num_readers(), 1);
+
+    Shared_Domain::unlink(name);
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_dead_reader )
+{
+    string name = segment_name("dead_reader");
+    Shared_Domain::unlink(name);
+
+    Shared_Domain domain(name, 1024 * 1024);
+
+    // Only three versions, so that it's easy to run out
+    typedef Shared_Versioned<int, 3> Var;
+    Var & var = domain.find_or_create<Var>("var", 0);
+
+    // Pin version 0
+    Shared_Snapshot snapshot(domain);
+
+    {
+        Shared_Transaction trans(domain);
+        trans.write(var, 1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    // A child pins version 1 and then dies without releasing it
+    pid_t pid = fork();
+    if (pid == 0) {
+        Shared_Domain domain2(name);
+        new Shared_Snapshot(domain2);
+        _exit(0);
+    }
+
+    BOOST_CHECK_EQUAL(wait_child(pid), 0);
+    BOOST_CHECK_EQUAL(domain.num_readers(), 2);
+
+    {
+        Shared_Transaction trans(domain);
+        trans.write(var, 2);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(var.history_size(domain.current_epoch()), 2);
+
+    // All three versions are now visible to a snapshot.  The next write
+    // can only proceed by reclaiming the dead child's slot.
+    {
+        Shared_Transaction trans(domain);
+        trans.write(var, 3);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(domain.num_readers(), 1);
+    BOOST_CHECK_EQUAL(snapshot.read(var), 0);
+
+    // Now pin version 3 (with a live reader), so that nothing can be freed
+    {
+        Shared_Snapshot snapshot2(domain);
+        Shared_Transaction trans(domain);
+        trans.write(var, 4);
+        BOOST_CHECK(trans.commit());
+
+        trans.write(var, 5);
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(trans.commit(), Exception);
+        BOOST_CHECK_EQUAL(snapshot2.read(var), 3);
+    }
+
+    BOOST_CHECK_EQUAL(snapshot.read(var), 0);
+
+    {
+        Shared_Transaction trans(domain);
+        BOOST_CHECK_EQUAL(trans.read(var), 4);
+        trans.write(var, 5);
+        BOOST_CHECK(trans.commit());
+    }
+
+    Shared_Domain::unlink(name);
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_reused_pid )
+{
+    string name = segment_name("reused_pid");
+    Shared_Domain::unlink(name);
+
+    Shared_Domain domain(name, 1024 * 1024);
+
+    Shared_Snapshot snapshot(domain);
+
+    // Start times are in clock ticks; make sure the child's is later than
+    // ours, or it can't be told from us.
+    usleep(2 * 1000000 / sysconf(_SC_CLK_TCK));
+
+    // A child pins a snapshot and dies without releasing it
+    pid_t pid = fork();
+    if (pid == 0) {
+        Shared_Domain domain2(name);
+        new Shared_Snapshot(domain2);
+        _exit(0);
+    }
+
+    BOOST_CHECK_EQUAL(wait_child(pid), 0);
+    BOOST_CHECK_EQUAL(domain.num_readers(), 2);
+
+    // Pretend that its pid has since been given to a process that is still
+    // running (us); the start time gives it away.
+    int found = 0;
+    for (unsigned i = 0;  i < Shared_Domain::MAX_READERS;  ++i) {
+        Shared_Domain::Reader_Slot & slot = domain.header->readers[i];
+        if (slot.pid != pid) continue;
+        BOOST_CHECK(slot.started != 0);
+        slot.pid = getpid();
+        ++found;
+    }
+    BOOST_CHECK_EQUAL(found, 1);
+
+    BOOST_CHECK_EQUAL(domain.reclaim_dead_readers(), 1);
+    BOOST_CHECK_EQUAL(domain.num_readers(), 1);
+
+    // Our own snapshot is still there
+    BOOST_CHECK_EQUAL(domain.reclaim_dead_readers(), 0);
+    BOOST_CHECK_EQUAL(domain.num_readers(), 1);
+
+    Shared_Domain::unlink(name);
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_dead_writer )
+{
+    string name = segment_name("dead_writer");
+    Shared_Domain::unlink(name);
+
+    Shared_Domain domain(name, 1024 * 1024);
+
+    typedef Shared_Versioned<int> Var;
+    Var & var1 = domain.find_or_create<Var>("var1", 0);
+    Var & var2 = domain.find_or_create<Var>("var2", 0);
+
+    Epoch epoch = domain.current_epoch();
+
+    // A child commits to both variables, but dies with the lock held after
+    // writing only the first of them; the epoch was never incremented.
+    pid_t pid = fork();
+    if (pid == 0) {
+        Shared_Domain domain2(name);
+        Var & var1 = domain2.find_or_create<Var>("var1", 0);
+
+        domain2.header->commit_lock.lock();
+
+        vector<Epoch> pinned;
+        domain2.pinned_epochs(pinned);
+        Epoch current = domain2.current_epoch();
+        int slot = var1.prepare(current, current, pinned);
+        if (slot < 0) _exit(1);
+        var1.publish(slot, 10, current + 1, domain2);
+
+        _exit(0);
+    }
+
+    BOOST_CHECK_EQUAL(wait_child(pid), 0);
+    BOOST_CHECK_EQUAL(domain.current_epoch(), epoch);
+    BOOST_CHECK_EQUAL(domain.header->num_pending, 1);
+
+    // The next commit, to the other variable, takes over the lock.  Once
+    // it has incremented the epoch, the half-written version must not
+    // become visible.
+    {
+        Shared_Transaction trans(domain);
+        trans.write(var2, 20);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(domain.current_epoch(), epoch + 1);
+    BOOST_CHECK_EQUAL(domain.header->num_pending, 0);
+
+    {
+        Shared_Snapshot snapshot(domain);
+        BOOST_CHECK_EQUAL(snapshot.read(var1), 0);
+        BOOST_CHECK_EQUAL(snapshot.read(var2), 20);
+    }
+
+    BOOST_CHECK_EQUAL(var1.history_size(domain.current_epoch()), 0);
+
+    // The lock works normally afterwards
+    {
+        Shared_Transaction trans(domain);
+        trans.write(var1, 30);
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(trans.read(var1), 30);
+    }
+
+    Shared_Domain::unlink(name);
+}
+
+/// Object whose constructor fails for negative values
+struct Checked {
+    explicit Checked(int value)
+        : value(value)
+    {
+        if (value < 0) throw Exception("Checked: negative");
+    }
+
+    int value;
+};
+
+BOOST_AUTO_TEST_CASE( test_shared_create_constructs_first )
+{
+    string name = segment_name("constructs_first");
+    Shared_Domain::unlink(name);
+
+    Shared_Domain domain(name, 1024 * 1024);
+
+    // An object that fails to be constructed is never found
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(domain.find_or_create<Checked>("obj", -1),
+                          Exception);
+    }
+
+    BOOST_CHECK_EQUAL(domain.find_or_create<Checked>("obj", 3).value, 3);
+    BOOST_CHECK_EQUAL(domain.find_or_create<Checked>("obj", 4).value, 3);
+
+    Shared_Domain::unlink(name);
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_dead_creator )
+{
+    string name = segment_name("dead_creator");
+    Shared_Domain::unlink(name);
+
+    JML_TRACE_EXCEPTIONS(false);
+
+    // The creator died before it could size the segment...
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    BOOST_REQUIRE(fd != -1);
+    BOOST_CHECK_THROW(Shared_Domain(name, 1024 * 1024, 20), Exception);
+
+    // ... or before it could initialize it
+    BOOST_REQUIRE_EQUAL(ftruncate(fd, 1024 * 1024), 0);
+    close(fd);
+    BOOST_CHECK_THROW(Shared_Domain(name, 1024 * 1024, 20), Exception);
+
+    // Once it's been unlinked, it can be created again
+    Shared_Domain::unlink(name);
+    Shared_Domain domain(name, 1024 * 1024, 20);
+    BOOST_CHECK_EQUAL(domain.current_epoch(), 1);
+
+    Shared_Domain::unlink(name);
+}
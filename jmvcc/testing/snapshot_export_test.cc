@@ -0,0 +1,233 @@
+/* snapshot_export_test.cc
+   Jeremy Barnes, 20 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of exporting snapshots to memory mapped images.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include "jml/arch/exception_handler.h"
+#include "jmvcc/snapshot_export.h"
+#include "jmvcc/transaction.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstddef>
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+struct Point {
+    double x, y;
+    int id;
+};
+
+std::ostream & operator << (std::ostream & stream, const Point & p)
+{
+    return stream << "(" << p.x << "," << p.y << "," << p.id << ")";
+}
+
+BOOST_AUTO_TEST_CASE( test_export_basics )
+{
+    string filename = format("/tmp/jmvcc_export_test_%d", getpid());
+
+    Versioned<int> i(1);
+    Versioned2<double> d(2.5);
+    Point p0 = { 1.0, 2.0, 3 };
+    Versioned2<Point> p(p0);
+
+    Snapshot_Export exporter;
+    exporter.add("int", i);
+    exporter.add("double", d);
+    exporter.add("point", p);
+
+    {
+        Local_Transaction trans;
+
+        // Written after the snapshot was taken; not in the image
+        {
+            Local_Transaction trans2;
+            i.write(10);
+            d.write(20.0);
+            BOOST_CHECK(trans2.commit());
+        }
+
+        exporter.write(filename, trans, 2);
+    }
+
+    Snapshot_Image image(filename);
+    BOOST_CHECK_EQUAL(image.size(), 3);
+    BOOST_CHECK_EQUAL(image.epoch() + 1, get_current_epoch());
+    BOOST_CHECK_EQUAL(image.get<int>("int"), 1);
+    BOOST_CHECK_EQUAL(image.get<double>("double"), 2.5);
+    BOOST_CHECK_EQUAL(image.get<Point>("point").id, 3);
+    BOOST_CHECK_EQUAL(image.get<Point>("point").y, 2.0);
+
+    // Index is sorted by name
+    BOOST_CHECK_EQUAL(image.name(0), string("double"));
+    BOOST_CHECK_EQUAL(image.name(2), string("point"));
+
+    size_t size;
+    BOOST_CHECK(image.find("nothing", size) == 0);
+
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(image.get<int>("nothing"), Exception);
+        BOOST_CHECK_THROW(image.get<int>("double"), Exception);
+    }
+
+    // Both versions were kept for the export, and are released after
+    BOOST_CHECK_EQUAL(i.history_size(), 0);
+    BOOST_CHECK_EQUAL(d.history_size(), 0);
+
+    unlink(filename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( test_export_parallel )
+{
+    string filename = format("/tmp/jmvcc_export_test2_%d", getpid());
+
+    int n = 10000;
+
+    vector<Versioned2<int> *> vars;
+    Snapshot_Export exporter;
+    for (unsigned i = 0;  i < n;  ++i) {
+        vars.push_back(new Versioned2<int>(i));
+        exporter.add(format("var%06d", i), *vars.back());
+    }
+
+    {
+        Local_Transaction trans;
+        for (unsigned i = 0;  i < n;  ++i)
+            vars[i]->mutate() *= 2;
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        exporter.write(filename, trans, 8);
+    }
+
+    Snapshot_Image image(filename);
+    BOOST_CHECK_EQUAL(image.size(), n);
+
+    int errors = 0;
+    for (unsigned i = 0;  i < n;  ++i)
+        errors += (image.get<int>(format("var%06d", i)) != i * 2);
+    BOOST_CHECK_EQUAL(errors, 0);
+
+    for (unsigned i = 0;  i < n;  ++i)
+        delete vars[i];
+
+    unlink(filename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( test_export_threads_own_transactions )
+{
+    string filename = format("/tmp/jmvcc_export_test3_%d", getpid());
+
+    int n = 1000;
+
+    vector<Versioned2<int> *> vars;
+    Snapshot_Export exporter;
+    for (int i = 0;  i < n;  ++i) {
+        vars.push_back(new Versioned2<int>(i));
+        exporter.add(format("var%06d", i), *vars.back());
+    }
+
+    {
+        // The threads read through transactions of their own, so the one
+        // that's passed in isn't touched by them
+        Local_Transaction trans;
+        trans.record_reads();
+        exporter.write(filename, trans, 8);
+        BOOST_CHECK_EQUAL(trans.num_local_values(), 0);
+
+        // Uncommitted writes are only seen by the transaction itself, so
+        // the values are written by this thread
+        vars[0]->write(-1);
+        vars[n - 1]->write(-2);
+        exporter.write(filename, trans, 8);
+    }
+
+    Snapshot_Image image(filename);
+    BOOST_CHECK_EQUAL(image.get<int>("var000000"), -1);
+    BOOST_CHECK_EQUAL(image.get<int>(format("var%06d", n - 1)), -2);
+    BOOST_CHECK_EQUAL(image.get<int>("var000500"), 500);
+
+    for (int i = 0;  i < n;  ++i)
+        delete vars[i];
+
+    unlink(filename.c_str());
+}
+
+void overwrite(const string & filename, uint64_t offset, uint64_t value)
+{
+    int fd = open(filename.c_str(), O_RDWR);
+    BOOST_REQUIRE(fd != -1);
+    BOOST_REQUIRE_EQUAL(pwrite(fd, &value, sizeof(value), offset),
+                        sizeof(value));
+    close(fd);
+}
+
+BOOST_AUTO_TEST_CASE( test_image_corrupt )
+{
+    string filename = format("/tmp/jmvcc_export_test4_%d", getpid());
+
+    Versioned<int> i(1);
+    Versioned<int> j(2);
+
+    Snapshot_Export exporter;
+    exporter.add("i", i);
+    exporter.add("j", j);
+
+    // Where the second entry of the index is
+    uint64_t index_offset = offsetof(Image_Header, index_offset);
+    uint64_t entry1 = (sizeof(Image_Header) + IMAGE_ALIGN - 1)
+        / IMAGE_ALIGN * IMAGE_ALIGN + sizeof(Image_Entry);
+
+    struct {
+        uint64_t offset, value;
+    } corruptions[] = {
+        { offsetof(Image_Header, num_entries), 1ULL << 60 },
+        { index_offset, 1ULL << 40 },
+        { index_offset, 3 },
+        { offsetof(Image_Header, names_offset), 0 },
+        { offsetof(Image_Header, data_offset), 1ULL << 40 },
+        { entry1 + offsetof(Image_Entry, name_offset), 1ULL << 40 },
+        { entry1 + offsetof(Image_Entry, data_offset), -1ULL },
+        { entry1 + offsetof(Image_Entry, size), -1ULL }
+    };
+
+    JML_TRACE_EXCEPTIONS(false);
+
+    for (unsigned c = 0;  c < sizeof(corruptions) / sizeof(corruptions[0]);
+         ++c) {
+        {
+            Local_Transaction trans;
+            exporter.write(filename, trans);
+        }
+        BOOST_REQUIRE_EQUAL(Snapshot_Image(filename).get<int>("j"), 2);
+
+        overwrite(filename, corruptions[c].offset, corruptions[c].value);
+        BOOST_CHECK_THROW(Snapshot_Image image(filename), Exception);
+    }
+
+    // Entries that aren't in the image
+    {
+        Local_Transaction trans;
+        exporter.write(filename, trans);
+    }
+    {
+        Snapshot_Image image(filename);
+        BOOST_CHECK_THROW(image.name(2), Exception);
+        BOOST_CHECK_THROW(image.data(-1), Exception);
+    }
+
+    unlink(filename.c_str());
+}
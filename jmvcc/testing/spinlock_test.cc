@@ -0,0 +1,218 @@
+/* spinlock_test.cc
+   Jeremy Barnes, 30 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test and contention benchmark of the spinlocks.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/demangle.h"
+#include "jmvcc/spinlock.h"
+#include <ace/Synch.h>
+#include <algorithm>
+
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE( test_ticket_spinlock_basics )
+{
+    BOOST_CHECK_EQUAL(sizeof(Ticket_Spinlock), (size_t)CACHE_LINE_SIZE);
+
+    Ticket_Spinlock lock;
+    BOOST_CHECK_EQUAL(lock.tryacquire(), 0);
+    BOOST_CHECK_EQUAL(lock.tryacquire(), -1);
+    lock.release();
+
+    {
+        ACE_Guard<Ticket_Spinlock> guard(lock);
+        BOOST_CHECK_EQUAL(lock.tryacquire(), -1);
+    }
+
+    BOOST_CHECK_EQUAL(lock.tryacquire(), 0);
+    lock.release();
+}
+
+template<class Lock>
+struct Contention_Thread {
+    Lock & lock;
+    volatile size_t & counter;
+    int iter;
+    int hold;
+    boost::barrier & barrier;
+
+    Contention_Thread(Lock & lock, volatile size_t & counter, int iter,
+                      int hold, boost::barrier & barrier)
+        : lock(lock), counter(counter), iter(iter), hold(hold),
+          barrier(barrier)
+    {
+    }
+
+    void operator () ()
+    {
+        barrier.wait();
+
+        for (int i = 0;  i < iter;  ++i) {
+            ACE_Guard<Lock> guard(lock);
+
+            // Not atomic, so lost updates show up if the lock doesn't work
+            size_t value = counter;
+            for (int j = 0;  j < hold;  ++j)
+                cpu_relax();
+            counter = value + 1;
+        }
+    }
+};
+
+template<class Lock>
+double run_contention_test(int nthreads, int iter, int hold)
+{
+    Lock lock;
+    volatile size_t counter = 0;
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(Contention_Thread<Lock>(lock, counter, iter, hold,
+                                                 barrier));
+
+    tg.join_all();
+
+    double elapsed = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(counter, (size_t)nthreads * iter);
+
+    return elapsed;
+}
+
+/// Counts how many times each thread gets the lock in a fixed time
+template<class Lock>
+struct Fairness_Thread {
+    Lock & lock;
+    volatile bool & finished;
+    size_t & acquisitions;
+    boost::barrier & barrier;
+
+    Fairness_Thread(Lock & lock, volatile bool & finished,
+                    size_t & acquisitions, boost::barrier & barrier)
+        : lock(lock), finished(finished), acquisitions(acquisitions),
+          barrier(barrier)
+    {
+    }
+
+    void operator () ()
+    {
+        barrier.wait();
+
+        size_t n = 0;
+        while (!finished) {
+            ACE_Guard<Lock> guard(lock);
+            ++n;
+        }
+
+        acquisitions = n;
+    }
+};
+
+template<class Lock>
+double run_fairness_test(int nthreads)
+{
+    Lock lock;
+    volatile bool finished = false;
+    vector<size_t> acquisitions(nthreads);
+
+    boost::barrier barrier(nthreads + 1);
+    boost::thread_group tg;
+
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(Fairness_Thread<Lock>(lock, finished,
+                                               acquisitions[i], barrier));
+
+    barrier.wait();
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    finished = true;
+    tg.join_all();
+
+    size_t min = *std::min_element(acquisitions.begin(), acquisitions.end());
+    size_t max = *std::max_element(acquisitions.begin(), acquisitions.end());
+
+    return (double)min / std::max<size_t>(max, 1);
+}
+
+void take_write_lock(RW_Spinlock & lock, volatile int & in)
+{
+    ACE_Write_Guard<RW_Spinlock> guard(lock);
+    in = 1;
+}
+
+BOOST_AUTO_TEST_CASE( test_rw_spinlock )
+{
+    RW_Spinlock lock;
+
+    // Readers don't block each other
+    {
+        ACE_Read_Guard<RW_Spinlock> guard1(lock);
+        ACE_Read_Guard<RW_Spinlock> guard2(lock);
+    }
+
+    // A writer waits for a reader to leave
+    volatile int writer_in = 0;
+    lock.acquire_read();
+
+    boost::thread writer(boost::bind(&take_write_lock, boost::ref(lock),
+                                     boost::ref(writer_in)));
+    for (unsigned i = 0;  i < 1000;  ++i)
+        sched_yield();
+    BOOST_CHECK_EQUAL(writer_in, 0);
+
+    lock.release();
+    writer.join();
+    BOOST_CHECK_EQUAL(writer_in, 1);
+
+    // And after it has gone, readers can get in again
+    {
+        ACE_Read_Guard<RW_Spinlock> guard(lock);
+    }
+
+    // Writers exclude each other
+    run_contention_test<RW_Spinlock>(4, 20000, 10);
+}
+
+template<class Lock>
+void run_benchmark()
+{
+    string name = demangle(typeid(Lock).name());
+
+    // More threads than CPUs measures the scheduler, not the lock
+    int max_threads = std::max<int>(2, boost::thread::hardware_concurrency());
+
+    for (int nthreads = 1;  nthreads <= max_threads;  nthreads *= 2) {
+        double short_hold = run_contention_test<Lock>(nthreads, 100000, 0);
+        double long_hold = run_contention_test<Lock>(nthreads, 20000, 100);
+        cerr << name << " " << nthreads << " threads: short hold "
+             << short_hold << "s, long hold " << long_hold << "s" << endl;
+    }
+
+    cerr << name << " fairness (min/max acquisitions over "
+         << max_threads << " threads): "
+         << run_fairness_test<Lock>(max_threads) << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_spinlocks )
+{
+    run_benchmark<Spinlock>();
+    run_benchmark<Ticket_Spinlock>();
+}
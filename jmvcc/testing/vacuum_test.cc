@@ -0,0 +1,460 @@
+/* vacuum_test.cc
+   Jeremy Barnes, 2 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of vacuum mode, where old versions are cleaned up an object at a
+   time instead of a version at a time.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/demangle.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jmvcc/versioned3.h"
+#include "jmvcc/secondary_index.h"
+#include "jmvcc/garbage.h"
+
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+template<class Var>
+void write_value(Domain & domain, Var & var, int value)
+{
+    Local_Transaction trans(domain);
+    var.write(value);
+    BOOST_REQUIRE(trans.commit());
+}
+
+template<class Var>
+int read_value(Domain & domain, Var & var)
+{
+    Local_Transaction trans(domain);
+    return var.read();
+}
+
+template<class Var>
+void test_vacuum_type()
+{
+    cerr << "testing " << demangle(typeid(Var).name()) << endl;
+
+    Domain domain;
+    domain.snapshot_info.set_vacuum_mode(true);
+
+    Var var(domain, 0);
+
+    // Nothing is cleaned up until we vacuum, and the object is only on
+    // the list once
+    for (int i = 1;  i <= 10;  ++i)
+        write_value(domain, var, i);
+
+    BOOST_CHECK_EQUAL(var.history_size(), 10);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 1);
+
+    // With no snapshots, only the newest is left
+    BOOST_CHECK_EQUAL(domain.snapshot_info.vacuum(), 1);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 0);
+    BOOST_CHECK_EQUAL(read_value(domain, var), 10);
+
+    // A snapshot keeps what it sees, and only that
+    {
+        Local_Transaction old_trans(domain);
+        BOOST_CHECK_EQUAL(var.read(), 10);
+
+        for (int i = 11;  i <= 20;  ++i)
+            write_value(domain, var, i);
+
+        BOOST_CHECK_EQUAL(var.history_size(), 10);
+        BOOST_CHECK_EQUAL(domain.snapshot_info.vacuum(), 1);
+        BOOST_CHECK_EQUAL(var.history_size(), 1);
+        BOOST_CHECK_EQUAL(var.read(), 10);
+
+        // It's still dirty, as the snapshot's version has to go later
+        BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 1);
+
+        // Can't change mode with a snapshot
+        {
+            JML_TRACE_EXCEPTIONS(false);
+            BOOST_CHECK_THROW(domain.snapshot_info.set_vacuum_mode(false),
+                              ML::Exception);
+        }
+
+        // A write in the old transaction conflicts as usual
+        var.write(100);
+        BOOST_CHECK(!old_trans.commit());
+        BOOST_CHECK_EQUAL(var.read(), 20);
+    }
+
+    BOOST_CHECK_EQUAL(read_value(domain, var), 20);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.vacuum(), 1);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+    // Several snapshots each keep theirs, and the versions between them go
+    {
+        Local_Transaction t1(domain);
+        BOOST_CHECK_EQUAL(var.read(), 20);
+        write_value(domain, var, 21);
+        write_value(domain, var, 22);
+
+        Local_Transaction t2(domain);
+        BOOST_CHECK_EQUAL(var.read(), 22);
+        write_value(domain, var, 23);
+        write_value(domain, var, 24);
+
+        Local_Transaction t3(domain);
+        BOOST_CHECK_EQUAL(var.read(), 24);
+        write_value(domain, var, 25);
+
+        domain.snapshot_info.vacuum();
+        BOOST_CHECK_EQUAL(var.history_size(), 3);
+
+        BOOST_CHECK_EQUAL(var.read(), 24);
+        BOOST_CHECK_EQUAL(read_value(domain, var), 25);
+    }
+
+    // Turning vacuum mode off cleans up what's left
+    BOOST_CHECK_EQUAL(var.history_size(), 3);
+    domain.snapshot_info.set_vacuum_mode(false);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 0);
+
+    // And from then on, versions are cleaned up one at a time again
+    write_value(domain, var, 26);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+    BOOST_CHECK_EQUAL(read_value(domain, var), 26);
+}
+
+BOOST_AUTO_TEST_CASE( test_vacuum )
+{
+    test_vacuum_type<Versioned<int> >();
+    test_vacuum_type<Versioned2<int> >();
+    test_vacuum_type<Versioned3<int> >();
+}
+
+template<class Var>
+void test_vacuum_incremental_type()
+{
+    Domain domain;
+    domain.snapshot_info.set_vacuum_mode(true);
+
+    enum { NVARS = 10 };
+    Var * vars[NVARS];
+    for (unsigned i = 0;  i < NVARS;  ++i)
+        vars[i] = new Var(domain, 0);
+
+    for (int j = 1;  j <= 3;  ++j) {
+        Local_Transaction trans(domain);
+        for (unsigned i = 0;  i < NVARS;  ++i)
+            vars[i]->write(j);
+        BOOST_REQUIRE(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), NVARS);
+
+    // Each call carries on from where the last one stopped
+    for (unsigned done = 0;  done < NVARS;  done += 3) {
+        BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), NVARS - done);
+        domain.snapshot_info.vacuum(3);
+    }
+
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 0);
+    for (unsigned i = 0;  i < NVARS;  ++i)
+        BOOST_CHECK_EQUAL(vars[i]->history_size(), 0);
+
+    // A dirty object that goes away is taken off the list
+    write_value(domain, *vars[0], 4);
+    write_value(domain, *vars[1], 4);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 2);
+    delete vars[0];
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 1);
+
+    BOOST_CHECK_EQUAL(domain.snapshot_info.vacuum(), 1);
+    BOOST_CHECK_EQUAL(vars[1]->history_size(), 0);
+
+    for (unsigned i = 1;  i < NVARS;  ++i)
+        delete vars[i];
+}
+
+BOOST_AUTO_TEST_CASE( test_vacuum_incremental )
+{
+    test_vacuum_incremental_type<Versioned<int> >();
+    test_vacuum_incremental_type<Versioned2<int> >();
+    test_vacuum_incremental_type<Versioned3<int> >();
+}
+
+
+/*****************************************************************************/
+/* CONCURRENT VACUUM                                                         */
+/*****************************************************************************/
+
+/** Writers keep the two variables equal, readers check that they see them
+    equal (with their snapshots held for a while, so that there are old
+    versions to keep) and a thread vacuums in a loop. */
+
+template<class Var>
+struct Vacuum_Test {
+    Domain & domain;
+    Var & var1;
+    Var & var2;
+    volatile bool finished;
+    size_t errors;
+
+    Vacuum_Test(Domain & domain, Var & var1, Var & var2)
+        : domain(domain), var1(var1), var2(var2), finished(false), errors(0)
+    {
+    }
+
+    void writer(int n, boost::barrier & barrier)
+    {
+        barrier.wait();
+        for (int i = 0;  i < n;  ) {
+            Local_Transaction trans(domain);
+            int val = var1.read() + 1;
+            var1.write(val);
+            var2.write(val);
+            if (trans.commit()) ++i;
+        }
+    }
+
+    void reader(boost::barrier & barrier)
+    {
+        barrier.wait();
+        while (!finished) {
+            Local_Transaction trans(domain);
+            int val1 = var1.read();
+            for (unsigned i = 0;  i < 100;  ++i)
+                sched_yield();
+            int val2 = var2.read();
+            if (val1 != val2) atomic_add(errors, 1);
+        }
+    }
+
+    void vacuumer(boost::barrier & barrier)
+    {
+        barrier.wait();
+        while (!finished) {
+            domain.snapshot_info.vacuum(1);
+            sched_yield();
+        }
+    }
+
+    void run(int nwriters, int nreaders, int n)
+    {
+        boost::barrier barrier(nwriters + nreaders + 1);
+        boost::thread_group writers, others;
+
+        for (int i = 0;  i < nwriters;  ++i)
+            writers.create_thread(boost::bind(&Vacuum_Test::writer, this, n,
+                                              boost::ref(barrier)));
+        for (int i = 0;  i < nreaders;  ++i)
+            others.create_thread(boost::bind(&Vacuum_Test::reader, this,
+                                             boost::ref(barrier)));
+        others.create_thread(boost::bind(&Vacuum_Test::vacuumer, this,
+                                         boost::ref(barrier)));
+
+        writers.join_all();
+        finished = true;
+        others.join_all();
+    }
+};
+
+template<class Var>
+void test_vacuum_threaded_type()
+{
+    Domain domain;
+    domain.snapshot_info.set_vacuum_mode(true);
+
+    Var var1(domain, 0), var2(domain, 0);
+
+    int nwriters = 2, n = 2000;
+    Vacuum_Test<Var> test(domain, var1, var2);
+    test.run(nwriters, 2, n);
+
+    BOOST_CHECK_EQUAL(test.errors, 0);
+    BOOST_CHECK_EQUAL(read_value(domain, var1), nwriters * n);
+    BOOST_CHECK_EQUAL(read_value(domain, var2), nwriters * n);
+
+    domain.snapshot_info.vacuum();
+    BOOST_CHECK_EQUAL(var1.history_size(), 0);
+    BOOST_CHECK_EQUAL(var2.history_size(), 0);
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_vacuum_threaded )
+{
+    test_vacuum_threaded_type<Versioned<int> >();
+    test_vacuum_threaded_type<Versioned2<int> >();
+    test_vacuum_threaded_type<Versioned3<int> >();
+}
+
+
+/*****************************************************************************/
+/* DESTRUCTION DURING VACUUM                                                 */
+/*****************************************************************************/
+
+/** Objects with history to vacuum are destroyed while another thread
+    vacuums.  The destructor has to wait for a vacuum that has already
+    taken the object off the list. */
+
+template<class Var>
+void vacuum_loop(Domain & domain, volatile bool & finished)
+{
+    while (!finished)
+        domain.snapshot_info.vacuum(1);
+}
+
+template<class Var>
+void test_vacuum_destroy_type()
+{
+    Domain domain;
+    domain.snapshot_info.set_vacuum_mode(true);
+
+    volatile bool finished = false;
+    boost::thread vacuumer(boost::bind(&vacuum_loop<Var>, boost::ref(domain),
+                                       boost::ref(finished)));
+
+    for (unsigned i = 0;  i < 2000;  ++i) {
+        Var * var = new Var(domain, 0);
+        {
+            Local_Transaction trans(domain);
+            write_value(domain, *var, 1);
+            write_value(domain, *var, 2);
+            BOOST_CHECK_EQUAL(var->read(), 0);
+        }
+        if (i % 2) domain.snapshot_info.vacuum(1);
+        delete var;
+    }
+
+    finished = true;
+    vacuumer.join();
+
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_vacuum_destroy )
+{
+    test_vacuum_destroy_type<Versioned<int> >();
+    test_vacuum_destroy_type<Versioned2<int> >();
+    test_vacuum_destroy_type<Versioned3<int> >();
+}
+
+
+/*****************************************************************************/
+/* SECONDARY INDEXES                                                         */
+/*****************************************************************************/
+
+int bucket(int value)
+{
+    return value / 10;
+}
+
+BOOST_AUTO_TEST_CASE( test_vacuum_index )
+{
+    Domain domain;
+    domain.snapshot_info.set_vacuum_mode(true);
+
+    Versioned<int> var(domain, 5);
+    Secondary_Index<Versioned<int>, int> index(&bucket, domain);
+    index.add(var);
+    domain.snapshot_info.vacuum();
+
+    {
+        Local_Transaction trans(domain);
+
+        // Moves to another bucket twice; the old entries stay while we can
+        // see them
+        write_value(domain, var, 15);
+        write_value(domain, var, 25);
+        BOOST_CHECK_EQUAL(index.entry_count(), 3);
+        BOOST_CHECK_EQUAL(index.count(0), 1);
+
+        domain.snapshot_info.vacuum();
+        BOOST_CHECK_EQUAL(index.entry_count(), 2);
+        BOOST_CHECK_EQUAL(index.count(0), 1);
+        BOOST_CHECK_EQUAL(index.count(1), 0);
+    }
+
+    BOOST_CHECK(domain.snapshot_info.dirty_count() != 0);
+    domain.snapshot_info.vacuum();
+    BOOST_CHECK_EQUAL(domain.snapshot_info.dirty_count(), 0);
+    BOOST_CHECK_EQUAL(index.entry_count(), 1);
+
+    {
+        Local_Transaction trans(domain);
+        BOOST_CHECK_EQUAL(index.count(2), 1);
+    }
+}
+
+
+/*****************************************************************************/
+/* BENCHMARK                                                                 */
+/*****************************************************************************/
+
+/** Commits to a few objects while a long snapshot is held, and then lets
+    the snapshot go.  With cleanups, each version is dealt with on its own;
+    with vacuum, each object every hundred commits. */
+
+template<class Var>
+double run_write_heavy(bool vacuum_mode, int nvars, int n)
+{
+    Domain domain;
+    domain.snapshot_info.set_vacuum_mode(vacuum_mode);
+
+    vector<Var *> vars;
+    for (int i = 0;  i < nvars;  ++i)
+        vars.push_back(new Var(domain, 0));
+
+    Timer timer;
+    {
+        Local_Transaction old_trans(domain);
+
+        for (int j = 0;  j < n;  ++j) {
+            Local_Transaction trans(domain);
+            vars[j % nvars]->write(j);
+            BOOST_REQUIRE(trans.commit());
+
+            // A little at a time, as a background thread would
+            if (vacuum_mode && j % 100 == 99)
+                domain.snapshot_info.vacuum();
+        }
+    }
+    if (vacuum_mode) domain.snapshot_info.vacuum();
+    double elapsed = timer.elapsed_wall();
+
+    for (int i = 0;  i < nvars;  ++i) {
+        BOOST_CHECK_EQUAL(vars[i]->history_size(), 0);
+        delete vars[i];
+    }
+
+    return elapsed;
+}
+
+template<class Var>
+void benchmark_vacuum_type()
+{
+    int nvars = 10, n = 100000;
+    double cleanups = run_write_heavy<Var>(false, nvars, n);
+    double vacuum = run_write_heavy<Var>(true, nvars, n);
+    cerr << demangle(typeid(Var).name()) << " " << n << " commits to "
+         << nvars << " objects: cleanups " << cleanups << "s, vacuum "
+         << vacuum << "s" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_vacuum )
+{
+    benchmark_vacuum_type<Versioned<int> >();
+    benchmark_vacuum_type<Versioned2<int> >();
+    benchmark_vacuum_type<Versioned3<int> >();
+}
@@ -0,0 +1,199 @@
+/* versioned_ptr_test.cc
+   Jeremy Barnes, 28 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of versioned pointers to immutable object graphs.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/versioned_ptr.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+int num_nodes = 0;
+
+/// Node of an immutable binary tree
+struct Node {
+    typedef boost::shared_ptr<const Node> Ptr;
+
+    Node(int value, const Ptr & left = Ptr(), const Ptr & right = Ptr())
+        : value(value), left(left), right(right)
+    {
+        atomic_add(num_nodes, 1);
+    }
+
+    ~Node()
+    {
+        atomic_add(num_nodes, -1);
+    }
+
+    int value;
+    Ptr left, right;
+
+    int total() const
+    {
+        return value
+            + (left ? left->total() : 0)
+            + (right ? right->total() : 0);
+    }
+};
+
+struct Delete_Node {
+    typedef void result_type;
+
+    void operator () (const Node * node) const
+    {
+        delete node;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_rcu_operator_arrow )
+{
+    In_Out_Critical critical;
+    RCU<Node, Delete_Node> rcu(new Node(3));
+    BOOST_CHECK_EQUAL(rcu->value, 3);
+}
+
+BOOST_AUTO_TEST_CASE( test_versioned_ptr )
+{
+    BOOST_CHECK_EQUAL(num_nodes, 0);
+
+    {
+        Node::Ptr big(new Node(100, Node::Ptr(new Node(1)),
+                               Node::Ptr(new Node(2))));
+
+        Versioned_Ptr<Node> root(Node::Ptr(new Node(0, big)));
+        big.reset();
+
+        BOOST_CHECK_EQUAL(num_nodes, 4);
+
+        auto_ptr<Local_Transaction> before(new Local_Transaction());
+        BOOST_CHECK_EQUAL(root->total(), 103);
+        const Node * shared = root->left.get();
+
+        // New root, sharing the big subtree
+        {
+            Local_Transaction trans;
+            Node::Ptr old = root.read_node();
+            root.write(new Node(10, old->left, Node::Ptr(new Node(20))));
+            BOOST_CHECK(trans.commit());
+        }
+
+        BOOST_CHECK_EQUAL(num_nodes, 6);
+
+        {
+            Local_Transaction trans;
+            BOOST_CHECK_EQUAL(root->total(), 133);
+            BOOST_CHECK_EQUAL(root->left.get(), shared);
+        }
+
+        // The old snapshot still sees the old tree
+        BOOST_CHECK_EQUAL(root->total(), 103);
+        BOOST_CHECK_EQUAL((*root).value, 0);
+
+        // Once it's gone, the old root is freed but the shared subtree isn't
+        before.reset();
+        BOOST_CHECK_EQUAL(root.history_size(), 0);
+        BOOST_CHECK_EQUAL(num_nodes, 5);
+
+        // A transaction that doesn't commit doesn't keep its tree alive
+        {
+            Local_Transaction trans;
+            root.write(new Node(1000));
+            BOOST_CHECK_EQUAL(root->total(), 1000);
+            BOOST_CHECK_EQUAL(num_nodes, 6);
+        }
+
+        BOOST_CHECK_EQUAL(num_nodes, 5);
+
+        // Nor does one that fails to commit
+        {
+            Local_Transaction t1;
+            root.write(new Node(2000));
+
+            {
+                Local_Transaction t2;
+                root.write(new Node(3000));
+                BOOST_CHECK(t2.commit());
+            }
+
+            BOOST_CHECK(!t1.commit());
+        }
+
+        BOOST_CHECK_EQUAL(num_nodes, 1);
+    }
+
+    BOOST_CHECK_EQUAL(num_nodes, 0);
+}
+
+struct Reader_Thread {
+    Versioned_Ptr<Node> & root;
+    volatile bool & finished;
+    size_t & errors;
+
+    Reader_Thread(Versioned_Ptr<Node> & root, volatile bool & finished,
+                  size_t & errors)
+        : root(root), finished(finished), errors(errors)
+    {
+    }
+
+    void operator () ()
+    {
+        size_t local_errors = 0;
+
+        // Every tree that is published has the same total
+        while (!finished) {
+            Local_Transaction trans;
+            const Node * node = root.read();
+            local_errors += (node->total() != 100);
+        }
+
+        static Lock lock;
+        Guard guard(lock);
+        errors += local_errors;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_versioned_ptr_threaded )
+{
+    {
+        Versioned_Ptr<Node> root(Node::Ptr(new Node(100)));
+
+        volatile bool finished = false;
+        size_t errors = 0;
+
+        boost::thread_group tg;
+        for (unsigned i = 0;  i < 4;  ++i)
+            tg.create_thread(Reader_Thread(root, finished, errors));
+
+        for (unsigned i = 0;  i < 20000;  ++i) {
+            Local_Transaction trans;
+            Node::Ptr old = root.read_node();
+            int left = i % 100;
+            root.write(new Node(100 - left, Node::Ptr(new Node(left)),
+                                old->right));
+            BOOST_CHECK(trans.commit());
+        }
+
+        finished = true;
+        tg.join_all();
+
+        BOOST_CHECK_EQUAL(errors, 0);
+        BOOST_CHECK_EQUAL(root.history_size(), 0);
+    }
+
+    BOOST_CHECK_EQUAL(num_nodes, 0);
+}
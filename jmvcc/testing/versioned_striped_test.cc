@@ -0,0 +1,193 @@
+/* versioned_striped_test.cc
+   Jeremy Barnes, 5 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test of striped versioned values.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned_striped.h"
+
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+typedef Versioned_Striped<int> Counter;
+
+void add(Counter & counter, int val)
+{
+    Local_Transaction trans(counter.domain());
+    counter.add(val);
+    BOOST_REQUIRE(trans.commit());
+}
+
+int read(Counter & counter)
+{
+    Local_Transaction trans(counter.domain());
+    return counter.read();
+}
+
+Striping_Policy fixed_stripes(unsigned n)
+{
+    Striping_Policy result;
+    result.min_stripes = result.max_stripes = n;
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE( test_striped )
+{
+    Domain domain;
+    Counter counter(domain, 10);
+
+    BOOST_CHECK_EQUAL(counter.stripe_count(), 1);
+    BOOST_CHECK_EQUAL(read(counter), 10);
+
+    add(counter, 5);
+    BOOST_CHECK_EQUAL(read(counter), 15);
+
+    {
+        Local_Transaction trans(domain);
+        BOOST_CHECK_EQUAL(counter.read(), 15);
+
+        // A transaction sees its own adds, but not those that commit after
+        // its snapshot, even into stripes that didn't exist
+        counter.add(1);
+        BOOST_CHECK_EQUAL(counter.read(), 16);
+
+        counter.set_policy(fixed_stripes(4));
+        BOOST_CHECK_EQUAL(counter.stripe_count(), 4);
+
+        // Another thread writes a stripe of its own
+        boost::thread thread(boost::bind(&add, boost::ref(counter), 100));
+        thread.join();
+        BOOST_CHECK_EQUAL(counter.allocated_stripes(), 2);
+        BOOST_CHECK_EQUAL(read(counter), 115);
+        BOOST_CHECK_EQUAL(counter.read(), 16);
+
+        // So there is no conflict with ours
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(counter.read(), 116);
+    }
+
+    BOOST_CHECK_EQUAL(read(counter), 116);
+    BOOST_CHECK_EQUAL(counter.history_size(), 0);
+
+    // Fewer stripes are written, but the value is still all there
+    counter.set_policy(fixed_stripes(1));
+    BOOST_CHECK_EQUAL(counter.stripe_count(), 1);
+    BOOST_CHECK_EQUAL(counter.allocated_stripes(), 2);
+    add(counter, 1);
+    BOOST_CHECK_EQUAL(read(counter), 117);
+
+    JML_TRACE_EXCEPTIONS(false);
+    BOOST_CHECK_THROW(counter.set_policy(fixed_stripes(0)), ML::Exception);
+    BOOST_CHECK_THROW(counter.set_policy(fixed_stripes(1000)), ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_striped_adapts )
+{
+    Domain domain;
+    Counter counter(domain, 0);
+
+    Striping_Policy policy;
+    policy.min_stripes = 1;
+    policy.max_stripes = 8;
+    policy.window = 2;
+    counter.set_policy(policy);
+
+    // Two transactions in the same thread write the same stripe, so one of
+    // them conflicts: half of the attempts, and so we grow
+    {
+        Local_Transaction trans1(domain);
+        counter.add(1);
+        add(counter, 1);
+        BOOST_CHECK(!trans1.commit());
+    }
+
+    BOOST_CHECK_EQUAL(counter.stripe_count(), 2);
+    BOOST_CHECK_EQUAL(read(counter), 1);
+
+    // No conflicts at all, so we shrink again
+    add(counter, 1);
+    add(counter, 1);
+    BOOST_CHECK_EQUAL(counter.stripe_count(), 1);
+    BOOST_CHECK_EQUAL(read(counter), 3);
+}
+
+
+/*****************************************************************************/
+/* CONCURRENT ADDS                                                           */
+/*****************************************************************************/
+
+/** Each thread adds to the counter in a loop, retrying its transaction
+    until it commits.  The transactions are made to last a while, so that
+    they overlap. */
+
+void add_loop(Counter & counter, int n, size_t & aborts,
+              boost::barrier & barrier)
+{
+    barrier.wait();
+    size_t my_aborts = 0;
+    for (int i = 0;  i < n;  ++i) {
+        Local_Transaction trans(counter.domain());
+        for (;;) {
+            counter.add(1);
+            sched_yield();
+            if (trans.commit()) break;
+            ++my_aborts;
+        }
+    }
+    atomic_add(aborts, my_aborts);
+}
+
+size_t run_adds(const Striping_Policy & policy, int nthreads, int n,
+                double & elapsed)
+{
+    Domain domain;
+    Counter counter(domain, 0);
+    counter.set_policy(policy);
+
+    size_t aborts = 0;
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&add_loop, boost::ref(counter), n,
+                                     boost::ref(aborts),
+                                     boost::ref(barrier)));
+    tg.join_all();
+    elapsed = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(read(counter), nthreads * n);
+    BOOST_CHECK_EQUAL(counter.history_size(), 0);
+
+    return aborts;
+}
+
+BOOST_AUTO_TEST_CASE( test_striped_threaded )
+{
+    int nthreads = 4, n = 5000;
+
+    Striping_Policy adaptive;
+    adaptive.max_stripes = nthreads;
+
+    double single_time, adaptive_time;
+    size_t single = run_adds(fixed_stripes(1), nthreads, n, single_time);
+    size_t striped = run_adds(adaptive, nthreads, n, adaptive_time);
+
+    cerr << nthreads << " threads x " << n << " adds: one stripe "
+         << single << " aborts in " << single_time << "s, adaptive "
+         << striped << " aborts in " << adaptive_time << "s" << endl;
+}
@@ -28,6 +28,7 @@
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/versioned3.h"
 
 using namespace ML;
 using namespace JMVCC;
@@ -227,9 +228,242 @@ BOOST_AUTO_TEST_CASE( test0 )
     do_versioned_test<Versioned<int> >();
 }
 
+BOOST_AUTO_TEST_CASE( test0_rw_lock )
+{
+    do_versioned_test<Versioned<int, RW_Spinlock> >();
+}
+
 BOOST_AUTO_TEST_CASE( test1 )
 {
     cerr << endl << "================ versioned2" << endl;
 
     do_versioned_test<Versioned2<int> >();
 }
+
+BOOST_AUTO_TEST_CASE( test1_versioned3 )
+{
+    cerr << endl << "================ versioned3" << endl;
+
+    do_versioned_test<Versioned3<int> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_read_latest )
+{
+    Versioned2<int> var(1);
+
+    // No transaction needed
+    BOOST_CHECK_EQUAL(var.read_latest(), 1);
+
+    {
+        Local_Transaction trans;
+        var.write(2);
+
+        // Our own write isn't committed yet
+        BOOST_CHECK_EQUAL(var.read(), 2);
+        BOOST_CHECK_EQUAL(var.read_latest(), 1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(var.read_latest(), 2);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+}
+
+/// Each value has the commit number twice, so that torn reads show up; the
+/// fixed width means they sort in commit order
+string commit_value(int i)
+{
+    return format("%08d-%08d", i, i);
+}
+
+void commit_values(Versioned2<string> & var, int n)
+{
+    for (int i = 1;  i <= n;  ++i) {
+        Local_Transaction trans;
+        var.write(commit_value(i));
+        if (!trans.commit())
+            throw Exception("commit failed with one writer");
+    }
+}
+
+void read_latest_values(const Versioned2<string> & var, int n,
+                        size_t & errors)
+{
+    string last = commit_value(0);
+    for (int i = 0;  i < n;  ++i) {
+        string val = var.read_latest();
+
+        // Never torn, and never goes backwards
+        errors += (val.size() != 17);
+        errors += (val.substr(0, 8) != val.substr(9));
+        errors += (val < last);
+        last = val;
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_read_latest_threaded )
+{
+    Versioned2<string> var(commit_value(0));
+
+    int nreaders = 4;
+    vector<size_t> errors(nreaders);
+
+    boost::thread_group tg;
+    tg.create_thread(boost::bind(&commit_values, boost::ref(var), 20000));
+    for (int i = 0;  i < nreaders;  ++i)
+        tg.create_thread(boost::bind(&read_latest_values, boost::cref(var),
+                                     100000, boost::ref(errors[i])));
+    tg.join_all();
+
+    for (int i = 0;  i < nreaders;  ++i)
+        BOOST_CHECK_EQUAL(errors[i], 0);
+
+    BOOST_CHECK_EQUAL(var.read_latest(), commit_value(20000));
+}
+
+/// Counts how many times values are copied
+struct Copy_Counted {
+    Copy_Counted(int value = 0)
+        : value(value)
+    {
+    }
+
+    Copy_Counted(const Copy_Counted & other)
+        : value(other.value)
+    {
+        ++copies;
+    }
+
+    int value;
+    static int copies;
+};
+
+int Copy_Counted::copies = 0;
+
+std::ostream & operator << (std::ostream & stream, const Copy_Counted & c)
+{
+    return stream << c.value;
+}
+
+BOOST_AUTO_TEST_CASE( test_cleanup_in_place )
+{
+    Versioned2<Copy_Counted> var(0);
+
+    // An old transaction keeps the first version, and so the history, alive
+    auto_ptr<Local_Transaction> old(new Local_Transaction());
+    BOOST_CHECK_EQUAL(var.read().value, 0);
+
+    for (int i = 1;  i <= 10;  ++i) {
+        Local_Transaction trans;
+        var.write(i);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(var.history_size(), 1);
+
+    // Cleaning up the old version doesn't copy the others
+    Copy_Counted::copies = 0;
+    old.reset();
+    BOOST_CHECK_EQUAL(Copy_Counted::copies, 0);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var.read().value, 10);
+    }
+
+    // A commit that fails rolls back what it had set up
+    Versioned2<Copy_Counted> var2(0);
+    {
+        Local_Transaction trans;
+        var.write(var.read().value + 1);
+        var2.write(var2.read().value + 1);
+
+        {
+            Local_Transaction trans2;
+            var.write(100);
+            var2.write(100);
+            BOOST_CHECK(trans2.commit());
+        }
+
+        BOOST_CHECK(!trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var.read().value, 100);
+        BOOST_CHECK_EQUAL(var2.read().value, 100);
+    }
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+    BOOST_CHECK_EQUAL(var2.history_size(), 0);
+}
+
+/// Throws from its copy constructor once armed
+struct Copy_Throws {
+    Copy_Throws(int value = 0)
+        : value(value)
+    {
+    }
+
+    Copy_Throws(const Copy_Throws & other)
+        : value(other.value)
+    {
+        if (armed && --armed == 0)
+            throw Exception("copy failed");
+    }
+
+    int value;
+    static int armed;  ///< Copies to make, including the one that throws
+};
+
+int Copy_Throws::armed = 0;
+
+std::ostream & operator << (std::ostream & stream, const Copy_Throws & c)
+{
+    return stream << c.value;
+}
+
+BOOST_AUTO_TEST_CASE( test_copy_throws )
+{
+    Versioned2<Copy_Throws> var(0);
+
+    // An old transaction keeps the first version alive, so that there is
+    // something to clean up afterwards
+    auto_ptr<Local_Transaction> old(new Local_Transaction());
+    BOOST_CHECK_EQUAL(var.read().value, 0);
+
+    {
+        Local_Transaction trans;
+        var.write(1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(var.history_size(), 1);
+
+    // Fail while copying the history, and then while adding the new value
+    JML_TRACE_EXCEPTIONS(false);
+    for (int fail_at = 1;  fail_at <= 3;  ++fail_at) {
+        Local_Transaction trans;
+        var.write(2);
+        Copy_Throws::armed = fail_at;
+        BOOST_CHECK_THROW(trans.commit(), Exception);
+        Copy_Throws::armed = 0;
+    }
+
+    BOOST_CHECK_EQUAL(var.history_size(), 1);
+
+    // The cleanup mustn't wait for a copy that will never be published
+    old.reset();
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var.read().value, 1);
+        var.write(3);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var.read().value, 3);
+    }
+}
@@ -6,6 +6,8 @@
 */
 
 #include "transaction.h"
+#include "futex.h"
+#include <algorithm>
 
 
 using namespace std;
@@ -17,7 +19,7 @@ namespace JMVCC {
 __thread Transaction * current_trans = 0;
 
 /// For the moment, only one commit can happen at a time
-ACE_Mutex commit_lock;
+ACE_Mutex & commit_lock = default_domain.commit_lock;
 
 
 void no_transaction_exception(const Versioned_Object * obj)
@@ -25,6 +27,11 @@ void no_transaction_exception(const Versioned_Object * obj)
     throw Exception("not in a transaction");
 }
 
+void wrong_domain_exception(const Versioned_Object * obj)
+{
+    throw Exception("object accessed from a transaction in another domain");
+}
+
 
 /*****************************************************************************/
 /* TRANSACTION                                                               */
@@ -34,9 +41,16 @@ bool
 Transaction::
 commit()
 {
-    status = COMMITTING;
-    Epoch result = Sandbox::commit(epoch());
-    status = result ? COMMITTED : FAILED;
+    if (debug_level) status = COMMITTING;
+
+    // A lazy snapshot has to be registered before the commit puts old
+    // versions on the newest snapshot's list.  That moves its epoch on, but
+    // what we wrote is still checked against the epoch that we read at.
+    Epoch old_epoch = epoch();
+    if (num_local_values()) pin();
+
+    Epoch result = Sandbox::commit(domain(), old_epoch);
+    if (debug_level) status = result ? COMMITTED : FAILED;
     if (!result) restart();
     
     if (use_critical)
@@ -47,6 +61,74 @@ commit()
     return result;
 }
 
+void
+Transaction::
+retry()
+{
+    if (next_domain)
+        throw Exception("retry() isn't supported across domains");
+
+    if (!recording_reads) {
+        // We don't know what was read, so we can't know what to wait for.
+        // Start again, this time recording.
+        recording_reads = true;
+        Sandbox::clear();
+        restart();
+        return;
+    }
+
+    Retry_Waiter waiter;
+    waiter.objects.swap(reads);
+    std::sort(waiter.objects.begin(), waiter.objects.end());
+    waiter.objects.erase(std::unique(waiter.objects.begin(),
+                                     waiter.objects.end()),
+                         waiter.objects.end());
+
+    if (waiter.objects.empty())
+        throw Exception("retry(): nothing was read, so nothing to wait for");
+
+    Sandbox::clear();
+
+    Domain & domain = this->domain();
+
+    bool changed = false;
+    {
+        // Commits wake waiters with the commit lock held, so holding it
+        // here means that we can't miss a wakeup between our check and
+        // going on the list
+        ACE_Guard<ACE_Mutex> guard(domain.commit_lock);
+
+        for (unsigned i = 0;  i < waiter.objects.size() && !changed;  ++i)
+            changed = waiter.objects[i]->latest_epoch() > epoch();
+
+        if (!changed) domain.waiters.push_back(&waiter);
+    }
+
+    if (changed) {
+        restart();
+        return;
+    }
+
+    // Don't hold up cleanups while we sleep
+    unregister_me();
+    if (use_critical) leave_critical();
+
+    while (!waiter.woken)
+        futex_wait(waiter.woken, 0);
+
+    if (use_critical) enter_critical();
+    register_me();
+}
+
+Transaction *
+Transaction::
+for_domain(const Domain & domain)
+{
+    for (Transaction * t = this;  t;  t = t->next_domain)
+        if (&t->domain() == &domain) return t;
+    return 0;
+}
+
 void
 Transaction::
 dump(std::ostream & stream, int indent)
@@ -56,6 +138,170 @@ dump(std::ostream & stream, int indent)
            << retries() << endl;
     stream << s << "sandbox" << endl;
     Sandbox::dump(stream, indent);
+    if (next_domain) {
+        stream << s << "next domain" << endl;
+        next_domain->dump(stream, indent);
+    }
+}
+
+
+/*****************************************************************************/
+/* SHADOW_TRANSACTION                                                        */
+/*****************************************************************************/
+
+Shadow_Transaction::
+Shadow_Transaction(const Transaction & other)
+    : Transaction(other, Borrowed())
+{
+    // Shadow the other domains too, so that reads in them see the same cut
+    if (other.next_domain)
+        next_domain = new Shadow_Transaction(*other.next_domain);
+}
+
+Shadow_Transaction::
+~Shadow_Transaction()
+{
+    delete next_domain;
+}
+
+
+/*****************************************************************************/
+/* MULTI_DOMAIN_TRANSACTION                                                  */
+/*****************************************************************************/
+
+namespace {
+
+/** Holds the commit locks of several domains.  They are always taken in
+    the same (address) order, so that two multi-domain commits with
+    domains in common can't deadlock. */
+struct Commit_Locks {
+    Commit_Locks(const vector<Domain *> & domains)
+        : domains(domains)
+    {
+        for (unsigned i = 0;  i < domains.size();  ++i)
+            domains[i]->commit_lock.acquire();
+    }
+
+    ~Commit_Locks()
+    {
+        for (int i = domains.size() - 1;  i >= 0;  --i)
+            domains[i]->commit_lock.release();
+    }
+
+    const vector<Domain *> & domains;
+};
+
+} // file scope
+
+struct Multi_Domain_Transaction::Participant : public Transaction {
+    Participant(Domain & domain)
+        : Transaction(domain, false /* use_critical */, Unregistered())
+    {
+    }
+
+    using Transaction::register_me;
+};
+
+Multi_Domain_Transaction::
+Multi_Domain_Transaction(Domain & domain1, Domain & domain2,
+                         bool use_critical)
+    : Transaction(domain1, use_critical, Unregistered())
+{
+    vector<Domain *> domains;
+    domains.push_back(&domain1);
+    domains.push_back(&domain2);
+    init(domains);
+}
+
+Multi_Domain_Transaction::
+Multi_Domain_Transaction(const std::vector<Domain *> & domains,
+                         bool use_critical)
+    : Transaction(*domains.at(0), use_critical, Unregistered())
+{
+    init(domains);
+}
+
+void
+Multi_Domain_Transaction::
+init(const std::vector<Domain *> & domains)
+{
+    lock_order = domains;
+    std::sort(lock_order.begin(), lock_order.end());
+    if (std::adjacent_find(lock_order.begin(), lock_order.end())
+        != lock_order.end())
+        throw Exception("Multi_Domain_Transaction: domain given twice");
+
+    Transaction * last = this;
+    for (unsigned i = 1;  i < domains.size();  ++i) {
+        Participant * p = new Participant(*domains[i]);
+        participants.push_back(p);
+        last->next_domain = p;
+        last = p;
+    }
+
+    // Register all of our snapshots at once, so that they are consistent
+    // with each other
+    Commit_Locks locks(lock_order);
+
+    register_me();
+    for (unsigned i = 0;  i < participants.size();  ++i)
+        participants[i]->register_me();
+}
+
+Multi_Domain_Transaction::
+~Multi_Domain_Transaction()
+{
+    for (unsigned i = 0;  i < participants.size();  ++i)
+        delete participants[i];
+}
+
+bool
+Multi_Domain_Transaction::
+commit()
+{
+    if (debug_level) status = COMMITTING;
+
+    bool result = true;
+
+    {
+        Commit_Locks locks(lock_order);
+
+        // Phase 1: prepare in every domain that has something to commit
+        vector<pair<Transaction *, Epoch> > prepared;
+
+        for (Transaction * t = this;  result && t;  t = t->next_domain) {
+            if (t->num_local_values() == 0) continue;
+            Epoch new_epoch = t->domain().current_epoch() + 1;
+            result = t->prepare(t->epoch(), new_epoch);
+            if (result) prepared.push_back(make_pair(t, new_epoch));
+        }
+
+        // Phase 2: publish them all, or roll back those that were prepared
+        for (unsigned i = 0;  i < prepared.size();  ++i) {
+            if (result)
+                prepared[i].first->publish(prepared[i].first->domain(),
+                                           prepared[i].second);
+            else prepared[i].first->abort(prepared[i].second);
+        }
+
+        // Move all of the snapshots forward together, with the locks still
+        // held so that they stay consistent with each other
+        for (Transaction * t = this;  t;  t = t->next_domain) {
+            t->clear();
+            if (result) t->set_epoch(t->domain().current_epoch());
+            else t->restart();
+        }
+    }
+
+    for (Transaction * t = this;  t;  t = t->next_domain)
+        t->notify();
+
+    if (debug_level) status = result ? COMMITTED : FAILED;
+
+    if (use_critical)
+        new_critical();
+
+    return result;
 }
 
 } // namespace JMVCC
@@ -11,6 +11,7 @@
 #include "snapshot.h"
 #include "sandbox.h"
 #include "garbage.h"
+#include <algorithm>
 
 
 namespace JMVCC {
@@ -22,22 +23,33 @@ extern __thread Transaction * current_trans;
 
 size_t current_trans_epoch();
 
-/// For the moment, only one commit can happen at a time
-extern ACE_Mutex commit_lock;
+/// For the moment, only one commit can happen at a time.  This is the commit
+/// lock of the default domain.
+extern ACE_Mutex & commit_lock;
 
 void no_transaction_exception(const Versioned_Object * obj) __attribute__((__noreturn__));
 
+void wrong_domain_exception(const Versioned_Object * obj) __attribute__((__noreturn__));
+
 
 
 /*****************************************************************************/
 /* TRANSACTION                                                               */
 /*****************************************************************************/
 
-/// A transaction is both a snapshot and a sandbox.
+/// A transaction is both a snapshot and a sandbox.  A Local_Transaction in
+/// a domain with lazy snapshots only registers its snapshot when it commits
+/// something; see Snapshot_Info::set_lazy_snapshots().
 struct Transaction : public Snapshot, public Sandbox {
 
     Transaction(bool use_critical = true)
-        : use_critical(use_critical)
+        : use_critical(use_critical), next_domain(0), recording_reads(false)
+    {
+    }
+
+    explicit Transaction(Domain & domain, bool use_critical = true)
+        : Snapshot(domain), use_critical(use_critical), next_domain(0),
+          recording_reads(false)
     {
     }
 
@@ -49,10 +61,108 @@ struct Transaction : public Snapshot, public Sandbox {
 
     void dump(std::ostream & stream = std::cerr, int indent = 0);
 
+    /// Return the part of the transaction that runs in the given domain, or
+    /// zero if the transaction doesn't span that domain.
+    Transaction * for_domain(const Domain & domain);
+
+    /** Abandon the transaction, and block until another transaction commits
+        a new version of one of the objects that this one read.  The
+        transaction is then restarted, and should be run again from the
+        beginning.  This is used to wait for a condition:
+
+            Local_Transaction trans;
+            trans.record_reads();
+            for (;;) {
+                if (queue.read().empty()) {
+                    trans.retry();
+                    continue;
+                }
+                ...
+            }
+
+        While blocked, the thread uses no CPU and the transaction's snapshot
+        doesn't hold on to any old versions.  If reads weren't being
+        recorded, recording is turned on and the transaction restarts
+        straight away.
+    */
+    void retry();
+
+    /// Start recording the objects that are read, for retry()
+    void record_reads(bool record = true)
+    {
+        recording_reads = record;
+        if (!record) reads.clear();
+    }
+
+    /// Called by objects whenever they are read or mutated
+    void record_read(const Versioned_Object * obj)
+    {
+        if (JML_UNLIKELY(recording_reads)) reads.push_back(obj);
+    }
+
     // Do we use critical sections?
     bool use_critical;
+
+protected:
+    Transaction(Domain & domain, bool use_critical, Unregistered)
+        : Snapshot(domain, Unregistered()), use_critical(use_critical),
+          next_domain(0), recording_reads(false)
+    {
+    }
+
+    /// Lazy if the domain has lazy snapshots; only for a transaction that
+    /// is already in a critical section
+    Transaction(Domain & domain, bool use_critical, Lazy)
+        : Snapshot(domain, Lazy()), use_critical(use_critical),
+          next_domain(0), recording_reads(false)
+    {
+    }
+
+    /// At the same epoch as the other one; see Shadow_Transaction
+    Transaction(const Transaction & other, Borrowed)
+        : Snapshot(other, Borrowed()), use_critical(false), next_domain(0),
+          recording_reads(false)
+    {
+    }
+
+    /// For a transaction that spans several domains, the part of the
+    /// transaction in the next domain.  Zero otherwise.
+    Transaction * next_domain;
+
+    /// Objects that have been read, if recording_reads is set
+    bool recording_reads;
+    std::vector<const Versioned_Object *> reads;
+
+    friend class Multi_Domain_Transaction;
+    friend class Shadow_Transaction;
 };
 
+/*****************************************************************************/
+/* RETRY_WAITER                                                              */
+/*****************************************************************************/
+
+/** A transaction that is blocked in retry().  It is on its domain's list
+    of waiters until a commit writes one of the objects that it read. */
+
+struct Retry_Waiter {
+    Retry_Waiter()
+        : woken(0)
+    {
+    }
+
+    /// Objects to wait for, sorted
+    std::vector<const Versioned_Object *> objects;
+
+    /// Set to one (and the thread woken up) by the commit
+    volatile int woken;
+
+    bool waits_for(const Versioned_Object * obj) const
+    {
+        return std::binary_search(objects.begin(), objects.end(), obj);
+    }
+};
+
+
 struct In_Out_Critical {
     In_Out_Critical()
     {
@@ -66,11 +176,32 @@ struct In_Out_Critical {
 };
 
 
+/*****************************************************************************/
+/* SHADOW_TRANSACTION                                                        */
+/*****************************************************************************/
+
+/** A read-only transaction at the same epoch as another, so that another
+    thread can read what the other one sees while it's still in use.  Each
+    thread needs one of its own, as reading through a transaction updates
+    it.  It doesn't see the other one's uncommitted writes, and mustn't be
+    committed.
+
+    It isn't registered with the domain: the other transaction keeps the
+    versions at its epoch alive, so it must outlive this one.  The thread
+    using it must be in a critical section.
+*/
+struct Shadow_Transaction : public Transaction {
+    explicit Shadow_Transaction(const Transaction & other);
+
+    ~Shadow_Transaction();
+};
+
+
 /*****************************************************************************/
 /* LOCAL_TRANSACTION                                                         */
 /*****************************************************************************/
 struct Local_Transaction : public In_Out_Critical, public Transaction {
-    Local_Transaction();
+    explicit Local_Transaction(Domain & domain = default_domain);
 
     ~Local_Transaction();
 
@@ -78,6 +209,91 @@ struct Local_Transaction : public In_Out_Critical, public Transaction {
 };
 
 
+
+
+/*****************************************************************************/
+/* MULTI_DOMAIN_TRANSACTION                                                  */
+/*****************************************************************************/
+
+/** A transaction that spans several domains, and commits atomically in all
+    of them with a two phase commit.  With the commit lock of every domain
+    held, each domain's sandbox is prepared (setup() on each object); only
+    once all of them have succeeded are they published (commit() on each
+    object).  If any of them fails, those that were prepared are rolled
+    back and nothing is committed anywhere.
+
+    The snapshots in the different domains are always (re)registered with
+    all of the commit locks held, so that they form a consistent cut: a
+    multi-domain transaction sees either all or none of another
+    multi-domain commit.  A single domain transaction only sees its own
+    domain's part of the commit.
+
+    The first domain is handled by the transaction itself, and each of the
+    others by a participant transaction.  Versioned objects find the
+    right one through current_trans_for(); transactions in only one domain
+    never do any of this.
+*/
+
+struct Multi_Domain_Transaction : public Transaction {
+    Multi_Domain_Transaction(Domain & domain1, Domain & domain2,
+                             bool use_critical = true);
+
+    explicit Multi_Domain_Transaction(const std::vector<Domain *> & domains,
+                                      bool use_critical = true);
+
+    ~Multi_Domain_Transaction();
+
+    /** Commits in all of the domains at once.  Returns false if there was
+        a conflict in any of them, in which case nothing was committed and
+        the transaction was restarted in every domain. */
+    bool commit();
+
+    size_t num_domains() const { return participants.size() + 1; }
+
+private:
+    struct Participant;
+    std::vector<Participant *> participants;
+
+    /// The domains in the order in which their commit locks are taken
+    std::vector<Domain *> lock_order;
+
+    void init(const std::vector<Domain *> & domains);
+};
+
+
+/*****************************************************************************/
+/* LOCAL_MULTI_DOMAIN_TRANSACTION                                            */
+/*****************************************************************************/
+
+struct Local_Multi_Domain_Transaction
+    : public In_Out_Critical, public Multi_Domain_Transaction {
+
+    Local_Multi_Domain_Transaction(Domain & domain1, Domain & domain2);
+
+    explicit
+    Local_Multi_Domain_Transaction(const std::vector<Domain *> & domains);
+
+    ~Local_Multi_Domain_Transaction();
+
+    Transaction * old_trans;
+};
+
+
+/// Return the current transaction, checking that it can be used to access
+/// the given object.
+inline Transaction * current_trans_for(const Versioned_Object * obj,
+                                       Domain & domain)
+{
+    Transaction * trans = current_trans;
+    if (!trans) no_transaction_exception(obj);
+    if (JML_UNLIKELY(&trans->domain() != &domain)) {
+        trans = trans->for_domain(domain);
+        if (!trans) wrong_domain_exception(obj);
+    }
+    return trans;
+}
+
+
 } // namespace JMVCC
 
 #include "transaction_impl.h"
@@ -21,7 +21,8 @@ namespace JMVCC {
 
 inline
 Local_Transaction::
-Local_Transaction()
+Local_Transaction(Domain & domain)
+    : Transaction(domain, true /* use_critical */, Lazy())
 {
     old_trans = current_trans;
     current_trans = this;
@@ -34,6 +35,37 @@ Local_Transaction::
     current_trans = old_trans;
 }
 
+
+
+/*****************************************************************************/
+/* LOCAL_MULTI_DOMAIN_TRANSACTION                                            */
+/*****************************************************************************/
+
+inline
+Local_Multi_Domain_Transaction::
+Local_Multi_Domain_Transaction(Domain & domain1, Domain & domain2)
+    : Multi_Domain_Transaction(domain1, domain2)
+{
+    old_trans = current_trans;
+    current_trans = this;
+}
+
+inline
+Local_Multi_Domain_Transaction::
+Local_Multi_Domain_Transaction(const std::vector<Domain *> & domains)
+    : Multi_Domain_Transaction(domains)
+{
+    old_trans = current_trans;
+    current_trans = this;
+}
+
+inline
+Local_Multi_Domain_Transaction::
+~Local_Multi_Domain_Transaction()
+{
+    current_trans = old_trans;
+}
+
 } // namespace JMVCC
 
 #endif /*  __jmvcc__transaction_impl_h__ */
@@ -10,6 +10,8 @@
 
 #include "jml/utils/circular_buffer.h"
 #include "versioned_object.h"
+#include "node_pool.h"
+#include "spinlock.h"
 #include <ace/Synch.h>
 
 
@@ -30,11 +32,22 @@ using namespace std;
     For more complicated cases (for example, where a lot of the state
     can be shared between an old and a new version), the object should
     derive directly from Versioned_Object instead.
+
+    Reads take the object's lock for reading and commits take it for
+    writing.  With the default ACE_Mutex, readers of the same object
+    serialize; with RW_Spinlock (from spinlock.h) they don't block each
+    other, and only wait for a commit or cleanup that is changing the
+    history, which is quick.
+
+    The object starts on a cache line of its own (see JMVCC_PAD_OBJECTS),
+    with current and the lock at the front, so the line that readers of
+    this object need is only written by commits and reads of this object.
 */
 
-template<typename T>
-struct Versioned : public Versioned_Object {
-    typedef ACE_Mutex Mutex;
+template<typename T, typename Lock = ACE_Mutex>
+struct JMVCC_OBJECT_ALIGNED Versioned : public Versioned_Object {
+    typedef Lock Mutex;
+    typedef T value_type;
     
     explicit Versioned(const T & val = T())
     {
@@ -43,8 +56,17 @@ struct Versioned : public Versioned_Object {
         //valid_from = 0;
     }
 
+    explicit Versioned(Domain & domain, const T & val = T())
+        : Versioned_Object(domain)
+    {
+        Entry entry = new_entry(0, val);
+        current = entry.value;
+    }
+
     ~Versioned()
     {
+        forget_vacuum();
+
         Entry entry(0, current);
         cleanup_entry(entry);
         for (typename History::iterator
@@ -57,17 +79,18 @@ struct Versioned : public Versioned_Object {
     // Client interface.  Just two methods to get at the current value.
     T & mutate()
     {
-        if (!current_trans) no_transaction_exception(this);
-        T * local = current_trans->local_value<T>(this);
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        T * local = trans->local_value<T>(this);
 
         if (!local) {
             T value;
             {
-                ACE_Guard<Mutex> guard(lock);
+                ACE_Read_Guard<Mutex> guard(lock);
                 //history.validate();
-                value = value_at_epoch(current_trans->epoch());
+                value = value_at_epoch(trans->epoch());
             }
-            local = current_trans->local_value<T>(this, value);
+            local = trans->local_value<T>(this, value);
 
             if (!local)
                 throw Exception("mutate(): no local was created");
@@ -84,16 +107,18 @@ struct Versioned : public Versioned_Object {
     const T read() const
     {
         if (!current_trans) {
-            ACE_Guard<Mutex> guard(lock);
-            return value_at_epoch(get_current_epoch());
+            ACE_Read_Guard<Mutex> guard(lock);
+            return value_at_epoch(domain_->current_epoch());
         }
-        
-        const T * val = current_trans->local_value<T>(this);
+
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        const T * val = trans->local_value<T>(this);
         
         if (val) return *val;
      
-        ACE_Guard<Mutex> guard(lock);
-        return value_at_epoch(current_trans->epoch());
+        ACE_Read_Guard<Mutex> guard(lock);
+        return value_at_epoch(trans->epoch());
     }
 
     size_t history_size() const { return history.size(); }
@@ -117,9 +142,9 @@ private:
     typedef ML::Circular_Buffer<Entry> History;
 
     T * current;         ///< Current value
+    mutable Mutex lock;
     //Epoch valid_from;    ///< Equal to the valid_to of history.back()
     History history;     ///< History of older values with epoch
-    mutable Mutex lock;
 
     Epoch valid_from() const { return (history.empty() ? 1 : history.back().valid_to); }
 
@@ -184,16 +209,16 @@ private:
         allocator.deallocate(entry.value, 1);
     }
 
-    static std::allocator<T> allocator;
+    static Pool_Allocator<T> allocator;
 
 public:
     // Implement object interface
 
     virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
     {
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Write_Guard<Mutex> guard(lock);
 
-        if (new_epoch != get_current_epoch() + 1)
+        if (new_epoch != domain_->current_epoch() + 1)
             throw Exception("epochs out of order");
 
         if (valid_from() > old_epoch)
@@ -212,20 +237,25 @@ public:
 
     virtual void commit(Epoch new_epoch) throw ()
     {
+        if (domain_->snapshot_info.vacuum_mode()) {
+            domain_->snapshot_info.register_dirty(this);
+            return;
+        }
+
         // Now that it's definitive, we perform the following:
         // 1.  We cleanup the first value on the history list
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Write_Guard<Mutex> guard(lock);
 
         // Register the new history entry to be cleaned up
         Epoch valid_from = (history.size() > 1 ? history[-2].valid_to : 1);
-        snapshot_info.register_cleanup(this, valid_from);
+        domain_->snapshot_info.register_cleanup(this, valid_from);
     }
 
     Epoch fake_commit(Epoch new_epoch) throw ()
     {
         // Now that it's definitive, we perform the following:
         // 1.  We cleanup the first value on the history list
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Read_Guard<Mutex> guard(lock);
 
         // Register the new history entry to be cleaned up
         Epoch valid_from = (history.size() > 1 ? history[-2].valid_to : 1);
@@ -235,7 +265,7 @@ public:
     virtual void rollback(Epoch new_epoch, void * data) throw ()
     {
         // Reverse the setup
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Write_Guard<Mutex> guard(lock);
         Entry entry(0, current);
         cleanup_entry(entry);
         current = history.back().value;
@@ -245,7 +275,7 @@ public:
 
     virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch)
     {
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Write_Guard<Mutex> guard(lock);
 
         if (history.empty())
             throw Exception("cleaning up with no values");
@@ -278,16 +308,57 @@ public:
         dump_unlocked();
         cerr << "unused_valid_from = " << unused_valid_from << endl;
         cerr << "trigger_epoch = " << trigger_epoch << endl;
-        snapshot_info.dump();
+        domain_->snapshot_info.dump();
         cerr << "----------- end cleaning up didn't exist ---------" << endl;
         
         throw Exception("attempt to clean up something that didn't exist");
     }
     
+    virtual size_t vacuum(const std::vector<Epoch> & snapshots,
+                          Epoch keep_after)
+    {
+        ACE_Write_Guard<Mutex> guard(lock);
+
+        // Compact the history in place.  As in cleanup(), the version
+        // before one that goes takes over its epochs; if it was the
+        // oldest, the next one becomes the oldest.
+        std::vector<Epoch>::const_iterator
+            s = snapshots.begin(), send = snapshots.end();
+        Epoch valid_from = 0;
+        unsigned kept = 0;
+        for (unsigned i = 0;  i < history.size();  ++i) {
+            Entry entry = history[i];
+
+            // First snapshot that could see it
+            while (s != send && *s < valid_from) ++s;
+            valid_from = entry.valid_to;
+
+            if (entry.valid_to > keep_after
+                || (s != send && *s < entry.valid_to)) {
+                history[kept++] = entry;
+                continue;
+            }
+
+            cleanup_entry(entry);
+            if (kept) history[kept - 1].valid_to = entry.valid_to;
+        }
+
+        while (history.size() > kept)
+            history.pop_back();
+
+        return kept;
+    }
+
+    virtual Epoch latest_epoch() const
+    {
+        ACE_Read_Guard<Mutex> guard(lock);
+        return valid_from();
+    }
+
     virtual Epoch rename_epoch(Epoch old_valid_from,
                                Epoch new_valid_from) throw ()
     {
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Write_Guard<Mutex> guard(lock);
 
         if (history.empty())
             throw Exception("renaming with no values");
@@ -340,7 +411,7 @@ public:
 
     virtual void dump(std::ostream & stream = std::cerr, int indent = 0) const
     {
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Read_Guard<Mutex> guard(lock);
         dump_itl(stream, indent);
     }
 
@@ -379,7 +450,7 @@ public:
         
         for (unsigned i = 0;  i < history.size();  ++i) {
             Epoch e2 = history[i].valid_to;
-            if (e2 > get_current_epoch() + 1) {
+            if (e2 > domain_->current_epoch() + 1) {
                 using namespace std;
                 cerr << "e = " << e << " e2 = " << e2 << endl;
                 dump();
@@ -400,7 +471,8 @@ public:
     template<typename T2> friend class Versioned2;
 };
 
-template<typename T> std::allocator<T> Versioned<T>::allocator;
+template<typename T, typename Lock>
+Pool_Allocator<T> Versioned<T, Lock>::allocator;
 
 } // namespace JMVCC
 
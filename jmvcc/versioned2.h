@@ -30,10 +30,15 @@ namespace JMVCC {
     For more complicated cases (for example, where a lot of the state
     can be shared between an old and a new version), the object should
     derive directly from Versioned_Object instead.
+
+    Each object has a cache line to itself (see JMVCC_PAD_OBJECTS), which
+    holds the data pointer next to the read-only metadata; a commit to a
+    neighbouring object doesn't evict it from readers' caches.
 */
 
 template<typename T>
-struct Versioned2 : public Versioned_Object {
+struct JMVCC_OBJECT_ALIGNED Versioned2 : public Versioned_Object {
+    typedef T value_type;
 
     explicit Versioned2(const T & val = T())
     {
@@ -41,23 +46,31 @@ struct Versioned2 : public Versioned_Object {
         data = new_data(val, 1);
     }
 
+    explicit Versioned2(Domain & domain, const T & val = T())
+        : Versioned_Object(domain)
+    {
+        data = new_data(val, 1);
+    }
+
     ~Versioned2()
     {
+        forget_vacuum();
         delete_data(const_cast<Data *>(get_data()));
     }
 
     // Client interface.  Just two methods to get at the current value.
     T & mutate()
     {
-        if (!current_trans) no_transaction_exception(this);
-        T * local = current_trans->local_value<T>(this);
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        T * local = trans->local_value<T>(this);
 
         if (!local) {
             T value;
             {
-                value = get_data()->value_at_epoch(current_trans->epoch());
+                value = get_data()->value_at_epoch(trans->epoch());
             }
-            local = current_trans->local_value<T>(this, value);
+            local = trans->local_value<T>(this, value);
             
             if (!local)
                 throw Exception("mutate(): no local was created");
@@ -78,22 +91,60 @@ struct Versioned2 : public Versioned_Object {
             //T result = d->value_at_epoch(get_current_epoch());
             //return result;
         }
-        const T * val = current_trans->local_value<T>(this);
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        const T * val = trans->local_value<T>(this);
         
         if (val) return *val;
         
         const Data * d = get_data();
 
-        T result = d->value_at_epoch(current_trans->epoch());
+        T result = d->value_at_epoch(trans->epoch());
         return result;
     }
 
+    /** Return the newest committed value.  It doesn't need a transaction or
+        a snapshot, only a light critical section, so it's cheap enough for
+        monitoring reads of single values.  Inside a transaction it still
+        returns the newest committed value, not what the transaction sees
+        or has written.  T's copy constructor must not schedule cleanups.
+    */
+    const T read_latest() const
+    {
+        Light_Critical_Guard guard;
+
+        // The epoch has to be read first.  Versions that are being set up
+        // by a commit are labelled with a later epoch, so we never see one;
+        // the commit that publishes an epoch has already put its versions
+        // in place.
+        Epoch epoch = domain_->current_epoch();
+        __asm__ __volatile__ ("" : : : "memory");
+        return get_data()->value_at_epoch(epoch);
+    }
+
     size_t history_size() const
     {
-        size_t result = get_data()->size() - 1;
+        size_t result = get_data()->live_size() - 1;
         return result;
     }
 
+protected:
+    /** Like read(), but returns the value in place instead of a copy.  The
+        reference stays valid until the transaction is finished with, as old
+        data is only freed once we leave the critical section. */
+    const T & read_in_place() const
+    {
+        if (!current_trans)
+            throw Exception("reading outside a transaction");
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        const T * val = trans->local_value<T>(this);
+
+        if (val) return *val;
+
+        return get_data()->value_at_epoch(trans->epoch());
+    }
+
 private:
     // This structure provides a list of values.  Each one is tagged with the
     // earliest epoch in which it is valid.  The latest epoch in which it is
@@ -101,61 +152,126 @@ private:
     // latest epoch.
 
     struct Entry {
-        explicit Entry(Epoch valid_to = 1, const T & value = T())
-            : valid_to(valid_to), value(value)
+        explicit Entry(Epoch valid_to = 1, const T & value = T(),
+                       uint32_t id = 0)
+            : valid_to(valid_to), id(id), removed(0), value(value)
         {
         }
 
         Epoch valid_to;
+        uint32_t id;                ///< Identifies the version in copies
+        volatile uint32_t removed;  ///< Cleaned up; see cleanup()
         T value;
     };
 
-    // Internal data object allocated
+    /* Internal data object allocated.  It is replaced as a whole (copy on
+       write) by setup() and rename_epoch(), which hold the commit lock.
+       cleanup() runs without it, and instead of copying marks the entry
+       it removes as a tombstone in place.  The tombstones keep their
+       valid_to, so the versions around them keep their epochs, and no
+       reader can need them; readers skip them anyway, so that the version
+       before each one takes over its epochs.  They are dropped the next
+       time the data is copied; the copier seals the data first so that a
+       cleanup marking an entry at the same time knows to mark it again in
+       the copy, and unseals it if the copy fails.  The value of a tombstone
+       is released once nothing can be reading it, by a cleanup that holds
+       a reference to the data. */
     struct Data {
         Data(size_t capacity)
-            : capacity(capacity), first(0), last(0)
+            : capacity(capacity), first(0), last(0), next_id(1), sealed(0),
+              num_removed(0), refs(1)
         {
         }
 
+        /// Copy, leaving out the tombstones.  The version before each one
+        /// takes over its epochs.
         Data(size_t capacity, const Data & old_data)
-            : capacity(capacity), first(0), last(0)
+            : capacity(capacity), first(0), last(0),
+              next_id(old_data.next_id), sealed(0), num_removed(0), refs(1)
         {
-            for (unsigned i = 0;  i < old_data.size();  ++i)
-                push_back(old_data.element(i));
+            try {
+                for (unsigned i = old_data.first;  i < old_data.last;  ++i) {
+                    const Entry & entry = old_data.history[i];
+                    if (!entry.removed) push_back(entry);
+                    else if (last > 0)
+                        history[last - 1].valid_to = entry.valid_to;
+                }
+            } catch (...) {
+                // Our destructor won't be called; history[0] is a real
+                // member, and so is destroyed for us
+                for (unsigned i = 1;  i < last;  ++i)
+                    history[i].value.~T();
+                throw;
+            }
         }
 
         uint32_t capacity;   // Number allocated
         uint32_t first;      // Index of first valid entry
         uint32_t last;       // Index of last valid entry
+        uint32_t next_id;    // Id of the next version to be added
+        mutable volatile int sealed;     // Being copied; see cleanup()
+        volatile uint32_t num_removed;   // Number of tombstones
+        volatile int refs;               // Published, plus Clear_Removed
         Entry history[1];  // real ones are allocated after
 
+        /// Number of entries, including tombstones
         uint32_t size() const { return last - first; }
 
+        /// Number of versions that haven't been cleaned up
+        uint32_t live_size() const { return size() - num_removed; }
+
         ~Data()
         {
+            // history[0] is a real member, and so is destroyed for us
             size_t sz = size();
-            for (unsigned i = 0;  i < sz;  ++i)
+            for (unsigned i = 1;  i < sz;  ++i)
                 history[i].value.~T();
         }
 
         /// Return the value for the given epoch
         const T & value_at_epoch(Epoch epoch) const
         {
-            for (int i = last - 1;  i > first;  --i) {
-                Epoch valid_from = history[i - 1].valid_to;
-                if (epoch >= valid_from)
-                    return history[i].value;
+            // The newest version is never a tombstone, so we always find
+            // one.  The entry before a version has its valid_from, even if
+            // it's a tombstone.
+            const Entry * result = 0;
+            for (int i = last - 1;  i >= (int)first;  --i) {
+                const Entry & entry = history[i];
+                if (entry.removed) continue;
+                result = &entry;
+                if (i == (int)first || epoch >= history[i - 1].valid_to)
+                    break;
             }
-            
-            return history[first].value;
+
+            return result->value;
         }
         
+        /** Copy without the tombstones.  The copy must be published, or the
+            data unsealed and the copy freed if that fails. */
         Data * copy(size_t new_capacity) const
         {
             if (new_capacity < size())
                 throw Exception("new capacity is wrong");
 
-            return new_data(*this, new_capacity);
+            // Pairs with the barrier in cleanup(): either we see its
+            // tombstone, or it sees that we're copying
+            sealed = 1;
+            memory_barrier();
+
+            try {
+                return new_data(*this, new_capacity);
+            } catch (...) {
+                unseal();
+                throw;
+            }
+        }
+
+        /// Undo copy() when its copy won't be published.  A cleanup that
+        /// was waiting for it finds that we're still published.
+        void unseal() const
+        {
+            memory_barrier();
+            sealed = 0;
         }
 
         Entry & front()
@@ -173,7 +289,7 @@ private:
             if (size() < 2)
                 throw Exception("popping back last element");
             --last;
-            // Need to: make sure that garbage collection runs its destructor
+            history[last].value.~T();
         }
 
         void push_back(const Entry & entry)
@@ -186,6 +302,8 @@ private:
             }
             new (&history[last].value) T(entry.value);
             history[last].valid_to = entry.valid_to;
+            history[last].id = entry.id;
+            history[last].removed = 0;
             
             memory_barrier();
 
@@ -246,14 +364,59 @@ private:
 
         void operator () ()
         {
-            data->~Data();
-            free(data);
+            release_data(data);
         }
 
         Data * data;
         Epoch epoch;
     };
 
+    /// Releases the value of a tombstone
+    struct Clear_Removed {
+        Clear_Removed(Data * data, Entry * entry)
+            : data(data), entry(entry)
+        {
+        }
+
+        void operator () ()
+        {
+            entry->value = T();
+            release_data(data);
+        }
+
+        Data * data;
+        Entry * entry;
+    };
+
+    /// Make the entry a tombstone, unless it is already one
+    static void remove_entry(Data * d, Entry & entry)
+    {
+        if (!__sync_bool_compare_and_swap(&entry.removed, 0, 1)) return;
+        atomic_add(d->num_removed, 1);
+        atomic_add(d->refs, 1);
+        schedule_cleanup(Clear_Removed(d, &entry));
+    }
+
+    /** After marking tombstones in d, wait until it isn't being copied.
+        Returns false if a copy has replaced it, which may not have the
+        tombstones. */
+    bool still_published(Data * d) const
+    {
+        // Pairs with the barrier in copy(): either it sees our tombstones,
+        // or we see that it's copying
+        memory_barrier();
+        while (d->sealed && data == d)
+            sched_yield();
+        return data == d;
+    }
+
+    static void release_data(Data * data)
+    {
+        if (__sync_add_and_fetch(&data->refs, -1) != 0) return;
+        data->~Data();
+        pool_free(data);
+    }
+
     static void delete_data(Data * data)
     {
         schedule_cleanup(Delete_Data(data));
@@ -267,27 +430,36 @@ private:
 
     static Data * new_data(size_t capacity)
     {
-        // TODO: exception safety...
-        void * d = malloc(sizeof(Data) + capacity * sizeof(Entry));
-        Data * d2 = new (d) Data(capacity);
-        return d2;
+        void * d = pool_allocate(sizeof(Data) + capacity * sizeof(Entry));
+        try {
+            return new (d) Data(capacity);
+        } catch (...) {
+            pool_free(d);
+            throw;
+        }
     }
 
     static Data * new_data(const T & val, size_t capacity)
     {
-        // TODO: exception safety...
-        void * d = malloc(sizeof(Data) + capacity * sizeof(Entry));
-        Data * d2 = new (d) Data(capacity);
-        d2->push_back(Entry(1,  val));
+        Data * d2 = new_data(capacity);
+        try {
+            d2->push_back(Entry(1,  val));
+        } catch (...) {
+            delete_data_now(d2);
+            throw;
+        }
         return d2;
     }
 
     static Data * new_data(const Data & old, size_t capacity)
     {
-        // TODO: exception safety...
-        void * d = malloc(sizeof(Data) + capacity * sizeof(Entry));
-        Data * d2 = new (d) Data(capacity, old);
-        return d2;
+        void * d = pool_allocate(sizeof(Data) + capacity * sizeof(Entry));
+        try {
+            return new (d) Data(capacity, old);
+        } catch (...) {
+            pool_free(d);
+            throw;
+        }
     }
 
     bool set_data(const Data * & old_data, Data * new_data)
@@ -316,7 +488,7 @@ public:
         for (;;) {
             const Data * d = get_data();
 
-            if (new_epoch != get_current_epoch() + 1)
+            if (new_epoch != domain_->current_epoch() + 1)
                 throw Exception("epochs out of order");
             
             Epoch valid_from = 1;
@@ -327,9 +499,16 @@ public:
                 return false;  // something updated before us
             
             Data * new_data = d->copy(d->size() + 1);
-            new_data->back().valid_to = new_epoch;
-            new_data->push_back(Entry(1 /* valid_to */,
-                                      *reinterpret_cast<T *>(new_value)));
+            try {
+                new_data->back().valid_to = new_epoch;
+                new_data->push_back(Entry(1 /* valid_to */,
+                                          *reinterpret_cast<T *>(new_value),
+                                          new_data->next_id++));
+            } catch (...) {
+                d->unseal();
+                delete_data_now(new_data);
+                throw;
+            }
             
             if (set_data(d, new_data)) return true;
         }
@@ -337,6 +516,11 @@ public:
 
     virtual void commit(Epoch new_epoch) throw ()
     {
+        if (domain_->snapshot_info.vacuum_mode()) {
+            domain_->snapshot_info.register_dirty(this);
+            return;
+        }
+
         const Data * d = get_data();
 
         // Now that it's definitive, we have an older entry to clean up
@@ -344,159 +528,177 @@ public:
         if (d->size() > 2)
             valid_from = d->element(d->size() - 3).valid_to;
 
-        snapshot_info.register_cleanup(this, valid_from);
+        domain_->snapshot_info.register_cleanup(this, valid_from);
     }
 
     virtual void rollback(Epoch new_epoch, void * local_data) throw ()
     {
-#if 1
-        const Data * d = get_data();
-
-        for (;;) {
-            Data * d2 = d->copy(d->size());
-            d2->pop_back();
-            if (set_data(d, d2)) return;
-        }
-#else
-        Data * d;
-        do {
-            d = get_data();
-            d->pop_back();
-            d->back().valid_to = 1;  // probably unnecessary...
-            memory_barrier();
-        } while (d != data);
-#endif
+        // The version that setup() added can go in place.  Its epoch was
+        // never published, so no reader can want it, and everything that
+        // copies the data holds the commit lock, as we do.  The valid_to of
+        // the version before it stays at new_epoch, as a reader that loaded
+        // last before we popped may still compare against it.
+        data->pop_back();
     }
 
     virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch)
     {
-        const Data * d = get_data();
+        // What we marked, so that we can find it again in a copy
+        uint32_t marked_id = 0;
 
-        for (;;) {
+        for (bool again = false;  ;  again = true) {
+            Data * d = data;
 
-            if (d->size() < 2) {
+            if (!again && d->live_size() < 2) {
                 using namespace std;
                 cerr << "cleaning up: unused_valid_from = " << unused_valid_from
                      << " trigger_epoch = " << trigger_epoch << endl;
-                cerr << "current_epoch = " << get_current_epoch() << endl;
+                cerr << "current_epoch = " << domain_->current_epoch() << endl;
                 throw Exception("cleaning up with no values to clean up");
             }
-            
-            using namespace std;
-            //cerr << "cleaning up: unused_valid_from = " << unused_valid_from
-            //     << " trigger_epoch = " << trigger_epoch << endl;
-            
-            //dump_unlocked();
-            
-            //cerr << "not in first one" << endl;
-            
-            Data * data2 = new_data(d->size());
-            
-            // Copy them, skipping the one that matched
-            
-            // TODO: optimize
+
+            // Find the version that was valid from unused_valid_from.  The
+            // oldest one left stands for everything before its valid_to.
+            // When we're looking again in a copy, we go by its id, as the
+            // epochs around it may have changed; if the copy saw our
+            // tombstone, it's not there any more.
+            Entry * found = 0;
             Epoch valid_from = 1;
-            bool found = false;
-            for (unsigned i = d->first, e = d->last, j = 0; i != e;  ++i) {
-                //cerr << "i = " << i << " e = " << e << " j = " << j
-                //     << " element = " << d->history[i].value << " valid to "
-                //     << d->history[i].valid_to << " found = "
-                //     << found << " valid_from = " << valid_from << endl;
-                //cerr << "data2->size() = " << data2->size() << endl;
-                
-                if (valid_from == unused_valid_from
-                    || (i == d->first
-                        && unused_valid_from < d->front().valid_to)) {
-                    //cerr << "  removing" << endl;
+            bool oldest = true;
+            for (unsigned i = d->first, e = d->last;  i != e;  ++i) {
+                Entry & entry = d->history[i];
+                bool match;
+                if (entry.removed) match = false;
+                else if (again) match = entry.id == marked_id;
+                else match = valid_from == unused_valid_from
+                         || (oldest && unused_valid_from < entry.valid_to);
+
+                if (match) {
                     if (found)
                         throw Exception("two with the same valid_from value");
-                    found = true;
-                    if (j != 0)
-                        data2->history[j - 1].valid_to = d->history[i].valid_to;
-                }
-                else {
-                    // Copy element i to element j
-                    new (&data2->history[j].value) T(d->history[i].value);
-                    data2->history[j].valid_to = d->history[i].valid_to;
-                    ++j;
-                    ++data2->last;
+                    found = &entry;
                 }
-                
-                valid_from = d->history[i].valid_to;
+                if (!entry.removed) oldest = false;
+                valid_from = entry.valid_to;
             }
-            
-            if (found) {
-                if (d->size() != data2->size() + 1) {
-                    cerr << "d->size() = " << d->size() << endl;
-                    cerr << "data2->size() = " << data2->size() << endl;
-                    dump_unlocked();
-                    throw Exception("sizes were wrong");
-                }
-                
-                if (set_data(d, data2)) return;
-                continue;
+
+            if (!found && again) return;
+
+            if (!found) {
+                using namespace std;
+                static Lock lock;
+                Guard guard2(lock);
+                cerr << "----------- cleaning up didn't exist ---------" << endl;
+                dump_unlocked();
+                cerr << "unused_valid_from = " << unused_valid_from << endl;
+                cerr << "trigger_epoch = " << trigger_epoch << endl;
+                domain_->snapshot_info.dump();
+                cerr << "----------- end cleaning up didn't exist ---------" << endl;
+
+                throw Exception("attempt to clean up something that didn't exist");
             }
-            
-            static Lock lock;
-            Guard guard2(lock);
-            cerr << "----------- cleaning up didn't exist ---------" << endl;
-            dump_unlocked();
-            cerr << "unused_valid_from = " << unused_valid_from << endl;
-            cerr << "trigger_epoch = " << trigger_epoch << endl;
-            snapshot_info.dump();
-            cerr << "----------- end cleaning up didn't exist ---------" << endl;
-            
-            throw Exception("attempt to clean up something that didn't exist");
+
+            marked_id = found->id;
+            remove_entry(d, *found);
+
+            // If it was being copied, we mark the version again in the copy
+            if (still_published(d)) return;
         }
     }
-    
-    virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
-        throw ()
-    {
-        const Data * d = get_data();
 
+    virtual size_t vacuum(const std::vector<Epoch> & snapshots,
+                          Epoch keep_after)
+    {
         for (;;) {
-
-            int s = d->size();
-
-            if (d->first != 0)
-                throw Exception("can't work with first != 0");
-
-            if (s == 0)
-                throw Exception("renaming with no values");
-            
-            if (old_valid_from < d->history[0].valid_to) {
-                // The last one doesn't have a valid_from, so we assume that
-                // it's ok and leave it.
-                if (s == 2)
-                    return d->history[1].valid_to;
-                else return 0;
+            Data * d = data;
+
+            // Mark the versions that can go as tombstones, as cleanup()
+            // does.  The newest one, or the one that a commit is setting
+            // up, always stays.
+            std::vector<Epoch>::const_iterator
+                s = snapshots.begin(), send = snapshots.end();
+            Epoch valid_from = 0;
+            for (unsigned i = d->first, e = d->last - 1;  i < e;  ++i) {
+                Entry & entry = d->history[i];
+
+                // First snapshot that could see it
+                while (s != send && *s < valid_from) ++s;
+                valid_from = entry.valid_to;
+
+                if (entry.removed || entry.valid_to > keep_after
+                    || (s != send && *s < entry.valid_to))
+                    continue;
+
+                remove_entry(d, entry);
             }
 
-            // This is subtle.  Since we have valid_to values stored and not
-            // valid_from values, we need to find the particular one and change
-            // it.
-            
-            // TODO: maybe we could modify in place???
-            Data * d2 = new_data(*d, d->capacity);
-
-            // TODO: optimize
-            int result = 0;
-            bool found = false;
-            for (unsigned i = 0;  i != s;  ++i) {
-                if (d2->history[i].valid_to != old_valid_from) continue;
-                d2->history[i].valid_to = new_valid_from;
-                found = true;
-                if (i == s - 3)
-                    result = d2->history[s - 2].valid_to;
-                break;
-            }
+            // If it was being copied, we do it again on the copy
+            if (still_published(d)) return d->live_size() - 1;
+        }
+    }
+    
+    virtual Epoch latest_epoch() const
+    {
+        const Data * d = get_data();
+        if (d->size() > 1)
+            return d->element(d->size() - 2).valid_to;
+        return 1;
+    }
 
-            if (!found)
-                throw Exception("not found");
+    virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
+        throw ()
+    {
+        /* We're called with the commit lock held, so nothing copies the data
+           or adds to it while we're here; cleanups can still mark
+           tombstones, but they don't touch the epochs.  We rename in place:
+           it changes one epoch in one go, as publishing a copy would, but
+           without allocating.
+
+           The positions that matter are those of the live versions.  The
+           epoch after each one is the valid_to of the last tombstone that
+           follows it, if any, so that's the one that gets renamed; leading
+           tombstones have no epochs at all.
+        */
+        Data * d = data;
+
+        if (d->first != 0)
+            throw Exception("can't work with first != 0");
+
+        int s = d->live_size();
+        if (s == 0)
+            throw Exception("renaming with no values");
+
+        unsigned i = d->first, e = d->last;
+        while (i < e && d->history[i].removed) ++i;
+
+        unsigned first_end = i;
+        while (first_end + 1 < e && d->history[first_end + 1].removed)
+            ++first_end;
+
+        if (old_valid_from < d->history[first_end].valid_to) {
+            // The last one doesn't have a valid_from, so we assume that
+            // it's ok and leave it.
+            if (s == 2) return d->back().valid_to;
+            return 0;
+        }
 
-            if (set_data(d, d2)) return result;
+        // This is subtle.  Since we have valid_to values stored and not
+        // valid_from values, we need to find the particular one and change
+        // it.
+        int after = s;  // live versions after the current one
+        for (;  i != e;  ++i) {
+            Entry & entry = d->history[i];
+            if (!entry.removed) --after;
+            if (entry.valid_to != old_valid_from) continue;
+            entry.valid_to = new_valid_from;
+
+            // The newest is never a tombstone, so the entry before it has
+            // its valid_from
+            if (after == 2) return d->history[e - 2].valid_to;
+            return 0;
         }
+
+        throw Exception("not found");
     }
 
     virtual void dump(std::ostream & stream = std::cerr, int indent = 0) const
@@ -525,6 +727,7 @@ public:
                    << entry.valid_to;
             stream << " addr " << &entry.value;
             stream << " value " << entry.value;
+            if (entry.removed) stream << " (removed)";
             stream << endl;
         }
     }
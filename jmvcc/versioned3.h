@@ -0,0 +1,418 @@
+/* versioned3.h                                                    -*- C++ -*-
+   Jeremy Barnes, 3 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Turns a normal object into a versioned one, with its versions in a
+   chain from the newest to the oldest.
+*/
+
+#ifndef __jmvcc__versioned3_h__
+#define __jmvcc__versioned3_h__
+
+#include <iostream>
+#include <algorithm>
+#include "versioned_object.h"
+#include "snapshot.h"
+#include "transaction.h"
+#include "node_pool.h"
+#include "spinlock.h"
+#include "garbage.h"
+#include "jml/arch/cmp_xchg.h"
+#include "jml/arch/atomic_ops.h"
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* VERSIONED3                                                                */
+/*****************************************************************************/
+
+/** This template takes an underlying type and turns it into a versioned
+    object, like Versioned and Versioned2, but keeps its versions in a
+    chain of nodes.  The object points to the newest version, and each
+    version points to the next older one and knows the epoch from which
+    it is valid; it is valid until the epoch of the version before it in
+    the chain.  The oldest version stands for all epochs before that.
+
+    Nothing is ever copied or moved when the history changes.  A commit
+    puts its version on the front with a single compare and swap; readers
+    at a recent epoch stop at the first node.  Old versions are unlinked
+    where they are, and the nodes freed once nothing can be reading them.
+
+    Readers don't take any lock.  Cleanups take a spinlock in the object,
+    only against each other; commits are already serialized by the
+    domain's commit lock.  Outside a transaction, read() gives the newest
+    committed value.
+*/
+
+template<typename T>
+struct JMVCC_OBJECT_ALIGNED Versioned3 : public Versioned_Object {
+    typedef T value_type;
+
+    explicit Versioned3(const T & val = T())
+        : newest(new_node(val, 1, 0))
+    {
+    }
+
+    explicit Versioned3(Domain & domain, const T & val = T())
+        : Versioned_Object(domain), newest(new_node(val, 1, 0))
+    {
+    }
+
+    ~Versioned3()
+    {
+        forget_vacuum();
+        schedule_cleanup(Free_Chain(newest));
+    }
+
+    // Client interface.  Just two methods to get at the current value.
+    T & mutate()
+    {
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        T * local = trans->local_value<T>(this);
+
+        if (!local) {
+            T value = value_at_epoch(trans->epoch());
+            local = trans->local_value<T>(this, value);
+
+            if (!local)
+                throw Exception("mutate(): no local was created");
+        }
+
+        return *local;
+    }
+
+    void write(const T & val)
+    {
+        mutate() = val;
+    }
+
+    /** Outside a transaction, returns the newest committed value, under a
+        light critical section; T's copy constructor must not schedule
+        cleanups. */
+    const T read() const
+    {
+        if (!current_trans) {
+            Light_Critical_Guard guard;
+
+            // A version being set up by a commit is labelled with a later
+            // epoch than the one we read, so we skip it
+            Epoch epoch = domain_->current_epoch();
+            __asm__ __volatile__ ("" : : : "memory");
+            return value_at_epoch(epoch);
+        }
+
+        Transaction * trans = current_trans_for(this, *domain_);
+        trans->record_read(this);
+        const T * val = trans->local_value<T>(this);
+
+        if (val) return *val;
+
+        return value_at_epoch(trans->epoch());
+    }
+
+    size_t history_size() const
+    {
+        size_t result = 0;
+        for (const Node * node = newest->next;  node;  node = node->next)
+            ++result;
+        return result;
+    }
+
+private:
+    struct Node {
+        Node(const T & value, Epoch valid_from, Node * next)
+            : value(value), valid_from(valid_from), next(next)
+        {
+        }
+
+        T value;
+        volatile Epoch valid_from;  ///< Changed in place by rename_epoch()
+        Node * volatile next;       ///< Next older version
+    };
+
+    /// Newest version; during a commit, the one being set up
+    Node * volatile newest;
+
+    /// Taken by cleanup(), vacuum() and rename_epoch() while they unlink or
+    /// change versions
+    mutable Spinlock lock;
+
+    const T & value_at_epoch(Epoch epoch) const
+    {
+        const Node * node = newest;
+        for (;;) {
+            const Node * next = node->next;
+            if (epoch >= node->valid_from || !next) return node->value;
+            node = next;
+        }
+    }
+
+    /** Find the version that is valid from the given epoch, and the one
+        that is newer than it (null for the newest).  The oldest version
+        stands for any epoch before the next one. */
+    Node * find(Epoch valid_from, Node * & newer) const
+    {
+        newer = 0;
+        for (Node * node = newest;  node;  newer = node, node = node->next) {
+            if (node->valid_from == valid_from
+                || (!node->next && newer && valid_from < newer->valid_from))
+                return node;
+        }
+        return 0;
+    }
+
+    static Node * new_node(const T & value, Epoch valid_from, Node * next)
+    {
+        void * mem = pool_allocate(sizeof(Node));
+        try {
+            return new (mem) Node(value, valid_from, next);
+        } catch (...) {
+            pool_free(mem);
+            throw;
+        }
+    }
+
+    static void free_node(Node * node)
+    {
+        node->~Node();
+        pool_free(node);
+    }
+
+    struct Free_Node {
+        Free_Node(Node * node)
+            : node(node)
+        {
+        }
+
+        void operator () ()
+        {
+            free_node(node);
+        }
+
+        Node * node;
+    };
+
+    /// Frees a node and everything older than it
+    struct Free_Chain {
+        Free_Chain(Node * node)
+            : node(node)
+        {
+        }
+
+        void operator () ()
+        {
+            while (node) {
+                Node * next = node->next;
+                free_node(node);
+                node = next;
+            }
+        }
+
+        Node * node;
+    };
+
+    /// Frees nodes that were unlinked from different places in the chain
+    struct Free_Nodes {
+        Free_Nodes(const std::vector<Node *> & nodes)
+            : nodes(nodes)
+        {
+        }
+
+        void operator () ()
+        {
+            for (unsigned i = 0;  i < nodes.size();  ++i)
+                free_node(nodes[i]);
+        }
+
+        std::vector<Node *> nodes;
+    };
+
+public:
+    // Implement object interface
+
+    virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
+    {
+        if (new_epoch != domain_->current_epoch() + 1)
+            throw Exception("epochs out of order");
+
+        for (;;) {
+            Node * old_newest = newest;
+
+            if (old_newest->valid_from > old_epoch)
+                return false;  // something updated before us
+
+            // Readers skip it until new_epoch is published
+            Node * node = new_node(*reinterpret_cast<T *>(new_value),
+                                   new_epoch, old_newest);
+            if (cmp_xchg(const_cast<Node * &>(newest), old_newest, node))
+                return true;
+            free_node(node);
+        }
+    }
+
+    virtual void commit(Epoch new_epoch) throw ()
+    {
+        if (domain_->snapshot_info.vacuum_mode()) {
+            domain_->snapshot_info.register_dirty(this);
+            return;
+        }
+
+        // Now that it's definitive, we have an older version to clean up
+        domain_->snapshot_info.register_cleanup(this,
+                                                newest->next->valid_from);
+    }
+
+    virtual void rollback(Epoch new_epoch, void * local_data) throw ()
+    {
+        // Its epoch was never published, so readers skipped it, but they
+        // may still be looking at it
+        Node * node = newest;
+        newest = node->next;
+        schedule_cleanup(Free_Node(node));
+    }
+
+    virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch)
+    {
+        Node * node;
+        {
+            ACE_Guard<Spinlock> guard(lock);
+
+            Node * newer;
+            node = find(unused_valid_from, newer);
+
+            if (!node || !newer) {
+                using namespace std;
+                cerr << "----------- cleaning up didn't exist ---------" << endl;
+                dump_unlocked();
+                cerr << "unused_valid_from = " << unused_valid_from << endl;
+                cerr << "trigger_epoch = " << trigger_epoch << endl;
+                domain_->snapshot_info.dump();
+                cerr << "----------- end cleaning up didn't exist ---------"
+                     << endl;
+
+                throw Exception("attempt to clean up something that didn't "
+                                "exist");
+            }
+
+            // The older version now goes up to the newer one's epoch.  The
+            // node keeps its link, for readers that are on it.
+            newer->next = node->next;
+        }
+
+        schedule_cleanup(Free_Node(node));
+    }
+
+    virtual size_t vacuum(const std::vector<Epoch> & snapshots,
+                          Epoch keep_after)
+    {
+        std::vector<Node *> unlinked;
+        size_t kept = 0;
+        {
+            ACE_Guard<Spinlock> guard(lock);
+
+            // The newest one, or the one being set up, always stays
+            Node * last_kept = newest;
+            for (Node * node = last_kept->next;  node;  node = node->next) {
+                Epoch valid_to = last_kept->valid_from;
+                Epoch valid_from = node->next ? node->valid_from : 0;
+
+                // First snapshot that could see it
+                std::vector<Epoch>::const_iterator s
+                    = std::lower_bound(snapshots.begin(), snapshots.end(),
+                                       valid_from);
+
+                if (valid_to > keep_after
+                    || (s != snapshots.end() && *s < valid_to)) {
+                    last_kept = node;
+                    ++kept;
+                    continue;
+                }
+
+                last_kept->next = node->next;
+                unlinked.push_back(node);
+            }
+        }
+
+        if (!unlinked.empty())
+            schedule_cleanup(Free_Nodes(unlinked));
+
+        return kept;
+    }
+
+    virtual Epoch latest_epoch() const
+    {
+        return newest->valid_from;
+    }
+
+    virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
+        throw ()
+    {
+        ACE_Guard<Spinlock> guard(lock);
+
+        Node * newer;
+        Node * node = find(old_valid_from, newer);
+
+        if (!node) {
+            using namespace std;
+            cerr << "---------------------" << endl;
+            cerr << "old_epoch = " << old_valid_from << endl;
+            cerr << "new_epoch = " << new_valid_from << endl;
+            dump_unlocked();
+            throw Exception("attempt to rename something that didn't exist");
+        }
+
+        // As for the others, the ordering of the versions doesn't change,
+        // so a reader sees the same version whichever value it reads
+        if (node->next && node->next->valid_from >= new_valid_from)
+            throw Exception("new valid_from not ordered with respect to old");
+        if (newer && newer->valid_from <= new_valid_from)
+            throw Exception("new valid_from not ordered with respect to "
+                            "old 2");
+
+        node->valid_from = new_valid_from;
+
+        // The newest isn't on a cleanup list, so tell the caller about it
+        if (newer && newer == newest) return newer->valid_from;
+        return 0;
+    }
+
+    virtual void dump(std::ostream & stream = std::cerr, int indent = 0) const
+    {
+        dump_itl(stream, indent);
+    }
+
+    virtual void dump_unlocked(std::ostream & stream = std::cerr,
+                               int indent = 0) const
+    {
+        dump_itl(stream, indent);
+    }
+
+    void dump_itl(std::ostream & stream, int indent = 0) const
+    {
+        using namespace std;
+        std::string s(indent, ' ');
+        stream << s << "object at " << this << std::endl;
+        stream << s << "history with " << history_size() + 1
+               << " values, newest first" << endl;
+        int i = 0;
+        for (const Node * node = newest;  node;  node = node->next, ++i) {
+            stream << s << "  " << i << ": valid from " << node->valid_from;
+            stream << " addr " << node;
+            stream << " value " << node->value;
+            stream << endl;
+        }
+    }
+
+    virtual std::string print_local_value(void * val) const
+    {
+        return ostream_format(*reinterpret_cast<T *>(val));
+    }
+};
+
+} // namespace JMVCC
+
+
+#endif /* __jmvcc__versioned3_h__ */
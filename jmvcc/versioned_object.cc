@@ -6,6 +6,8 @@
 */
 
 #include "versioned_object.h"
+#include "snapshot.h"
+#include "aggregate.h"
 #include "jml/utils/string_functions.h"
 
 using namespace std;
@@ -16,6 +18,51 @@ using namespace std;
 
 namespace JMVCC {
 
+Versioned_Object::
+~Versioned_Object()
+{
+    // Too late for a vacuum in progress, as the derived class has gone, but
+    // it still needs to come off the list
+    forget_vacuum();
+
+    // Likewise, an aggregate must stop counting us.  It only needs our
+    // address to do so, and only marks us to be taken out later.
+    if (JML_UNLIKELY(num_aggregates_))
+        forget_aggregates();
+}
+
+void
+Versioned_Object::
+forget_aggregates()
+{
+    ACE_Guard<ACE_Mutex> guard(domain_->commit_lock);
+
+    const std::vector<Aggregate_Base *> & aggregates = domain_->aggregates;
+    for (unsigned i = 0;  i < aggregates.size() && num_aggregates_;  ++i)
+        aggregates[i]->forget(this);
+}
+
+void
+Versioned_Object::
+forget_vacuum_slow()
+{
+    domain_->snapshot_info.forget_dirty(this);
+}
+
+size_t
+Versioned_Object::
+vacuum(const std::vector<Epoch> & snapshots, Epoch keep_after)
+{
+    throw ML::Exception("object doesn't support vacuum mode");
+}
+
+Epoch
+Versioned_Object::
+latest_epoch() const
+{
+    return domain_->current_epoch();
+}
+
 void
 Versioned_Object::
 dump(std::ostream & stream, int indent) const
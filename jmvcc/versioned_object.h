@@ -10,6 +10,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include "jmvcc_defs.h"
 
 
@@ -21,10 +22,20 @@ namespace JMVCC {
 /*****************************************************************************/
 
 /// This is an actual object.  Contains metadata and value history of an
-/// object.
+/// object.  Each object belongs to a single domain, whose epochs are used
+/// to label its versions.
 
 struct Versioned_Object {
 
+    explicit Versioned_Object(Domain & domain = default_domain)
+        : domain_(&domain), vacuum_state_(0), num_aggregates_(0)
+    {
+    }
+
+    virtual ~Versioned_Object();
+
+    Domain & domain() const { return *domain_; }
+
     // Get the commit ready and check that everything can go ahead, but
     // don't actually perform the commit
     virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data) = 0;
@@ -38,17 +49,66 @@ struct Versioned_Object {
     // Clean up an unused version
     virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch) = 0;
     
+    // Clean up all of the old versions that none of the given snapshot
+    // epochs (in order) can see, apart from those still valid after
+    // keep_after.  Used in vacuum mode instead of cleanup().  Returns the
+    // number of old versions left.  Only objects that implement it may
+    // call Snapshot_Info::register_dirty(), and their destructors must
+    // call forget_vacuum().
+    virtual size_t vacuum(const std::vector<Epoch> & snapshots,
+                          Epoch keep_after);
+
     // Rename an epoch to a different number.  Returns the valid_from value
     // of the next epoch in the set.
     virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
         throw () = 0;
 
+    // Return the epoch from which the latest committed version is valid,
+    // for telling if the object has changed since a snapshot was taken.
+    // Must be called with the domain's commit lock held.  The default
+    // says that it changed in the current epoch.
+    virtual Epoch latest_epoch() const;
+
     virtual void dump(std::ostream & stream = std::cerr, int indent = 0) const;
 
     virtual void dump_unlocked(std::ostream & stream = std::cerr,
                                int indent = 0) const;
 
     virtual std::string print_local_value(void * val) const;
+
+protected:
+    Domain * domain_;  ///< Domain that the object's epochs belong to
+
+    // Take the object off the domain's list of objects to vacuum, waiting
+    // for any vacuum of it in progress to finish.  Must be called first
+    // thing by the destructor of a class that implements vacuum(), while
+    // the object is still whole.
+    void forget_vacuum()
+    {
+        if (vacuum_state_) forget_vacuum_slow();
+    }
+
+private:
+    friend class Snapshot_Info;
+    friend class Aggregate_Base;
+
+    enum {
+        VACUUM_DIRTY = 1,  ///< On the domain's list of objects to vacuum
+        VACUUM_PIN = 2     ///< Added for each vacuum in progress
+    };
+
+    /// Both in one word, so that one read tells if there is anything to
+    /// wait for.  Changed with the domain's dirty lock held.
+    volatile int vacuum_state_;
+
+    void forget_vacuum_slow();
+
+    /// Number of aggregates that we're a member of.  Changed with the
+    /// domain's commit lock held.
+    volatile int num_aggregates_;
+
+    /// Take the object out of the aggregates that it's still a member of
+    void forget_aggregates();
 };
 
 
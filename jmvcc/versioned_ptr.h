@@ -0,0 +1,99 @@
+/* versioned_ptr.h                                                 -*- C++ -*-
+   Jeremy Barnes, 28 January 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Versioned pointer to an immutable object graph.
+*/
+
+#ifndef __jmvcc__versioned_ptr_h__
+#define __jmvcc__versioned_ptr_h__
+
+#include "transaction.h"
+#include "versioned2.h"
+#include <boost/shared_ptr.hpp>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* VERSIONED_PTR                                                             */
+/*****************************************************************************/
+
+/** Pointer to the root of an immutable object graph, such as a tree of
+    configuration, that is replaced as a whole on each update.  Nodes are
+    never modified once published; an update builds a new root, sharing
+    whatever subtrees didn't change with the old one.
+
+    Unlike RCU, each version of the pointer is tagged with an epoch, so a
+    transaction sees the graph that was current in its snapshot.  Each
+    version holds a reference to its root.  Once no snapshot can see a
+    version it is dropped, and the nodes that nothing else refers to are
+    freed; this happens through schedule_cleanup(), so the nodes outlive
+    any critical section that could still be reading them.
+
+    read() returns the root directly, without copying the handle, so a read
+    costs no more than reading a pointer.  The result stays valid until the
+    transaction is finished with.
+*/
+
+template<typename T>
+struct Versioned_Ptr : public Versioned2<boost::shared_ptr<const T> > {
+
+    typedef boost::shared_ptr<const T> Node_Ptr;
+    typedef Versioned2<Node_Ptr> Base;
+
+    explicit Versioned_Ptr(const Node_Ptr & root = Node_Ptr())
+        : Base(root)
+    {
+    }
+
+    explicit Versioned_Ptr(Domain & domain, const Node_Ptr & root = Node_Ptr())
+        : Base(domain, root)
+    {
+    }
+
+    /// Root in the current transaction's snapshot, or zero if there is none
+    const T * read() const
+    {
+        return this->read_in_place().get();
+    }
+
+    const T * operator -> () const
+    {
+        return read();
+    }
+
+    const T & operator * () const
+    {
+        return *read();
+    }
+
+    /** Handle to the root, for building a new graph that shares parts of
+        the current one. */
+    Node_Ptr read_node() const
+    {
+        return this->read_in_place();
+    }
+
+    /// Replace the whole graph in the current transaction
+    void write(const Node_Ptr & root)
+    {
+        Base::write(root);
+    }
+
+    /// Replace the whole graph with a newly allocated root, taking
+    /// ownership of it
+    void write(const T * root)
+    {
+        Base::write(Node_Ptr(root));
+    }
+
+private:
+    // The graph can't be modified in place
+    using Base::mutate;
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__versioned_ptr_h__ */
@@ -0,0 +1,42 @@
+/* versioned_striped.cc
+   Jeremy Barnes, 5 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Support for striped versioned values.
+*/
+
+#include "versioned_striped.h"
+#include <unistd.h>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* STRIPING_POLICY                                                           */
+/*****************************************************************************/
+
+Striping_Policy::
+Striping_Policy()
+    : min_stripes(1), window(256), grow_above(0.05), shrink_below(0.005)
+{
+    // More stripes than can be written at once don't help
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    max_stripes = std::max(1L, std::min(cpus, 64L));
+}
+
+namespace {
+
+volatile unsigned num_stripe_threads = 0;
+__thread unsigned t_stripe_index = 0;  ///< Index plus one; zero if none yet
+
+} // file scope
+
+unsigned stripe_thread_index()
+{
+    if (JML_UNLIKELY(!t_stripe_index))
+        t_stripe_index = __sync_add_and_fetch(&num_stripe_threads, 1);
+    return t_stripe_index - 1;
+}
+
+} // namespace JMVCC
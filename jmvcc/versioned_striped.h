@@ -0,0 +1,250 @@
+/* versioned_striped.h                                             -*- C++ -*-
+   Jeremy Barnes, 5 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   A versioned value that is split into stripes, so that the transactions
+   that update it don't conflict with each other.
+*/
+
+#ifndef __jmvcc__versioned_striped_h__
+#define __jmvcc__versioned_striped_h__
+
+#include "transaction.h"
+#include "versioned.h"
+#include "spinlock.h"
+#include "jml/arch/atomic_ops.h"
+#include <functional>
+#include <stdlib.h>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* STRIPING_POLICY                                                           */
+/*****************************************************************************/
+
+/** When a Versioned_Striped changes the number of stripes that it writes.
+    Every window commit attempts on its stripes, the fraction of them that
+    conflicted is looked at: above grow_above, the number is doubled, and
+    below shrink_below, it's halved, within min_stripes and max_stripes.
+    Setting min_stripes and max_stripes to the same number gives a fixed
+    number of stripes.
+*/
+
+struct Striping_Policy {
+    Striping_Policy();
+
+    unsigned min_stripes;   ///< Stripes written to start with
+    unsigned max_stripes;   ///< Default: the number of CPUs
+    unsigned window;        ///< Commit attempts between each look
+    double grow_above;      ///< Conflict rate above which we double
+    double shrink_below;    ///< Conflict rate below which we halve
+};
+
+/// Index of the current thread, for it to pick a stripe with.  Threads are
+/// numbered from zero in the order that they first ask.
+unsigned stripe_thread_index();
+
+
+/*****************************************************************************/
+/* VERSIONED_STRIPED                                                         */
+/*****************************************************************************/
+
+/** A value that is only ever updated by combining something into it, such
+    as a counter or a sum that every transaction adds to.  As a single
+    Versioned<T>, all of those transactions would conflict with each other.
+    Here, the value is split into stripes, each a Versioned<T> on a cache
+    line of its own; add() combines into the stripe of the current thread,
+    and read() combines all of the stripes at the transaction's epoch.
+    Combine must be associative and commutative, with T() as its identity.
+
+    The number of stripes that are written adapts to the conflicts seen by
+    the commits, according to the Striping_Policy.  Stripes are created as
+    they are needed, with the identity as their value, so they don't change
+    what any snapshot reads.  When the number goes down, the stripes that
+    are no longer written keep their values, and are still read; nothing
+    ever needs to be moved between stripes.
+
+    A transaction that reads the value depends on all of the stripes, but
+    only conflicts over the ones that it writes.
+*/
+
+template<typename T, typename Combine = std::plus<T> >
+struct Versioned_Striped : boost::noncopyable {
+    typedef T value_type;
+
+    explicit Versioned_Striped(const T & val = T())
+        : domain_(&default_domain)
+    {
+        init(val);
+    }
+
+    explicit Versioned_Striped(Domain & domain, const T & val = T())
+        : domain_(&domain)
+    {
+        init(val);
+    }
+
+    ~Versioned_Striped()
+    {
+        for (unsigned i = 0;  i < allocated;  ++i) {
+            stripes[i]->~Stripe();
+            free(stripes[i]);
+        }
+    }
+
+    /// Combine the given value into ours
+    void add(const T & val)
+    {
+        unsigned n = active;
+        Stripe & stripe = get_stripe(stripe_thread_index() % n);
+        T & value = stripe.mutate();
+        value = combine(value, val);
+    }
+
+    /// Value in the current transaction's snapshot, including its own adds
+    const T read() const
+    {
+        unsigned n = allocated;
+        __asm__ __volatile__ ("" : : : "memory");
+
+        T result = stripes[0]->read();
+        for (unsigned i = 1;  i < n;  ++i)
+            result = combine(result, stripes[i]->read());
+        return result;
+    }
+
+    void set_policy(const Striping_Policy & policy);
+    const Striping_Policy & policy() const { return policy_; }
+
+    /// Number of stripes that add() writes to
+    unsigned stripe_count() const { return active; }
+
+    /// Number of stripes that read() combines
+    unsigned allocated_stripes() const { return allocated; }
+
+    /// Old versions over all of the stripes
+    size_t history_size() const
+    {
+        size_t result = 0;
+        for (unsigned i = 0;  i < allocated;  ++i)
+            result += stripes[i]->history_size();
+        return result;
+    }
+
+    Domain & domain() const { return *domain_; }
+
+private:
+    enum { MAX_STRIPES = 64 };
+
+    /// A stripe tells us how its commits went
+    struct Stripe : public Versioned<T> {
+        Stripe(Domain & domain, const T & val, Versioned_Striped * owner)
+            : Versioned<T>(domain, val), owner(owner)
+        {
+        }
+
+        virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
+        {
+            bool result = Versioned<T>::setup(old_epoch, new_epoch, data);
+            owner->record_setup(result);
+            return result;
+        }
+
+        Versioned_Striped * owner;
+    };
+
+    Domain * domain_;
+    Combine combine;
+
+    Stripe * stripes[MAX_STRIPES];
+    volatile unsigned allocated;   ///< Stripes that exist
+    volatile unsigned active;      ///< Stripes that add() writes
+
+    /// Protects the creation of stripes
+    Spinlock lock;
+
+    /// Protected by the domain's commit lock, which all setups hold
+    Striping_Policy policy_;
+    unsigned attempts;
+    unsigned conflicts;
+
+    void init(const T & val)
+    {
+        allocated = 0;
+        active = 1;
+        attempts = conflicts = 0;
+        stripes[0] = new_stripe(val);
+        allocated = 1;
+        set_policy(Striping_Policy());
+    }
+
+    Stripe * new_stripe(const T & val)
+    {
+        void * mem;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(Stripe)))
+            throw Exception("couldn't allocate stripe");
+        try {
+            return new (mem) Stripe(*domain_, val, this);
+        } catch (...) {
+            free(mem);
+            throw;
+        }
+    }
+
+    Stripe & get_stripe(unsigned i)
+    {
+        if (JML_LIKELY(i < allocated)) return *stripes[i];
+
+        ACE_Guard<Spinlock> guard(lock);
+        while (allocated <= i) {
+            // A new stripe has the identity at every epoch, so readers can
+            // start combining it as soon as they see it
+            stripes[allocated] = new_stripe(T());
+            memory_barrier();
+            allocated = allocated + 1;
+        }
+        return *stripes[i];
+    }
+
+    void record_setup(bool succeeded)
+    {
+        ++attempts;
+        if (!succeeded) ++conflicts;
+        if (attempts < policy_.window) return;
+
+        double rate = (double)conflicts / attempts;
+        unsigned n = active;
+        if (rate > policy_.grow_above)
+            n = std::min(n * 2, policy_.max_stripes);
+        else if (rate < policy_.shrink_below)
+            n = std::max(n / 2, policy_.min_stripes);
+        active = n;
+
+        attempts = conflicts = 0;
+    }
+};
+
+template<typename T, typename Combine>
+void
+Versioned_Striped<T, Combine>::
+set_policy(const Striping_Policy & policy)
+{
+    if (policy.min_stripes < 1 || policy.min_stripes > policy.max_stripes
+        || policy.max_stripes > MAX_STRIPES)
+        throw Exception("Versioned_Striped: invalid number of stripes");
+    if (policy.window < 1)
+        throw Exception("Versioned_Striped: invalid window");
+
+    ACE_Guard<ACE_Mutex> guard(domain_->commit_lock);
+    policy_ = policy;
+    attempts = conflicts = 0;
+    active = std::max(policy.min_stripes,
+                      std::min(policy.max_stripes, (unsigned)active));
+}
+
+} // namespace JMVCC
+
+
+#endif /* __jmvcc__versioned_striped_h__ */